@@ -31,118 +31,277 @@
 #include "config.h"
 #include "mfm.h"
 
+/*
+ * Раздвигаем 16 битов на чётные позиции 32-битного слова:
+ * бит i переходит в бит 2*i. Без циклов, за четыре шага.
+ */
+unsigned mfm_spread(unsigned x)
+{
+    x &= 0xffff;
+    x = (x | x << 8) & 0x00ff00ff;
+    x = (x | x << 4) & 0x0f0f0f0f;
+    x = (x | x << 2) & 0x33333333;
+    x = (x | x << 1) & 0x55555555;
+    return x;
+}
+
+/*
+ * Обратное преобразование: чётные биты слова собираем
+ * в младшие 16 битов.
+ */
+unsigned mfm_gather(unsigned x)
+{
+    x &= 0x55555555;
+    x = (x | x >> 1) & 0x33333333;
+    x = (x | x >> 2) & 0x0f0f0f0f;
+    x = (x | x >> 4) & 0x00ff00ff;
+    x = (x | x >> 8) & 0x0000ffff;
+    return x;
+}
+
+/*
+ * Эталоны: по одному биту.
+ */
+unsigned mfm_spread_ref(unsigned x)
+{
+    unsigned y = 0;
+    int i;
+
+    for (i=0; i<16; ++i)
+        y |= (x >> i & 1) << (2*i);
+    return y;
+}
+
+unsigned mfm_gather_ref(unsigned x)
+{
+    unsigned y = 0;
+    int i;
+
+    for (i=0; i<16; ++i)
+        y |= (x >> (2*i) & 1) << i;
+    return y;
+}
+
 /*
  * Первый аргумент содержит нечётные биты 32-битного слова,
  * второй - чётные биты. Возвращаем значение исходного слова.
  */
 static unsigned long unshuffle(int odd, int even)
 {
-    unsigned long word;
+    return mfm_codec->spread(odd) << 1 | mfm_codec->spread(even);
+}
+
+/*
+ * Разбиваем слово на нечётные и чётные биты.
+ */
+static void shuffle(unsigned long word, int *odd, int *even)
+{
+    *odd = mfm_codec->gather(word >> 1);
+    *even = mfm_codec->gather(word);
+}
+
+/*
+ * 512-байтный блок: первая половина - нечётные биты, вторая
+ * половина - чётные. Данные и контрольную сумму получаем
+ * за один проход. Быстрый и эталонный варианты отличаются
+ * только функцией spread(), подставляемой при компиляции.
+ */
+static inline unsigned unshuffle_block(const unsigned char *raw,
+    unsigned char *data, unsigned (*spread)(unsigned))
+{
+    const unsigned char *podd = raw, *peven = raw + SECTSZ/2;
+    unsigned odd, even, word, sum;
     int i;
 
-    word = 0;
-    for (i=0; i<16; ++i) {
-        word <<= 2;
-        word |= (even >> 15 & 1) | (odd >> 14 & 2);
-        odd <<= 1;
-        even <<= 1;
+    sum = 0;
+    for (i=0; i<SECTSZ/4; ++i) {
+        odd = podd[0] << 8 | podd[1];
+        even = peven[0] << 8 | peven[1];
+        podd += 2;
+        peven += 2;
+        sum ^= odd ^ even;
+        word = spread(odd) << 1 | spread(even);
+        data[0] = word >> 24;
+        data[1] = word >> 16;
+        data[2] = word >> 8;
+        data[3] = word;
+        data += 4;
     }
-    return word;
+    return sum;
+}
+
+unsigned mfm_unshuffle(const unsigned char *raw, unsigned char *data)
+{
+    return unshuffle_block(raw, data, mfm_spread);
+}
+
+unsigned mfm_unshuffle_ref(const unsigned char *raw, unsigned char *data)
+{
+    return unshuffle_block(raw, data, mfm_spread_ref);
 }
 
 /*
- * Разбиваем слово на нечётные и чётные биты.
+ * Обратное преобразование блока, с контрольной суммой.
  */
-static void shuffle(unsigned long word, int *odd, int *even)
+static inline unsigned shuffle_block(const unsigned char *data,
+    unsigned char *raw, unsigned (*gather)(unsigned))
 {
+    unsigned char *podd = raw, *peven = raw + SECTSZ/2;
+    unsigned odd, even, word, sum;
     int i;
 
-    *odd = 0;
-    *even = 0;
-    for (i=0; i<16; i++) {
-        *odd <<= 1;
-        *even <<= 1;
-        *odd |= (word >> 31) & 1;
-        *even |= (word >> 30) & 1;
-        word <<= 2;
+    sum = 0;
+    for (i=0; i<SECTSZ/4; ++i) {
+        word = (unsigned) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+        data += 4;
+        odd = gather(word >> 1);
+        even = gather(word);
+        sum ^= odd ^ even;
+        podd[0] = odd >> 8;
+        podd[1] = odd;
+        peven[0] = even >> 8;
+        peven[1] = even;
+        podd += 2;
+        peven += 2;
     }
+    return sum;
+}
+
+unsigned mfm_shuffle(const unsigned char *data, unsigned char *raw)
+{
+    return shuffle_block(data, raw, mfm_gather);
+}
+
+unsigned mfm_shuffle_ref(const unsigned char *data, unsigned char *raw)
+{
+    return shuffle_block(data, raw, mfm_gather_ref);
 }
 
 /*
  * Поиск идентификатора сектора на дискете формата Amiga.
+ * Ждем маркер 00-a1-a1-fx.
  */
 int mfm_scan_amiga(mfm_reader_t *reader, int *nbits_read)
 {
-    int bit, tag;
-    unsigned long history;
+    const mfm_mark_t *m;
+    int end;
 
-    history = 0;
+    m = mfm_next_mark(reader, MFM_SYNC_AMIGA);
+    end = m ? m->halfbit : reader->nhalfbits;
     if (nbits_read)
-        *nbits_read = 0;
-    for (;;) {
-        bit = mfm_read_bit(reader);
-        if (bit < 0) {
-            if (mfm_verbose && nbits_read)
-                fprintf(mfm_err, "Track %d/%d: final gap %d bits\n",
-                    reader->track >> 1, reader->track & 1, *nbits_read);
-            return -1;
-        }
-        history = history << 1 | bit;
-        if (nbits_read)
-            ++*nbits_read;
-
-        if ((history & 0xffffffff) == 0xffffffff) {
-            /* Все единицы - подсинхронизовываемся на полубит. */
-            mfm_read_halfbit(reader);
-            history = 0;
-            continue;
-        }
-
-        /* Формат Amiga: ждем 00-a1-a1-fx. */
-        if ((history & 0xfffffff0) == 0x00a1a1f0) {
-            /* Нашли маркер, читаем и возвращаем его тег. */
-            tag = history & 0xff;
-            return tag;
-        }
+        *nbits_read = (end - reader->halfbit) / 2;
+    if (! m) {
+        reader->halfbit = end;
+        if (mfm_verbose && nbits_read)
+            fprintf(reader->err, "Track %d/%d: final gap %d bits\n",
+                reader->track >> 1, reader->track & 1, *nbits_read);
+        return -1;
     }
+
+    /* Нашли маркер, возвращаем его тег: последний байт маркера. */
+    reader->halfbit = end - 16;
+    return mfm_read_byte(reader);
 }
 
 /*
- * Определяем тип дискеты.
+ * Определяем тип дискеты по первому маркеру нулевой дорожки.
  * Возвращаем 0 для IBM PC или 1 для Amiga.
  */
-int mfm_detect_amiga(FILE *fin)
+int mfm_detect_amiga(mfm_track_index_t *idx, mfm_io_t *in)
 {
-    mfm_reader_t reader;
-    unsigned long history;
-    int bit;
+    mfm_index_seek(idx, in, 0);
+    return mfm_detect_amiga_track(idx);
+}
 
-    mfm_read_seek(&reader, fin, 0);
-    history = 0x13713713;
-    for (;;) {
-        bit = mfm_read_bit(&reader);
-        if (bit < 0)
-            return -1;
-        history = history << 1 | bit;
-        history &= 0xffffffff;
+/*
+ * То же для уже загруженной дорожки.
+ */
+int mfm_detect_amiga_track(mfm_track_index_t *idx)
+{
+    const mfm_mark_t *m;
+
+    idx->reader.halfbit = 0;
+    m = mfm_next_mark(&idx->reader,
+        MFM_SYNC_IBMPC | MFM_SYNC_INDEX | MFM_SYNC_AMIGA);
+    if (! m)
+        return -1;
+    return m->type == MFM_SYNC_AMIGA;
+}
 
-        /* Все единицы - подсинхронизовываемся на полубит. */
-        if (history == 0xffffffff) {
-            mfm_read_halfbit(&reader);
-            history = 0;
-            continue;
-        }
+/*
+ * Номер дорожки по первому сектору с верным заголовком,
+ * в формате IBM PC или Amiga. Возвращаем -1, если секторов нет.
+ */
+static int first_track(mfm_track_index_t *idx)
+{
+    int amiga = mfm_detect_amiga_track(idx);
+
+    if (amiga < 0)
+        return -1;
+    if (amiga)
+        mfm_index_amiga(idx);
+    else
+        mfm_index_ibmpc(idx);
+    if (idx->nsectors == 0)
+        return -1;
+    if (amiga)
+        return idx->sect[0].cylinder;
+    return idx->sect[0].cylinder * 2 + idx->sect[0].head;
+}
 
-        /* Формат IBM PC: ждем 00-a1-a1-a1 или 00-c2-c2-c2. */
-        if (history == 0x00a1a1a1 || history == 0x00c2c2c2) {
-            return 0;
-        }
+/*
+ * Длина дорожки MFM-файла из канала: размер файла неизвестен.
+ * Читаем вперёд три дорожки двойной плотности и смотрим,
+ * где начинаются сектора дорожки 1: через одну длину
+ * дорожки DD, через две (HD) или дальше (ED). Если по пробе
+ * понять нельзя, завершаемся с ошибкой: нужен ключ -D.
+ * Для обычного файла и при заданной плотности ничего не меняем.
+ */
+void mfm_detect_density(mfm_track_index_t *idx, mfm_io_t *in)
+{
+    const unsigned char *buf;
+    size_t nbytes;
+    int k, track, tracksz, stats = mfm_stats_on;
+
+    if (mfm_density || mfm_io_random(in))
+        return;
+    buf = mfm_io_peek(in, 3 * TRACKSZ, &nbytes);
+
+    if (nbytes == 0)
+        return;
+    if (nbytes >= 4 && memcmp(buf, "MFMZ", 4) == 0) {
+        /* Плотность тут ни при чём, см. raw_read(). */
+        fprintf(mfm_err, "Compact MFM file cannot be read "
+            "from a pipe, aborted.\n");
+        mfm_fail(MFM_ERR_ARG);
+    }
 
-        /* Формат Amiga: ждем 00-a1-a1-fx. */
-        if ((history & ~0xf) == 0x00a1a1f0) {
-            return 1;
+    /* Пробное чтение в статистику не входит. */
+    mfm_stats_on = 0;
+    tracksz = 0;
+    for (k=1; k<3 && (size_t) (k+1) * TRACKSZ <= nbytes; ++k) {
+        mfm_index_load(idx, buf + k * TRACKSZ, TRACKSZ, 0);
+        track = first_track(idx);
+        if (track < 0)
+            break;
+        if (track > 0) {
+            tracksz = k * TRACKSZ;
+            break;
         }
     }
+    if (k == 3)
+        tracksz = MFM_DENSITY_ED * TRACKSZ;
+    mfm_stats_on = stats;
+    idx->loaded = 0;
+
+    /* Нет секторов в пробном месте или мало данных:
+     * угадывать не берёмся, пусть плотность задаст пользователь. */
+    if (tracksz == 0) {
+        fprintf(mfm_err, "Cannot detect density of MFM data "
+            "from pipe, use -D option, aborted.\n");
+        mfm_fail(MFM_ERR_FORMAT);
+    }
+    in->tracksz = tracksz;
 }
 
 /*
@@ -167,50 +326,34 @@ static unsigned long read_long(mfm_reader_t *reader, unsigned long *sum)
  */
 static int read_data(mfm_reader_t *reader, unsigned char *data)
 {
-    unsigned long ldata;
-    int odd [128], even [128], sum, i;
+    unsigned char raw [SECTSZ];
+    unsigned sum;
+    int stage = mfm_stage(MFM_STAGE_DECODE);
 
-    /* Первая половина - нечётные биты. */
-    for (i=0; i<SECTSZ/4; ++i) {
-        odd[i] = mfm_read_byte(reader) << 8;
-        odd[i] |= mfm_read_byte(reader);
-    }
-    /* Вторая половина - чётные биты. */
-    for (i=0; i<SECTSZ/4; ++i) {
-        even[i] = mfm_read_byte(reader) << 8;
-        even[i] |= mfm_read_byte(reader);
-    }
-    /* Восстанавливаем данные. */
-    sum = 0;
-    for (i=0; i<SECTSZ/4; ++i) {
-        ldata = unshuffle(odd[i], even[i]);
-        sum ^= odd[i] ^ even[i];
-        *data++ = ldata >> 24;
-        *data++ = ldata >> 16;
-        *data++ = ldata >> 8;
-        *data++ = ldata;
-    }
+    mfm_read_bytes(reader, raw, SECTSZ);
+    sum = mfm_codec->unshuffle(raw, data);
+    mfm_stage(stage);
     return sum;
 }
 
 /*
  * Чтение очередного сектора с дискеты формата Amiga.
+ * Положение и параметры сектора запоминаем в sect.
  */
 int mfm_read_sector_amiga(mfm_reader_t *reader, unsigned char *data,
-    int *sector_gap)
+    mfm_sector_t *sect)
 {
     int tag, track, sector, odd, even, gap;
     unsigned long label[4], header_sum, data_sum;
     unsigned long my_header_sum, my_data_sum;
 
-    if (sector_gap)
-        *sector_gap = 0;
+    sect->sector_gap = 0;
     for (;;) {
         tag = mfm_scan_amiga(reader, &gap);
-        if (sector_gap)
-            *sector_gap += gap;
+        sect->sector_gap += gap;
         if (tag < 0)
             return -1;
+        sect->id_halfbit = reader->halfbit - 16;
         odd = (tag << 8) | mfm_read_byte(reader);
         even = mfm_read_byte(reader) << 8;
         even |= mfm_read_byte(reader);
@@ -225,253 +368,224 @@ int mfm_read_sector_amiga(mfm_reader_t *reader, unsigned char *data,
         label[2] = read_long(reader, &my_header_sum);
         label[3] = read_long(reader, &my_header_sum);
         if (mfm_verbose)
-            fprintf(mfm_err, "Track %d, sector %d: label %08lx:%08lx:%08lx:%08lx\n",
+            fprintf(reader->err, "Track %d, sector %d: label %08lx:%08lx:%08lx:%08lx\n",
                 track, sector, label[0], label[1], label[2], label[3]);
 
-        header_sum = mfm_read_byte(reader) << 24;
+        header_sum = (unsigned long) mfm_read_byte(reader) << 24;
         header_sum |= mfm_read_byte(reader) << 16;
         header_sum |= mfm_read_byte(reader) << 8;
         header_sum |= mfm_read_byte(reader);
         if (my_header_sum != header_sum) {
-            fprintf(mfm_err, "track %d sector %d: header sum %08lx, expected %08lx\n",
+            mfm_count(header_errors, 1);
+            fprintf(reader->err, "track %d sector %d: header sum %08lx, expected %08lx\n",
                 track, sector, my_header_sum, header_sum);
             return -1;
         }
         if (track != reader->track) {
-            fprintf(mfm_err, "track %d, sector %d: incorrect track number, expected %d\n",
+            fprintf(reader->err, "track %d, sector %d: incorrect track number, expected %d\n",
                 track, sector, reader->track);
         }
 
-        data_sum = mfm_read_byte(reader) << 24;
+        data_sum = (unsigned long) mfm_read_byte(reader) << 24;
         data_sum |= mfm_read_byte(reader) << 16;
         data_sum |= mfm_read_byte(reader) << 8;
         data_sum |= mfm_read_byte(reader);
 
+        sect->data_halfbit = reader->halfbit;
         my_data_sum = read_data(reader, data);
-        if (my_data_sum != data_sum)
-            fprintf(mfm_err, "track %d sector %d: data sum %08lx, expected %08lx\n",
+        sect->data_ok = (my_data_sum == data_sum);
+        if (! sect->data_ok) {
+            mfm_count(data_errors, 1);
+            fprintf(reader->err, "track %d sector %d: data sum %08lx, expected %08lx\n",
                 track, sector, my_data_sum, data_sum);
+        }
+        sect->sector = sector;
+        sect->cylinder = track;
+        sect->head = 0;
+        sect->size = 2;
+        sect->nbytes = SECTSZ;
+        sect->data_gap = 0;
         return sector;
     }
 }
 
 /*
- * Читаем дискету Amiga из MFM-файла. Количество дорожек (до 160)
- * задаётся параметром ntracks.
+ * Строим оглавление дорожки Amiga.
+ * Если оно уже построено, повторно дорожку не просматриваем.
  */
-void mfm_read_amiga(mfm_disk_t *d, FILE *fin, int ntracks)
+void mfm_index_amiga(mfm_track_index_t *idx)
 {
-    int t, s;
-    mfm_reader_t reader;
-    unsigned char block [SECTSZ];
-    int have_sector [MAXSECT];
-
-    d->ntracks = ntracks;
-    d->nsectors_per_track = 11;
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        for (;;) {
-            s = mfm_read_sector_amiga(&reader, block, 0);
-            if (s < 0)
-                break;
-            if (s >= d->nsectors_per_track) {
-                fprintf(mfm_err, "track %d: too large sector number %d\n",
-                    t, s);
-                continue;
-            }
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            memcpy(d->block[t][s], block, SECTSZ);
-        }
+    if (idx->format == MFM_SYNC_AMIGA)
+        return;
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            if (! have_sector [s])
-                fprintf(mfm_err, "track %d: no sector %d\n", t, s);
-        }
-    }
+    /* На сектор один маркер; на дорожке не меньше 11 секторов. */
+    mfm_index_build(idx, MFM_SYNC_AMIGA, mfm_read_sector_amiga, 1,
+        mfm_format_amiga.nsectors);
+}
+
+void mfm_read_amiga(mfm_disk_t *d, mfm_track_index_t *idx, mfm_io_t *in, int ntracks)
+{
+    mfm_read_format(&mfm_format_amiga, d, idx, in, ntracks, 0);
 }
 
 /*
- * Исследуем и печатаем информацию о дискете Amiga из MFM-файла.
- * Количество дорожек (до 160) задаётся параметром ntracks.
+ * Потоковое чтение: сектора каждой дорожки выводим в fout,
+ * не накапливая образ в памяти.
  */
-void mfm_analyze_amiga(FILE *fin, int ntracks)
+void mfm_read_amiga_stream(mfm_track_index_t *idx, mfm_io_t *in, FILE *fout)
 {
-    int t, s, i, nsectors_per_track;
-    mfm_reader_t reader;
-    unsigned char block [SECTSZ];
-    int have_sector [MAXSECT];
-    int order_of_sectors [MAXSECT];
-    int sector_gap [MAXSECT];
-
-    fprintf(mfm_err, "Format: Amiga\n");
-    for (t=0; t<ntracks; ++t) {
-        fprintf(mfm_err, "\n");
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        nsectors_per_track = 0;
-        for (i=0; ; ++i) {
-            s = mfm_read_sector_amiga(&reader, block, &sector_gap[i]);
-            if (s < 0)
-                break;
-            if (s >= MAXSECT) {
-                fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
-                    s+1);
-                exit(-1);
-            }
-            if (s >= nsectors_per_track)
-                nsectors_per_track = s + 1;
-
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            order_of_sectors [i] = s;
-        }
-        fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
-            t >> 1, t & 1, nsectors_per_track);
-        if (nsectors_per_track < 1)
-            continue;
+    mfm_disk_t d;
 
-        fprintf(mfm_err, "Order of sectors:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", order_of_sectors[s] + 1);
-        }
-        fprintf(mfm_err, "\n");
-
-        fprintf(mfm_err, "Sector gap:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", sector_gap[s] - 5*8);
-        }
-        fprintf(mfm_err, " bits (std %d)\n", 0);
+    memset(&d, 0, sizeof(d));
+    mfm_read_format(&mfm_format_amiga, &d, idx, in, MAXTRACK, fout);
+    mfm_disk_free(&d);
+}
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<nsectors_per_track; ++s) {
-            if (! have_sector [s])
-                fprintf(mfm_err, "No sector %d\n", s + 1);
-        }
-    }
+void mfm_analyze_amiga(mfm_track_index_t *idx, mfm_io_t *in, int ntracks)
+{
+    mfm_analyze_format(&mfm_format_amiga, idx, in, ntracks);
 }
 
+#define IDENTSZ         24      /* ident, label and checksum */
+#define BLOCKSZ         (4 + SECTSZ)    /* checksum and shuffled data */
+
 /*
- * Записываем маркер идентификатора, с нарушением правил MFM.
+ * Промежуток до маркера считается до его конца: в него входят
+ * 2 байта нулей, два байта A1 и тег.
  */
-static void write_marker(mfm_writer_t *writer)
-{
-    int i;
-
-    /* Два байта нулей. */
-    mfm_write_byte(writer, 0);
-    mfm_write_byte(writer, 0);
-
-    /* Два байта A1 с нарушением кодирования в шестом бите. */
-    for (i=0; i<2; ++i) {
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 0);
-        mfm_write_halfbit(writer, 0);
-        mfm_write_halfbit(writer, 0);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 1);
-    }
-}
+#define MARK_BYTES      5
 
 /*
- * Записываем идентификатор и его контрольную сумму.
+ * Идентификатор, метка и контрольная сумма, IDENTSZ байтов.
  */
-static void write_ident(mfm_writer_t *writer, int t, int s)
+static void make_ident(unsigned char *buf, int t, int s, int nsectors)
 {
-    int sum, i, odd, even;
+    int sum, odd, even;
     unsigned long ldata;
 
     /* Compute identifier and checksum. */
-    ldata = 0xff << 24;
+    ldata = 0xffUL << 24;
     ldata |= t << 16;
     ldata |= s << 8;
-    ldata |= 11-s;
+    ldata |= nsectors - s;
     shuffle(ldata, &odd, &even);
     sum = odd ^ even;
 
-    /* Write identifier. */
-    mfm_write_byte(writer, odd >> 8);
-    mfm_write_byte(writer, odd);
-    mfm_write_byte(writer, even >> 8);
-    mfm_write_byte(writer, even);
+    /* Identifier. */
+    buf[0] = odd >> 8;
+    buf[1] = odd;
+    buf[2] = even >> 8;
+    buf[3] = even;
 
-    /* Write label. */
-    for (i=0; i<16; ++i) {
-        mfm_write_byte(writer, 0);
-    }
+    /* Label. */
+    memset(buf + 4, 0, 16);
 
-    /* Write checksum. */
-    mfm_write_byte(writer, sum >> 24);
-    mfm_write_byte(writer, sum >> 16);
-    mfm_write_byte(writer, sum >> 8);
-    mfm_write_byte(writer, sum);
+    /* Checksum. */
+    buf[20] = sum >> 24;
+    buf[21] = sum >> 16;
+    buf[22] = sum >> 8;
+    buf[23] = sum;
 }
 
 /*
- * Запись 512-байтного блока с перестановкой битов.
- * Перед блоком записывается 4 байта контрольной суммы.
+ * 512-байтный блок с перестановкой битов, BLOCKSZ байтов.
+ * Перед блоком 4 байта контрольной суммы.
  */
-static void write_sector(mfm_writer_t *writer, unsigned char *data)
+static void make_block(unsigned char *buf, unsigned char *data)
 {
-    unsigned long ldata;
-    int odd [128], even [128], sum, i;
+    unsigned sum;
 
-    /* Shuffle data, compute checksum. */
-    sum = 0;
-    for (i=0; i<SECTSZ/4; ++i) {
-        ldata = data[4*i] << 24;
-        ldata |= data[4*i+1] << 16;
-        ldata |= data[4*i+2] << 8;
-        ldata |= data[4*i+3];
-        shuffle(ldata, &odd[i], &even[i]);
-        sum ^= odd[i] ^ even[i];
-    }
+    sum = mfm_codec->shuffle(data, buf + 4);
 
-    /* Write checksum. */
-    mfm_write_byte(writer, sum >> 24);
-    mfm_write_byte(writer, sum >> 16);
-    mfm_write_byte(writer, sum >> 8);
-    mfm_write_byte(writer, sum);
+    /* Checksum. */
+    buf[0] = sum >> 24;
+    buf[1] = sum >> 16;
+    buf[2] = sum >> 8;
+    buf[3] = sum;
+}
 
-    /* Write data, odd bits first. */
-    for (i=0; i<SECTSZ/4; ++i) {
-        mfm_write_byte(writer, odd[i] >> 8);
-        mfm_write_byte(writer, odd[i]);
-    }
-    for (i=0; i<SECTSZ/4; ++i) {
-        mfm_write_byte(writer, even[i] >> 8);
-        mfm_write_byte(writer, even[i]);
+/*
+ * Образец дорожки Amiga с маркерами. Идентификатор и блок
+ * данных идут подряд, их вписываем в образец для каждой дорожки.
+ */
+static void layout_amiga(const mfm_format_t *fmt, mfm_writer_t *writer,
+    const mfm_disk_t *d, int *pos)
+{
+    int s;
+
+    mfm_write_gap(writer, fmt->pre_gap, 0);
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        mfm_write_marker(writer, fmt->sync_zeros, MFM_MARK_A1, fmt->sync_marks);
+        pos[2*s] = writer->halfbit;
+        mfm_write_gap(writer, IDENTSZ + BLOCKSZ, 0);
     }
+    mfm_fill_track(writer, 0);
 }
 
 /*
- * Записываем MFM-образ флоппи-диска в формате Amiga.
+ * Поля секторов дорожки t.
  */
-void mfm_write_amiga(mfm_disk_t *d, FILE *fout)
+static void patch_amiga(mfm_writer_t *writer, const int *pos, mfm_disk_t *d,
+    int t, int dt)
 {
-    mfm_writer_t writer;
-    int t, s;
+    unsigned char ident [IDENTSZ], block [BLOCKSZ], *data;
+    int s, h;
 
-    if (mfm_verbose)
-        fprintf(mfm_err, "Creating %d tracks, %d sectors per track\n",
-            d->ntracks, d->nsectors_per_track);
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        make_ident(ident, t, s, d->nsectors_per_track);
+        mfm_write_patch(writer, pos[2*s], ident, IDENTSZ);
 
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_write_reset(&writer, fout);
-        mfm_write_gap(&writer, 150, 0);
+        /* Блок данных: повторный сектор берём из кэша. */
+        data = mfm_block(d, dt, s);
+        h = pos[2*s] + IDENTSZ*16;
+        if (mfm_cache_get(writer, h, MFM_SYNC_AMIGA, data, BLOCKSZ*2))
+            continue;
+        make_block(block, data);
+        mfm_write_patch(writer, h, block, BLOCKSZ);
+        mfm_cache_put(writer, h, MFM_SYNC_AMIGA, data, BLOCKSZ*2);
+    }
+}
 
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            write_marker(&writer);
-            write_ident(&writer, t, s);
-            write_sector(&writer, d->block[t][s]);
-        }
-        mfm_fill_track(&writer, 0);
+static const mfm_gap_t amiga_gaps[] = {
+    { 11, 0, MFM_DENSITY_DD },  /* default */
+    { 22, 0, MFM_DENSITY_HD },
+    { 0,  0, 0 },
+};
+
+const mfm_format_t mfm_format_amiga = {
+    .name       = "Amiga",
+    .sync       = MFM_SYNC_AMIGA,
+    .nsectors   = 11,
+    .sync_zeros = 2,
+    .sync_marks = 2,
+    .mark_bytes = MARK_BYTES,
+    .pre_gap    = 150,
+    .index_mark = 0,
+    .data_gap   = 0,
+    .gaps       = amiga_gaps,
+    .index      = mfm_index_amiga,
+    .layout     = layout_amiga,
+    .patch      = patch_amiga,
+};
+
+void mfm_write_amiga(mfm_disk_t *d, mfm_io_t *out)
+{
+    if (d->sector_size != SECTSZ) {
+        fprintf(mfm_err, "Amiga sectors are %d bytes, aborted.\n", SECTSZ);
+        mfm_fail(MFM_ERR_ARG);
     }
+    mfm_write_format(&mfm_format_amiga, d, 0, out);
+}
+
+/*
+ * Потоковая запись: образ секторов читаем из fin по дорожке.
+ */
+void mfm_write_amiga_stream(FILE *fin, mfm_io_t *out, int nsectors_per_track)
+{
+    mfm_disk_t d;
+
+    memset(&d, 0, sizeof(d));
+    mfm_disk_init(&d, 1, nsectors_per_track, SECTSZ);
+    mfm_write_format(&mfm_format_amiga, &d, fin, out);
+    mfm_disk_free(&d);
 }
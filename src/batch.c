@@ -0,0 +1,219 @@
+/*
+ * Batch conversion of many files in one process.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "mfmlib.h"
+
+/*
+ * Пакетное задание: список файлов и общие счётчики.
+ * Каждый поток работает со своим контекстом, буферы которого
+ * используются повторно для всех его файлов. Поэтому память
+ * ограничена числом потоков, а не длиной списка.
+ */
+typedef struct {
+    FILE *manifest;
+    FILE *diag;                 /* diagnostics of conversions */
+    int format;
+    int rev;
+    pthread_mutex_t lock;
+    int lineno;                 /* lines of manifest read */
+    int nok;
+    int nfailed;
+    mfm_options_t opt;          /* options for all contexts */
+} batch_t;
+
+/*
+ * Имя выходного файла по умолчанию: .mfm и .scp в образ секторов,
+ * образ секторов в .mfm.
+ */
+static char *output_name(const char *input)
+{
+    const char *ext = strrchr(input, '.');
+    const char *slash = strrchr(input, '/');
+    size_t len = (ext && (! slash || ext > slash)) ?
+        (size_t) (ext - input) : strlen(input);
+    char *name = malloc(len + 5);
+
+    if (! name)
+        return 0;
+    memcpy(name, input, len);
+    strcpy(name + len,
+        (mfm_file_type(input) != MFM_FILE_IMG) ? ".img" :
+        mfm_compact ? ".mfz" : ".mfm");
+    return name;
+}
+
+/*
+ * Очередная строка списка: "input [output]". Имена разделяются
+ * табуляцией, а если её нет, то пробелами. Пустые строки
+ * и строки с '#' в начале пропускаются.
+ * Возвращаем 0 в конце списка.
+ */
+static int next_job(batch_t *b, char **input, char **output, int *lineno)
+{
+    char *line = 0, *p, *q;
+    size_t size = 0;
+    ssize_t len;
+    int found = 0;
+
+    pthread_mutex_lock(&b->lock);
+    while ((len = getline(&line, &size, b->manifest)) >= 0) {
+        b->lineno++;
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = 0;
+
+        p = line + strspn(line, " \t");
+        if (*p == 0 || *p == '#')
+            continue;
+
+        q = strchr(p, '\t');
+        if (! q)
+            q = strchr(p, ' ');
+        if (q) {
+            *q++ = 0;
+            q += strspn(q, " \t");
+        }
+        *input = strdup(p);
+        *output = (q && *q) ? strdup(q) : output_name(p);
+        *lineno = b->lineno;
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&b->lock);
+    free(line);
+    return found;
+}
+
+static void *batch_worker(void *arg)
+{
+    batch_t *b = arg;
+    mfm_context_t ctx;
+    char *input, *output;
+    int lineno, error;
+
+    mfm_options_load(&b->opt);
+    mfm_context_init(&ctx);
+    ctx.err = b->diag;
+    ctx.verbose = mfm_verbose;
+    ctx.gap_byte = mfm_gap_byte;
+    ctx.index_gap = mfm_index_gap;
+    ctx.sector_gap = mfm_sector_gap;
+    ctx.data_gap = mfm_data_gap;
+    ctx.density = mfm_density;
+    ctx.sector_size = mfm_sector_size;
+    ctx.compact = mfm_compact;
+    ctx.retry = mfm_retry;
+    ctx.reference = (mfm_codec == &mfm_codec_ref);
+    ctx.cache = mfm_cache;
+    ctx.stats = mfm_stats_on;
+
+    while (next_job(b, &input, &output, &lineno)) {
+        if (! input || ! output)
+            error = MFM_ERR_NOMEM;
+        else
+            error = mfm_convert_file(&ctx, input, output, b->format, b->rev);
+
+        /* Состояние каждого файла: номер строки, результат,
+         * код ошибки, имена файлов, через табуляцию. */
+        pthread_mutex_lock(&b->lock);
+        printf("%d\t%s\t%d\t%s\t%s\n", lineno, error ? "failed" : "ok",
+            error, input ? input : "", output ? output : "");
+        fflush(stdout);
+        if (error)
+            b->nfailed++;
+        else
+            b->nok++;
+        pthread_mutex_unlock(&b->lock);
+
+        free(input);
+        free(output);
+    }
+    mfm_context_free(&ctx);
+    return 0;
+}
+
+/*
+ * Преобразование всех файлов из списка в mfm_jobs потоков.
+ * Список "-" читается со стандартного ввода.
+ * Возвращаем количество неудачных преобразований.
+ */
+int mfm_batch(const char *manifest, int format, int rev)
+{
+    batch_t b;
+    pthread_t *thread;
+    int nthreads, i;
+
+    memset(&b, 0, sizeof(b));
+    b.format = format;
+    b.rev = rev;
+    b.manifest = (strcmp(manifest, "-") == 0) ? stdin : fopen(manifest, "r");
+    if (! b.manifest) {
+        perror(manifest);
+        return -1;
+    }
+
+    /* Диагностика идёт в stderr только в подробном режиме:
+     * стандартный вывод занят состоянием файлов. */
+    b.diag = mfm_verbose ? stderr : fopen("/dev/null", "w");
+    if (! b.diag)
+        b.diag = stderr;
+
+    /* Все контексты с одинаковыми параметрами, потоки получают
+     * их копию. Внутри файла работаем в один поток. */
+    nthreads = (mfm_jobs > 1) ? mfm_jobs : 1;
+    mfm_options_save(&b.opt);
+    b.opt.err = b.diag;
+    b.opt.jobs = 1;
+
+    pthread_mutex_init(&b.lock, 0);
+    thread = calloc(nthreads, sizeof(thread[0]));
+    for (i=0; thread && i<nthreads; ++i) {
+        if (pthread_create(&thread[i], 0, batch_worker, &b) != 0) {
+            /* Справимся меньшим числом потоков. */
+            nthreads = i;
+            break;
+        }
+    }
+    if (! thread || nthreads == 0)
+        batch_worker(&b);
+    for (i=0; thread && i<nthreads; ++i)
+        pthread_join(thread[i], 0);
+
+    fprintf(stderr, "Batch: %d converted, %d failed\n", b.nok, b.nfailed);
+    pthread_mutex_destroy(&b.lock);
+    free(thread);
+    if (b.manifest != stdin)
+        fclose(b.manifest);
+    if (b.diag != stderr)
+        fclose(b.diag);
+    mfm_err = stdout;
+    return b.nfailed;
+}
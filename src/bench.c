@@ -0,0 +1,950 @@
+/*
+ * Benchmark of MFM codec, scanner, flux decoder and conversions.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "config.h"
+#include "mfmlib.h"
+#include "scp.h"
+
+/*
+ * Синтетические дискеты: данные секторов, MFM-образы и файл SCP.
+ * Строятся один раз, до всех замеров.
+ */
+#define NTRACKS         160
+#define NREVS           2
+
+static unsigned char *img_ibmpc;        /* 9 sectors per track */
+static unsigned char *img_amiga;        /* 11 sectors per track */
+static unsigned char *mfm_ibmpc;
+static unsigned char *mfm_bk;
+static unsigned char *mfm_amiga;
+static size_t mfm_size;                 /* same for all formats */
+static char scp_name[] = "/tmp/mfmbenchXXXXXX";
+
+static mfm_context_t ctx;
+static mfm_track_index_t idx;
+
+/*
+ * Результат одного прохода замера.
+ */
+typedef struct {
+    unsigned long long bytes;           /* of MFM data */
+    unsigned long long tracks;
+} bench_count_t;
+
+/*
+ * Детерминированный генератор: от запуска к запуску
+ * одни и те же данные.
+ */
+static unsigned long rand_state = 1;
+
+static unsigned rand_next(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16) & 0x7fff;
+}
+
+static void *xalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (! p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+    return p;
+}
+
+static unsigned char *make_image(int nsectors_per_track)
+{
+    size_t size = (size_t) NTRACKS * nsectors_per_track * SECTSZ, i;
+    unsigned char *img = xalloc(size);
+
+    for (i = 0; i < size; i++)
+        img[i] = rand_next();
+    return img;
+}
+
+static unsigned char *make_mfm(const unsigned char *img, int nsectors_per_track,
+    int format)
+{
+    const unsigned char *mfm;
+    unsigned char *copy;
+    size_t size;
+
+    if (mfm_create_buffer(&ctx, img, (size_t) NTRACKS * nsectors_per_track *
+        SECTSZ, nsectors_per_track, format, &mfm, &size) != MFM_OK)
+        exit(-1);
+    copy = xalloc(size);
+    memcpy(copy, mfm, size);
+    mfm_size = size;
+    return copy;
+}
+
+static void put_le32(unsigned char *p, unsigned val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+/*
+ * Поток переходов из MFM-образа: интервал между единичными
+ * полубитами, 2 мкс на полубит, с дрожанием до 5%.
+ * Отсчёты по 25 нсек, 16 бит, старший байт первый.
+ */
+static size_t make_flux(const unsigned char *track, unsigned char *out)
+{
+    int halfbit, n = 0;
+    size_t nsamples = 0;
+    unsigned t;
+
+    for (halfbit = 0; halfbit < TRACKSZ * 8; halfbit++) {
+        n++;
+        if (! (track[halfbit >> 3] & (0x80 >> (halfbit & 7))))
+            continue;
+        t = (n * 2000 + (int) (rand_next() % 201) - 100) / 25;
+        out[2*nsamples] = t >> 8;
+        out[2*nsamples + 1] = t;
+        nsamples++;
+        n = 0;
+    }
+    return nsamples;
+}
+
+static void make_scp(const unsigned char *mfm)
+{
+    unsigned char hdr[16 + 4*TRACK_MAX], thdr[4 + 12*NREVS];
+    unsigned char *flux = xalloc(TRACKSZ * 8 * 2);
+    unsigned offset = sizeof(hdr), data, duration;
+    size_t nsamples, i;
+    int fd, tn, rev;
+    FILE *f;
+
+    fd = mkstemp(scp_name);
+    f = (fd < 0) ? 0 : fdopen(fd, "wb");
+    if (! f) {
+        fprintf(stderr, "%s: cannot create\n", scp_name);
+        exit(-1);
+    }
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "SCP", 3);
+    hdr[3] = 0x19;                      /* version 1.9 */
+    hdr[4] = 0x80;                      /* disk type: other */
+    hdr[5] = NREVS;
+    hdr[7] = NTRACKS;
+    hdr[8] = FLAG_INDEX | FLAG_TPI;
+    fseek(f, sizeof(hdr), SEEK_SET);
+
+    for (tn = 0; tn < NTRACKS; tn++) {
+        put_le32(hdr + 16 + 4*tn, offset);
+        memcpy(thdr, "TRK", 3);
+        thdr[3] = tn;
+        data = sizeof(thdr);
+        fseek(f, offset + data, SEEK_SET);
+        for (rev = 0; rev < NREVS; rev++) {
+            nsamples = make_flux(mfm + (size_t) tn * TRACKSZ, flux);
+            duration = 0;
+            for (i = 0; i < nsamples; i++)
+                duration += flux[2*i] << 8 | flux[2*i + 1];
+            put_le32(thdr + 4 + 12*rev, duration);
+            put_le32(thdr + 8 + 12*rev, nsamples);
+            put_le32(thdr + 12 + 12*rev, data);
+            fwrite(flux, 2, nsamples, f);
+            data += 2 * nsamples;
+        }
+        fseek(f, offset, SEEK_SET);
+        fwrite(thdr, 1, sizeof(thdr), f);
+        offset += data;
+    }
+    rewind(f);
+    fwrite(hdr, 1, sizeof(hdr), f);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "%s: write error\n", scp_name);
+        exit(-1);
+    }
+    free(flux);
+}
+
+/*
+ * Ядра: кодирование и декодирование байтов, контрольные суммы,
+ * перестановка битов Amiga, поиск секторов, чтение потока
+ * переходов и PLL. Объём считаем в байтах MFM.
+ */
+static void bench_write_byte(bench_count_t *c)
+{
+    static mfm_writer_t writer;
+    int t, n;
+
+    for (t = 0; t < NTRACKS; t++) {
+        mfm_write_reset(&writer, 0);
+        for (n = 0; n < TRACKSZ/2; n++)
+            mfm_write_byte(&writer, mfm_ibmpc[(size_t) t*TRACKSZ + n]);
+    }
+    c->bytes += (size_t) NTRACKS * TRACKSZ;
+    c->tracks += NTRACKS;
+}
+
+static void bench_read_byte(bench_count_t *c)
+{
+    int t, n;
+    unsigned sum = 0;
+
+    for (t = 0; t < NTRACKS; t++) {
+        mfm_index_load(&idx, mfm_ibmpc + (size_t) t * TRACKSZ, TRACKSZ, t);
+        for (n = 0; n < TRACKSZ/2; n++)
+            sum += mfm_read_byte(&idx.reader);
+    }
+    if (sum == 1)
+        printf("\n");                   /* keep the result alive */
+    c->bytes += (size_t) NTRACKS * TRACKSZ;
+    c->tracks += NTRACKS;
+}
+
+static void bench_crc16(bench_count_t *c)
+{
+    size_t s;
+    unsigned sum = 0;
+
+    for (s = 0; s < (size_t) NTRACKS * 9; s++)
+        sum += mfm_codec->crc16(0xffff, img_ibmpc + s * SECTSZ, SECTSZ);
+    if (sum == 1)
+        printf("\n");
+    c->bytes += (size_t) NTRACKS * 9 * SECTSZ * 2;
+    c->tracks += NTRACKS;
+}
+
+static void bench_unshuffle(bench_count_t *c)
+{
+    static unsigned char data[SECTSZ];
+    size_t s;
+    unsigned sum = 0;
+
+    for (s = 0; s < (size_t) NTRACKS * 11; s++)
+        sum += mfm_codec->unshuffle(img_amiga + s * SECTSZ, data);
+    if (sum == 1)
+        printf("\n");
+    c->bytes += (size_t) NTRACKS * 11 * SECTSZ * 2;
+    c->tracks += NTRACKS;
+}
+
+static void bench_shuffle(bench_count_t *c)
+{
+    static unsigned char raw[SECTSZ];
+    size_t s;
+    unsigned sum = 0;
+
+    for (s = 0; s < (size_t) NTRACKS * 11; s++)
+        sum += mfm_codec->shuffle(img_amiga + s * SECTSZ, raw);
+    if (sum == 1)
+        printf("\n");
+    c->bytes += (size_t) NTRACKS * 11 * SECTSZ * 2;
+    c->tracks += NTRACKS;
+}
+
+static void bench_index(bench_count_t *c, const unsigned char *mfm,
+    void (*index)(mfm_track_index_t *idx))
+{
+    int t;
+
+    for (t = 0; t < NTRACKS; t++) {
+        mfm_index_load(&idx, mfm + (size_t) t * TRACKSZ, TRACKSZ, t);
+        index(&idx);
+    }
+    c->bytes += (size_t) NTRACKS * TRACKSZ;
+    c->tracks += NTRACKS;
+}
+
+static void bench_index_ibmpc(bench_count_t *c)
+{
+    bench_index(c, mfm_ibmpc, mfm_index_ibmpc);
+}
+
+static void bench_index_amiga(bench_count_t *c)
+{
+    bench_index(c, mfm_amiga, mfm_index_amiga);
+}
+
+static scp_file_t sf;
+
+static void bench_scp_next_flux(bench_count_t *c)
+{
+    int tn;
+    unsigned n, nflux, sum = 0;
+    const uint32_t *flux;
+
+    for (tn = 0; tn < NTRACKS; tn++) {
+        scp_select_track(&sf, tn);
+        nflux = scp_read_flux(&sf, 0, &flux);
+        scp_reset(&sf);
+        for (n = 0; n < nflux; n++)
+            sum += scp_next_flux(&sf, 0);
+    }
+    if (sum == 1)
+        printf("\n");
+    c->bytes += (size_t) NTRACKS * TRACKSZ;
+    c->tracks += NTRACKS;
+}
+
+static void bench_pll(bench_count_t *c)
+{
+    int tn;
+    unsigned sum = 0;
+
+    for (tn = 0; tn < NTRACKS; tn++) {
+        scp_select_track(&sf, tn);
+        sum += scp_pll_bits(&sf, 0);
+    }
+    if (sum == 1)
+        printf("\n");
+    c->bytes += (size_t) NTRACKS * TRACKSZ;
+    c->tracks += NTRACKS;
+}
+
+static void bench_scp_read_flux(bench_count_t *c)
+{
+    int tn;
+    const uint32_t *flux;
+
+    for (tn = 0; tn < NTRACKS; tn++) {
+        scp_select_track(&sf, tn);
+        scp_read_flux(&sf, 0, &flux);
+    }
+    c->bytes += (size_t) NTRACKS * TRACKSZ;
+    c->tracks += NTRACKS;
+}
+
+/*
+ * Полные преобразования, через библиотечный интерфейс.
+ */
+static void create(bench_count_t *c, const unsigned char *img,
+    int nsectors_per_track, int format)
+{
+    const unsigned char *mfm;
+    size_t size;
+
+    if (mfm_create_buffer(&ctx, img, (size_t) NTRACKS * nsectors_per_track *
+        SECTSZ, nsectors_per_track, format, &mfm, &size) != MFM_OK)
+        exit(-1);
+    c->bytes += size;
+    c->tracks += NTRACKS;
+}
+
+static void extract(bench_count_t *c, const unsigned char *mfm, int format)
+{
+    const unsigned char *img;
+    size_t size;
+
+    if (mfm_extract_buffer(&ctx, mfm, mfm_size, format,
+        &img, &size) != MFM_OK)
+        exit(-1);
+    c->bytes += mfm_size;
+    c->tracks += NTRACKS;
+}
+
+static void bench_img2mfm_ibmpc(bench_count_t *c)
+{
+    create(c, img_ibmpc, 9, MFM_FORMAT_IBMPC);
+}
+
+static void bench_img2mfm_bk(bench_count_t *c)
+{
+    create(c, img_ibmpc, 9, MFM_FORMAT_BK);
+}
+
+static void bench_img2mfm_amiga(bench_count_t *c)
+{
+    create(c, img_amiga, 11, MFM_FORMAT_AMIGA);
+}
+
+static void bench_mfm2img_ibmpc(bench_count_t *c)
+{
+    extract(c, mfm_ibmpc, MFM_FORMAT_IBMPC);
+}
+
+static void bench_mfm2img_bk(bench_count_t *c)
+{
+    extract(c, mfm_bk, MFM_FORMAT_IBMPC);
+}
+
+static void bench_mfm2img_amiga(bench_count_t *c)
+{
+    extract(c, mfm_amiga, MFM_FORMAT_AMIGA);
+}
+
+static void bench_scp2mfm(bench_count_t *c)
+{
+    mfm_io_rewind(&ctx.out);
+    scp_write_mfm(scp_name, &ctx.out, 0);
+    c->bytes += ctx.out.size;
+    c->tracks += NTRACKS;
+}
+
+static void bench_scp2img(bench_count_t *c)
+{
+    const unsigned char *img;
+    size_t size;
+
+    if (mfm_extract_scp(&ctx, scp_name, 0, MFM_FORMAT_IBMPC,
+        &img, &size) != MFM_OK)
+        exit(-1);
+    c->bytes += mfm_size;
+    c->tracks += NTRACKS;
+}
+
+/*
+ * Синтетические данные должны декодироваться без ошибок,
+ * иначе замер идёт не по тому пути.
+ */
+static void check(const char *name, const unsigned char *img,
+    const unsigned char *expect, size_t size)
+{
+    if (memcmp(img, expect, size) != 0)
+        fprintf(stderr, "%s: decoded data differ\n", name);
+}
+
+static void check_all(void)
+{
+    const unsigned char *img;
+    size_t size;
+
+    mfm_extract_buffer(&ctx, mfm_ibmpc, mfm_size, MFM_FORMAT_IBMPC, &img, &size);
+    check("mfm2img_ibmpc", img, img_ibmpc, size);
+    mfm_extract_buffer(&ctx, mfm_amiga, mfm_size, MFM_FORMAT_AMIGA, &img, &size);
+    check("mfm2img_amiga", img, img_amiga, size);
+    mfm_extract_scp(&ctx, scp_name, 0, MFM_FORMAT_IBMPC, &img, &size);
+    check("scp2img", img, img_ibmpc, size);
+}
+
+/*
+ * Сверка быстрых путей с эталонными (ключ -C). Одни и те же
+ * преобразования выполняются дважды, с ctx.reference и без,
+ * и результаты сравниваются байт в байт: код возврата, данные
+ * и текст диагностики. Кроме исправных образов проверяются
+ * испорченные: сбойные полубиты, сдвиги дорожки, повреждённые
+ * отсчёты и заголовки SCP.
+ */
+typedef struct {
+    const unsigned char *in;            /* sector data or MFM */
+    size_t size;
+    int nsectors_per_track;             /* 0 - decode */
+    int format;
+    const char *scp;                    /* SCP file to decode */
+    int scp2mfm;                        /* SCP to MFM, not to sectors */
+    int cache;                          /* encode with sector cache */
+} check_case_t;
+
+typedef struct {
+    int error;
+    unsigned char *data;
+    size_t size;
+    char *diag;
+    size_t diag_size;
+} check_result_t;
+
+static void check_scp2mfm(void *arg)
+{
+    const check_case_t *k = arg;
+
+    scp_write_mfm(k->scp, &ctx.out, 0);
+}
+
+static void check_run(const check_case_t *k, int reference,
+    check_result_t *r)
+{
+    const unsigned char *out = 0;
+    size_t size = 0;
+    FILE *err;
+
+    memset(r, 0, sizeof(*r));
+    err = open_memstream(&r->diag, &r->diag_size);
+    if (! err) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+    ctx.err = err;
+    ctx.reference = reference;
+    ctx.cache = k->cache;
+    if (k->scp2mfm) {
+        /* Библиотечного вызова нет: параметры ставим сами. */
+        mfm_err = err;
+        mfm_codec = reference ? &mfm_codec_ref : &mfm_codec_fast;
+        if (ctx.out.mode != MFM_IO_MEMORY)
+            mfm_io_memory(&ctx.out, 0, 0);
+        mfm_io_rewind(&ctx.out);
+        r->error = mfm_catch(check_scp2mfm, (void*) k);
+        out = ctx.out.map;
+        size = ctx.out.size;
+    } else if (k->scp)
+        r->error = mfm_extract_scp(&ctx, k->scp, 0, k->format, &out, &size);
+    else if (k->nsectors_per_track)
+        r->error = mfm_create_buffer(&ctx, k->in, k->size,
+            k->nsectors_per_track, k->format, &out, &size);
+    else
+        r->error = mfm_extract_buffer(&ctx, k->in, k->size, k->format,
+            &out, &size);
+    fclose(err);
+
+    if (r->error == MFM_OK && size > 0) {
+        r->data = xalloc(size);
+        memcpy(r->data, out, size);
+        r->size = size;
+    }
+}
+
+/*
+ * Возвращаем 1, если результаты быстрого и эталонного путей совпали.
+ */
+static int check_case(const char *name, int sample, const check_case_t *k)
+{
+    check_result_t fast, ref;
+    const char *what = 0;
+
+    check_run(k, 0, &fast);
+    check_run(k, 1, &ref);
+    if (fast.error != ref.error)
+        what = "return codes";
+    else if (fast.size != ref.size ||
+        memcmp(fast.data, ref.data, fast.size) != 0)
+        what = "data";
+    else if (fast.diag_size != ref.diag_size ||
+        memcmp(fast.diag, ref.diag, fast.diag_size) != 0)
+        what = "diagnostics";
+    if (what)
+        fprintf(stderr, "%s, sample %d: %s differ\n", name, sample, what);
+    free(fast.data);
+    free(fast.diag);
+    free(ref.data);
+    free(ref.diag);
+    return ! what;
+}
+
+static int get_bit(const unsigned char *buf, size_t h)
+{
+    return buf[h >> 3] >> (7 - (h & 7)) & 1;
+}
+
+static void put_bit(unsigned char *buf, size_t h, int val)
+{
+    buf[h >> 3] = (buf[h >> 3] & ~(0x80 >> (h & 7))) | val << (7 - (h & 7));
+}
+
+static size_t rand_below(size_t n)
+{
+    return (((size_t) rand_next() << 15) | rand_next()) % n;
+}
+
+/*
+ * Порча MFM-образа: сбойные полубиты, или вставка лишних
+ * полубитов со сдвигом остатка дорожки, как при уходе частоты.
+ */
+static void damage_mfm(unsigned char *mfm, size_t size)
+{
+    size_t h, end, i;
+    int n, shift;
+
+    for (n = 1 + rand_next() % 8; n > 0; n--) {
+        h = rand_below(size * 8);
+        if (rand_next() % 4) {
+            put_bit(mfm, h, ! get_bit(mfm, h));
+            continue;
+        }
+        shift = 1 + rand_next() % 15;
+        end = (h / (TRACKSZ * 8) + 1) * TRACKSZ * 8;
+        for (i = end - 1; i >= h + shift; i--)
+            put_bit(mfm, i, get_bit(mfm, i - shift));
+    }
+}
+
+/*
+ * Порча файла SCP: отсчёты переходов, изредка заголовки.
+ */
+static void damage_scp(unsigned char *scp, size_t size)
+{
+    size_t data = 16 + 4*TRACK_MAX, i;
+    int n;
+
+    for (n = 1 + rand_next() % 16; n > 0; n--) {
+        if (rand_next() % 16 == 0) {
+            i = rand_below(data);
+            scp[i] ^= 1 << (rand_next() % 8);
+            continue;
+        }
+        i = data + rand_below(size - data);
+        switch (rand_next() % 3) {
+        case 0:
+            scp[i] = 0;                 /* overflow or long interval */
+            break;
+        case 1:
+            scp[i] ^= 1 << (rand_next() % 8);
+            break;
+        default:
+            scp[i] = rand_next();
+            break;
+        }
+    }
+}
+
+static unsigned char *read_file(const char *name, size_t *size)
+{
+    unsigned char *buf;
+    FILE *f = fopen(name, "rb");
+    long len;
+
+    if (! f || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0) {
+        fprintf(stderr, "%s: cannot read\n", name);
+        exit(-1);
+    }
+    buf = xalloc(len);
+    rewind(f);
+    if (fread(buf, 1, len, f) != (size_t) len) {
+        fprintf(stderr, "%s: read error\n", name);
+        exit(-1);
+    }
+    fclose(f);
+    *size = len;
+    return buf;
+}
+
+static void write_file(const char *name, const unsigned char *buf,
+    size_t size)
+{
+    FILE *f = fopen(name, "wb");
+
+    if (! f || fwrite(buf, 1, size, f) != size || fclose(f) != 0) {
+        fprintf(stderr, "%s: write error\n", name);
+        exit(-1);
+    }
+}
+
+static int check_reported, check_failed;
+
+static void report(const char *name, int nchecked, int nfailed)
+{
+    printf("%s\n    { \"name\": \"%s\", \"checked\": %d, "
+        "\"mismatches\": %d }", check_reported ? "," : "",
+        name, nchecked, nfailed);
+    fflush(stdout);
+    check_reported++;
+    check_failed += nfailed;
+}
+
+/*
+ * Все проверки: исправные образы и nsamples испорченных
+ * для каждого декодера. Возвращаем количество расхождений.
+ */
+static int check_differential(int nsamples)
+{
+    static const struct {
+        const char *name;
+        unsigned char **mfm;
+        int format;
+    } decode[] = {
+        { "mfm2img_ibmpc", &mfm_ibmpc, MFM_FORMAT_IBMPC },
+        { "mfm2img_bk",    &mfm_bk,    MFM_FORMAT_IBMPC },
+        { "mfm2img_amiga", &mfm_amiga, MFM_FORMAT_AMIGA },
+        { "mfm2img_auto",  &mfm_amiga, MFM_FORMAT_AUTO },
+    };
+    char damaged_name[] = "/tmp/mfmcheckXXXXXX";
+    unsigned char *mfm, *scp, *bad;
+    check_case_t k;
+    size_t scp_size;
+    int i, n, fd, total;
+
+    printf("{\n");
+    printf("  \"version\": \"%s\",\n", PACKAGE_VERSION);
+    printf("  \"samples\": %d,\n", nsamples);
+    printf("  \"results\": [");
+
+    /* Кодирование. */
+    memset(&k, 0, sizeof(k));
+    k.in = img_ibmpc;
+    k.size = (size_t) NTRACKS * 9 * SECTSZ;
+    k.nsectors_per_track = 9;
+    k.format = MFM_FORMAT_IBMPC;
+    report("img2mfm_ibmpc", 1, ! check_case("img2mfm_ibmpc", 0, &k));
+    k.format = MFM_FORMAT_BK;
+    report("img2mfm_bk", 1, ! check_case("img2mfm_bk", 0, &k));
+    k.in = img_amiga;
+    k.size = (size_t) NTRACKS * 11 * SECTSZ;
+    k.nsectors_per_track = 11;
+    k.format = MFM_FORMAT_AMIGA;
+    report("img2mfm_amiga", 1, ! check_case("img2mfm_amiga", 0, &k));
+
+    /* Кодирование через кэш секторов: первый проход заполняет
+     * кэш, второй берёт из него все сектора. */
+    k.cache = 1;
+    total = 0;
+    for (n = 0; n < 2; n++) {
+        k.in = img_ibmpc;
+        k.size = (size_t) NTRACKS * 9 * SECTSZ;
+        k.nsectors_per_track = 9;
+        k.format = MFM_FORMAT_IBMPC;
+        total += ! check_case("img2mfm_cache", n, &k);
+        k.in = img_amiga;
+        k.size = (size_t) NTRACKS * 11 * SECTSZ;
+        k.nsectors_per_track = 11;
+        k.format = MFM_FORMAT_AMIGA;
+        total += ! check_case("img2mfm_cache", n, &k);
+    }
+    report("img2mfm_cache", 4, total);
+
+    /* Декодирование: исправный образ, затем испорченные. */
+    mfm = xalloc(mfm_size);
+    for (i = 0; i < (int) (sizeof(decode) / sizeof(decode[0])); i++) {
+        memset(&k, 0, sizeof(k));
+        k.in = mfm;
+        k.size = mfm_size;
+        k.format = decode[i].format;
+        total = 0;
+        for (n = 0; n <= nsamples; n++) {
+            memcpy(mfm, *decode[i].mfm, mfm_size);
+            if (n > 0)
+                damage_mfm(mfm, mfm_size);
+            total += ! check_case(decode[i].name, n, &k);
+        }
+        report(decode[i].name, nsamples + 1, total);
+    }
+    free(mfm);
+
+    /* Поток переходов. */
+    scp = read_file(scp_name, &scp_size);
+    bad = xalloc(scp_size);
+    fd = mkstemp(damaged_name);
+    if (fd < 0) {
+        fprintf(stderr, "%s: cannot create\n", damaged_name);
+        exit(-1);
+    }
+    close(fd);
+    for (i = 0; i < 2; i++) {
+        memset(&k, 0, sizeof(k));
+        k.scp = damaged_name;
+        k.format = MFM_FORMAT_IBMPC;
+        k.scp2mfm = i;
+        total = 0;
+        for (n = 0; n <= nsamples; n++) {
+            memcpy(bad, scp, scp_size);
+            if (n > 0)
+                damage_scp(bad, scp_size);
+            write_file(damaged_name, bad, scp_size);
+            total += ! check_case(i ? "scp2mfm" : "scp2img", n, &k);
+        }
+        report(i ? "scp2mfm" : "scp2img", nsamples + 1, total);
+    }
+    unlink(damaged_name);
+    free(bad);
+    free(scp);
+
+    printf("\n  ]\n}\n");
+    return check_failed;
+}
+
+static const struct {
+    const char *name;
+    const char *kind;
+    void (*run)(bench_count_t *c);
+} bench[] = {
+    { "mfm_write_byte",  "kernel",   bench_write_byte },
+    { "mfm_read_byte",   "kernel",   bench_read_byte },
+    { "crc16_ccitt",     "kernel",   bench_crc16 },
+    { "unshuffle",       "kernel",   bench_unshuffle },
+    { "shuffle",         "kernel",   bench_shuffle },
+    { "index_ibmpc",     "kernel",   bench_index_ibmpc },
+    { "index_amiga",     "kernel",   bench_index_amiga },
+    { "scp_next_flux",   "kernel",   bench_scp_next_flux },
+    { "scp_read_flux",   "kernel",   bench_scp_read_flux },
+    { "pll_next_bit",    "kernel",   bench_pll },
+    { "img2mfm_ibmpc",   "pipeline", bench_img2mfm_ibmpc },
+    { "img2mfm_bk",      "pipeline", bench_img2mfm_bk },
+    { "img2mfm_amiga",   "pipeline", bench_img2mfm_amiga },
+    { "mfm2img_ibmpc",   "pipeline", bench_mfm2img_ibmpc },
+    { "mfm2img_bk",      "pipeline", bench_mfm2img_bk },
+    { "mfm2img_amiga",   "pipeline", bench_mfm2img_amiga },
+    { "scp2mfm",         "pipeline", bench_scp2mfm },
+    { "scp2img",         "pipeline", bench_scp2img },
+};
+
+#define NBENCH  (int) (sizeof(bench) / sizeof(bench[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(void)
+{
+    int i;
+
+    printf("mfmdisk benchmark, version %s\n", PACKAGE_VERSION);
+    printf("\n");
+    printf("Usage:\n");
+    printf("    mfmdisk-bench [-t SEC] [-j N] [-S] [-K] [name...]\n");
+    printf("    mfmdisk-bench -C N\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -t SEC             run every test for at least SEC seconds,\n");
+    printf("                       default 1\n");
+    printf("    -j N               decode tracks in N parallel threads\n");
+    printf("    -S                 collect statistics, as with --stats\n");
+    printf("    -K                 encode with sector cache, as with --cache\n");
+    printf("    -C N               compare fast codecs with the reference\n");
+    printf("                       ones, as with --reference, on good images\n");
+    printf("                       and on N damaged samples of each\n");
+    printf("\n");
+    printf("Tests:\n");
+    for (i = 0; i < NBENCH; i++)
+        printf("    %-18s %s\n", bench[i].name, bench[i].kind);
+    printf("\n");
+    printf("Results are printed in JSON format. Throughput is counted\n");
+    printf("in bytes of MFM data, %d bytes per track.\n", TRACKSZ);
+    exit(0);
+}
+
+static int selected(const char *name, int argc, char **argv)
+{
+    int i;
+
+    if (argc == 0)
+        return 1;
+    for (i = 0; i < argc; i++)
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    double min_time = 1, start, elapsed;
+    bench_count_t c;
+    int i, first = 1, passes, nsamples = -1;
+
+    for (;;) {
+        switch (getopt(argc, argv, "ht:j:SKC:")) {
+        case EOF:
+            break;
+        case 't':
+            min_time = strtod(optarg, 0);
+            continue;
+        case 'j':
+            mfm_jobs = strtol(optarg, 0, 0);
+            if (mfm_jobs < 1)
+                mfm_jobs = 1;
+            continue;
+        case 'S':
+            mfm_stats_on = 1;
+            continue;
+        case 'K':
+            mfm_cache = 1;
+            continue;
+        case 'C':
+            nsamples = strtol(optarg, 0, 0);
+            continue;
+        default:
+            usage();
+        }
+        break;
+    }
+    argc -= optind;
+    argv += optind;
+
+    mfm_err = stderr;
+    mfm_context_init(&ctx);
+    ctx.jobs = mfm_jobs;
+    ctx.stats = mfm_stats_on;
+    ctx.cache = mfm_cache;
+
+    img_ibmpc = make_image(9);
+    img_amiga = make_image(11);
+    mfm_ibmpc = make_mfm(img_ibmpc, 9, MFM_FORMAT_IBMPC);
+    mfm_bk = make_mfm(img_ibmpc, 9, MFM_FORMAT_BK);
+    mfm_amiga = make_mfm(img_amiga, 11, MFM_FORMAT_AMIGA);
+    make_scp(mfm_ibmpc);
+    if (scp_open(&sf, scp_name) != MFM_OK) {
+        unlink(scp_name);
+        exit(-1);
+    }
+
+    check_all();
+
+    if (nsamples >= 0) {
+        i = check_differential(nsamples);
+        scp_close(&sf);
+        unlink(scp_name);
+        mfm_context_free(&ctx);
+        return i ? 1 : 0;
+    }
+
+    /* Диагностика сбойных секторов замерам не нужна. */
+    mfm_err = fopen("/dev/null", "w");
+    ctx.err = mfm_err;
+
+    printf("{\n");
+    printf("  \"version\": \"%s\",\n", PACKAGE_VERSION);
+    printf("  \"jobs\": %d,\n", mfm_jobs);
+    printf("  \"stats\": %d,\n", mfm_stats_on);
+    printf("  \"cache\": %d,\n", mfm_cache);
+    printf("  \"results\": [");
+    for (i = 0; i < NBENCH; i++) {
+        if (! selected(bench[i].name, argc, argv))
+            continue;
+
+        /* Первый проход прогревает кэши и не считается. */
+        memset(&c, 0, sizeof(c));
+        bench[i].run(&c);
+        memset(&c, 0, sizeof(c));
+        passes = 0;
+        start = now();
+        do {
+            bench[i].run(&c);
+            passes++;
+            elapsed = now() - start;
+        } while (elapsed < min_time);
+
+        printf("%s\n    { \"name\": \"%s\", \"kind\": \"%s\", "
+            "\"passes\": %d, \"seconds\": %.3f, "
+            "\"mb_per_sec\": %.2f, \"tracks_per_sec\": %.1f }",
+            first ? "" : ",", bench[i].name, bench[i].kind, passes,
+            elapsed, c.bytes / elapsed / 1e6, c.tracks / elapsed);
+        fflush(stdout);
+        first = 0;
+    }
+    printf("\n  ]\n}\n");
+
+    scp_close(&sf);
+    unlink(scp_name);
+    mfm_context_free(&ctx);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Sector cache: encoded MFM fields, found by contents.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Кэш закодированных полей данных секторов. В архивах много
+ * одинаковых дискет: загрузочные диски, чистые отформатированные
+ * с секторами из 0xE5 или нулей. Поле данных сектора (с суммой)
+ * зависит только от содержимого сектора, формата и предыдущего
+ * полубита, но не от номеров дорожки и сектора, поэтому
+ * повторный сектор берём из кэша готовым, копированием.
+ * Кэш общий для всех потоков и вызовов библиотеки, так что
+ * сохраняется на весь пакет файлов (--batch).
+ */
+__thread int mfm_cache;
+
+#define CACHE_SIZE      4096            /* entries, power of 2 */
+#define CACHE_LOCKS     64              /* entries share locks by index */
+#define CACHE_FIELD     (4 + SECTSZ)    /* largest field: Amiga block */
+
+typedef struct {
+    unsigned long long key;             /* hash, 0 - empty entry */
+    int kind;                           /* format and previous halfbit */
+    int nbytes;                         /* bytes of MFM */
+    unsigned char data [SECTSZ];        /* sector contents */
+    unsigned char mfm [2*CACHE_FIELD];  /* encoded field */
+} cache_entry_t;
+
+static cache_entry_t *cache_tab;
+static pthread_mutex_t cache_lock [CACHE_LOCKS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_init(void)
+{
+    int i;
+
+    /* Память отводится при первом обращении: без ключа
+     * --cache кэш ничего не стоит. */
+    cache_tab = calloc(CACHE_SIZE, sizeof(cache_entry_t));
+    for (i=0; i<CACHE_LOCKS; ++i)
+        pthread_mutex_init(&cache_lock[i], 0);
+}
+
+/*
+ * Свёртка содержимого сектора, по 8 байтов, в четыре
+ * независимые цепочки умножений.
+ */
+static unsigned long long cache_hash(const unsigned char *data, int kind)
+{
+    unsigned long long h [4], w;
+    int i;
+
+    for (i=0; i<4; ++i)
+        h[i] = (kind + i + 1) * 0x9e3779b97f4a7c15ULL;
+    for (i=0; i<SECTSZ/8; ++i) {
+        memcpy(&w, data + 8*i, 8);
+        h[i & 3] = (h[i & 3] ^ w) * 0xff51afd7ed558ccdULL;
+    }
+    w = h[0] ^ (h[1] >> 17) ^ (h[2] >> 31) ^ (h[3] >> 47);
+    w ^= w >> 29;
+    return w | 1;
+}
+
+/*
+ * Вид поля: формат (MFM_SYNC_xxx) и последний полубит перед полем,
+ * от которого зависит синхроимпульс первого бита.
+ * Возвращаем -1, если поле не помещается на дорожке.
+ */
+static int cache_kind(mfm_writer_t *writer, int halfbit, int sync, int nbytes)
+{
+    const unsigned char *p = writer->buf + (halfbit >> 3);
+
+    if (halfbit <= 0 || (halfbit >> 3) + nbytes > (writer->nhalfbits >> 3))
+        return -1;
+    return sync << 1 | (p[-1] & 1);
+}
+
+/*
+ * Берём поле данных сектора из кэша и вписываем его в дорожку
+ * с полубита halfbit, как mfm_write_patch(). Возвращаем 1,
+ * если сектор найден, иначе 0: поле надо закодировать
+ * и положить в кэш вызовом mfm_cache_put().
+ */
+int mfm_cache_get(mfm_writer_t *writer, int halfbit, int sync,
+    const unsigned char *data, int nbytes)
+{
+    unsigned char *p, *end;
+    unsigned long long key;
+    cache_entry_t *e;
+    int kind, slot, last, found;
+
+    if (! mfm_cache || mfm_codec != &mfm_codec_fast)
+        return 0;
+    pthread_once(&cache_once, cache_init);
+    kind = cache_kind(writer, halfbit, sync, nbytes);
+    if (! cache_tab || kind < 0)
+        return 0;
+
+    key = cache_hash(data, kind);
+    slot = key & (CACHE_SIZE - 1);
+    e = &cache_tab[slot];
+    p = writer->buf + (halfbit >> 3);
+    end = writer->buf + (writer->nhalfbits >> 3);
+
+    pthread_mutex_lock(&cache_lock[slot % CACHE_LOCKS]);
+    found = (e->key == key && e->kind == kind && e->nbytes == nbytes &&
+        memcmp(e->data, data, SECTSZ) == 0);
+    if (found)
+        memcpy(p, e->mfm, nbytes);
+    pthread_mutex_unlock(&cache_lock[slot % CACHE_LOCKS]);
+
+    if (! found) {
+        mfm_count(cache_misses, 1);
+        return 0;
+    }
+    mfm_count(cache_hits, 1);
+
+    /* Синхроимпульс следующего байта, как в mfm_write_patch(). */
+    p += nbytes;
+    last = p[-1] & 1;
+    if (p < end && ! (p[0] & 0x40))
+        p[0] = (p[0] & 0x7f) | (last ? 0 : 0x80);
+    return 1;
+}
+
+/*
+ * Кладём в кэш поле данных сектора, только что закодированное
+ * на дорожке с полубита halfbit: nbytes байтов MFM.
+ */
+void mfm_cache_put(mfm_writer_t *writer, int halfbit, int sync,
+    const unsigned char *data, int nbytes)
+{
+    unsigned long long key;
+    cache_entry_t *e;
+    int kind, slot;
+
+    if (! mfm_cache || mfm_codec != &mfm_codec_fast || ! cache_tab ||
+        nbytes > 2*CACHE_FIELD)
+        return;
+    kind = cache_kind(writer, halfbit, sync, nbytes);
+    if (kind < 0)
+        return;
+
+    key = cache_hash(data, kind);
+    slot = key & (CACHE_SIZE - 1);
+    e = &cache_tab[slot];
+
+    /* Прямое отображение: новый сектор вытесняет старый. */
+    pthread_mutex_lock(&cache_lock[slot % CACHE_LOCKS]);
+    e->key = key;
+    e->kind = kind;
+    e->nbytes = nbytes;
+    memcpy(e->data, data, SECTSZ);
+    memcpy(e->mfm, writer->buf + (halfbit >> 3), nbytes);
+    pthread_mutex_unlock(&cache_lock[slot % CACHE_LOCKS]);
+}
@@ -0,0 +1,288 @@
+/*
+ * Compact MFM container: track offset table and run-length packing.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Формат компактного файла, все числа little-endian:
+ *
+ *   0  4  "MFMZ"
+ *   4  1  версия, 1
+ *   5  1  плотность, MFM_DENSITY_xx
+ *   6  2  количество дорожек N
+ *   8  4  смещения дорожек от начала файла, N+1 штук
+ *
+ * Дорожка t лежит между смещениями t и t+1, пустая дорожка
+ * читается как нули. Дорожка состоит из 16-битных слов MFM,
+ * упакованных записями:
+ *
+ *   0nnnnnnn                   n+1 слов как есть, далее сами слова
+ *   1nnnnnnn nnnnnnnn hi lo    слово hi-lo, повторённое n+1 раз
+ */
+#define Z_VERSION       1
+#define Z_HEADER        8       /* before the offset table */
+#define Z_MAXLIT        128     /* words in one literal record */
+#define Z_MAXRUN        0x8000  /* words in one run record */
+#define Z_MINRUN        3       /* shorter runs go as literals */
+
+static unsigned get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static void put32(unsigned char *p, unsigned val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+static void *z_alloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (! ptr) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+    return ptr;
+}
+
+/*
+ * Проверка заголовка компактного файла.
+ * Возвращаем 0, если это не компактный файл, 1 - если правильный,
+ * -1 - если заголовок испорчен.
+ */
+int mfm_compact_check(const unsigned char *buf, size_t size,
+    int *ntracks, int *density)
+{
+    unsigned t, n, prev, offset;
+
+    if (size < Z_HEADER || memcmp(buf, "MFMZ", 4) != 0)
+        return 0;
+    n = buf[6] | buf[7] << 8;
+    if (buf[4] != Z_VERSION || n > MAXTRACK ||
+        (buf[5] != MFM_DENSITY_DD && buf[5] != MFM_DENSITY_HD &&
+         buf[5] != MFM_DENSITY_ED) ||
+        size < Z_HEADER + 4 * (n + 1))
+        return -1;
+
+    prev = Z_HEADER + 4 * (n + 1);
+    for (t=0; t<=n; ++t) {
+        offset = get32(buf + Z_HEADER + 4*t);
+        if (offset < prev || offset > size)
+            return -1;
+        prev = offset;
+    }
+    *ntracks = n;
+    *density = buf[5];
+    return 1;
+}
+
+/*
+ * Упаковка дорожки в dst. Места нужно не меньше, чем
+ * nbytes + nbytes/128 + 2. Возвращаем длину результата.
+ */
+size_t mfm_compact_pack(const unsigned char *src, int nbytes,
+    unsigned char *dst)
+{
+    const unsigned char *lit = 0;
+    unsigned char *p = dst;
+    int nwords = nbytes / 2, i, run, nlit = 0;
+
+    for (i=0; i<nwords; i+=run) {
+        run = 1;
+        while (i + run < nwords && run < Z_MAXRUN &&
+            src[2*(i+run)] == src[2*i] && src[2*(i+run)+1] == src[2*i+1])
+            ++run;
+
+        if (run < Z_MINRUN) {
+            /* Слово добавляется к записи как есть. */
+            run = 1;
+            if (nlit == 0)
+                lit = src + 2*i;
+            if (++nlit < Z_MAXLIT)
+                continue;
+        }
+        if (nlit > 0) {
+            *p++ = nlit - 1;
+            memcpy(p, lit, 2*nlit);
+            p += 2*nlit;
+            nlit = 0;
+        }
+        if (run >= Z_MINRUN) {
+            *p++ = 0x80 | (run - 1) >> 8;
+            *p++ = run - 1;
+            *p++ = src[2*i];
+            *p++ = src[2*i+1];
+        }
+    }
+    if (nlit > 0) {
+        *p++ = nlit - 1;
+        memcpy(p, lit, 2*nlit);
+        p += 2*nlit;
+    }
+    return p - dst;
+}
+
+/*
+ * Распаковка дорожки длиной nbytes.
+ * Пустые данные дают дорожку из нулей.
+ * Возвращаем -1, если данные испорчены.
+ */
+int mfm_compact_unpack(const unsigned char *src, size_t size,
+    unsigned char *dst, int nbytes)
+{
+    const unsigned char *end = src + size;
+    unsigned char *p = dst, *limit = dst + nbytes;
+    int count;
+
+    if (size == 0) {
+        memset(dst, 0, nbytes);
+        return 0;
+    }
+    while (src < end) {
+        if (*src & 0x80) {
+            if (end - src < 4)
+                return -1;
+            count = ((src[0] & 0x7f) << 8 | src[1]) + 1;
+            if (limit - p < 2*count)
+                return -1;
+            while (count-- > 0) {
+                *p++ = src[2];
+                *p++ = src[3];
+            }
+            src += 4;
+        } else {
+            count = 2 * (src[0] + 1);
+            if (end - src - 1 < count || limit - p < count)
+                return -1;
+            memcpy(p, src + 1, count);
+            p += count;
+            src += 1 + count;
+        }
+    }
+    return (p == limit) ? 0 : -1;
+}
+
+/*
+ * Добавление дорожки к упакованным данным.
+ */
+static void add_track(mfm_compact_t *z, const unsigned char *track, int nbytes)
+{
+    int i;
+
+    if (z->ntracks >= MAXTRACK) {
+        fprintf(mfm_err, "Too many tracks = %d, aborted.\n", z->ntracks + 1);
+        mfm_fail(MFM_ERR_FORMAT);
+    }
+    z->offset[z->ntracks++] = z->size;
+
+    /* Пустая дорожка не занимает места. */
+    for (i=0; i<nbytes && track[i] == 0; ++i)
+        continue;
+    if (i == nbytes)
+        return;
+
+    if (z->size + nbytes + nbytes/128 + 2 > z->alloc) {
+        z->alloc = 2 * z->alloc + nbytes + nbytes/128 + 2;
+        z->data = z_alloc(z->data, z->alloc);
+    }
+    z->size += mfm_compact_pack(track, nbytes, z->data + z->size);
+}
+
+/*
+ * Вывод данных в компактный файл: собираем целые дорожки
+ * и упаковываем их.
+ */
+void mfm_compact_write(mfm_compact_t *z, const unsigned char *buf,
+    size_t nbytes, int tracksz)
+{
+    size_t n;
+
+    while (nbytes > 0) {
+        if (z->fill == 0 && nbytes >= (size_t) tracksz) {
+            /* Целая дорожка, без копирования. */
+            add_track(z, buf, tracksz);
+            buf += tracksz;
+            nbytes -= tracksz;
+            continue;
+        }
+        n = tracksz - z->fill;
+        if (n > nbytes)
+            n = nbytes;
+        memcpy(z->track + z->fill, buf, n);
+        z->fill += n;
+        buf += n;
+        nbytes -= n;
+        if (z->fill == (size_t) tracksz) {
+            add_track(z, z->track, tracksz);
+            z->fill = 0;
+        }
+    }
+}
+
+/*
+ * Завершение компактного файла: неполная дорожка дополняется
+ * нулями. Возвращаем заголовок с таблицей смещений,
+ * за ним нужно вывести z->data.
+ */
+unsigned char *mfm_compact_finish(mfm_compact_t *z, int tracksz,
+    size_t *hsize)
+{
+    unsigned char *hdr;
+    int t;
+
+    if (z->fill > 0) {
+        memset(z->track + z->fill, 0, tracksz - z->fill);
+        add_track(z, z->track, tracksz);
+        z->fill = 0;
+    }
+    *hsize = Z_HEADER + 4 * (z->ntracks + 1);
+    hdr = z_alloc(0, *hsize);
+    memcpy(hdr, "MFMZ", 4);
+    hdr[4] = Z_VERSION;
+    hdr[5] = tracksz / TRACKSZ;
+    hdr[6] = z->ntracks;
+    hdr[7] = z->ntracks >> 8;
+    for (t=0; t<z->ntracks; ++t)
+        put32(hdr + Z_HEADER + 4*t, *hsize + z->offset[t]);
+    put32(hdr + Z_HEADER + 4*t, *hsize + z->size);
+    return hdr;
+}
+
+void mfm_compact_free(mfm_compact_t *z)
+{
+    if (z) {
+        free(z->data);
+        free(z);
+    }
+}
@@ -0,0 +1,323 @@
+/*
+ * Disk formats: decoding and encoding of tracks, common to all formats.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Стандартный промежуток между секторами для данного количества
+ * секторов на дорожке, или первый из таблицы формата.
+ */
+int mfm_std_sector_gap(const mfm_format_t *fmt, int nsectors)
+{
+    const mfm_gap_t *g;
+
+    for (g=fmt->gaps; g->nsectors; ++g)
+        if (g->nsectors == nsectors && g->gap)
+            return g->gap;
+    return fmt->gaps[0].gap;
+}
+
+/*
+ * Плотность записи для данного количества секторов на дорожке.
+ * Больше, чем в таблице, - наибольшая плотность формата.
+ */
+int mfm_density_of(const mfm_format_t *fmt, int nsectors)
+{
+    const mfm_gap_t *g;
+
+    for (g=fmt->gaps; g[1].nsectors; ++g)
+        if (g->nsectors >= nsectors)
+            break;
+    return g->density;
+}
+
+/*
+ * Записываем маркер, с нарушением правил MFM:
+ * нули для синхронизации, затем слова mark.
+ */
+void mfm_write_marker(mfm_writer_t *writer, int nzeros, unsigned mark,
+    int nmarks)
+{
+    int i;
+
+    for (i=0; i<nzeros; ++i)
+        mfm_write_byte(writer, 0);
+    for (i=0; i<nmarks; ++i)
+        mfm_write_word(writer, mark);
+}
+
+/*
+ * Разбор дорожек: задание mfm_read_format().
+ */
+typedef struct {
+    const mfm_format_t *fmt;
+    mfm_disk_t *d;
+    mfm_track_index_t *idx;
+    mfm_io_t *in;
+    mfm_track_index_t *tab;     /* indexes built in parallel, or 0 */
+    int ntracks;
+    FILE *fout;
+} read_job_t;
+
+static void read_tracks(void *arg)
+{
+    read_job_t *job = arg;
+    const mfm_format_t *fmt = job->fmt;
+    mfm_disk_t *d = job->d;
+    mfm_track_index_t *idx = job->idx, *tab = job->tab;
+    mfm_io_t *in = job->in;
+    int ntracks = job->ntracks;
+    FILE *fout = job->fout;
+    int t, s, i, nsectors, sector_size, dt;
+    int have_sector [MAXINDEX];
+
+    /* Распознаём количество секторов и их размер по нулевой дорожке. */
+    if (tab)
+        idx = &tab[0];
+    else {
+        mfm_index_seek(idx, in, 0);
+        fmt->index(idx);
+    }
+    sector_size = idx->nsectors ? idx->sect[0].nbytes : SECTSZ;
+
+    /* Стандартное количество секторов известно только для 512 байт. */
+    nsectors = (sector_size == SECTSZ) ? fmt->nsectors : 1;
+    for (i=0; i<idx->nsectors; ++i) {
+        s = idx->sect[i].sector;
+        if (s >= nsectors && s < MAXINDEX)
+            nsectors = s + 1;
+    }
+    mfm_disk_init(d, fout ? 1 : ntracks, nsectors, sector_size);
+
+    for (t=0; t<ntracks; ++t) {
+        if (tab)
+            idx = &tab[t];
+        else {
+            mfm_index_seek(idx, in, t);
+            fmt->index(idx);
+        }
+        dt = t;
+        if (fout) {
+            mfm_disk_init(d, 1, nsectors, sector_size);
+            dt = 0;
+        }
+        for (s=0; s<d->nsectors_per_track; ++s)
+            have_sector [s] = 0;
+        for (i=0; i<idx->nsectors; ++i) {
+            mfm_index_print(idx, idx->sect[i].diag_end);
+            s = idx->sect[i].sector;
+            if (s >= d->nsectors_per_track) {
+                fprintf(mfm_err, "Track %d/%d: too large sector number %d\n",
+                    t >> 1, t & 1, s + 1);
+                continue;
+            }
+            if (idx->sect[i].nbytes != sector_size) {
+                fprintf(mfm_err, "Track %d/%d: sector %d of %d bytes, "
+                    "expected %d\n", t >> 1, t & 1, s + 1,
+                    idx->sect[i].nbytes, sector_size);
+                continue;
+            }
+            /* Сектора могут следовать в произвольном порядке. */
+            have_sector [s] = 1;
+            memcpy(mfm_block(d, dt, s), idx->data[i], sector_size);
+        }
+        mfm_index_print(idx, -1);
+
+        /* Проверим, что получили все сектора. */
+        for (s=0; s<d->nsectors_per_track; ++s)
+            if (! have_sector [s])
+                break;
+        if (s < d->nsectors_per_track) {
+            fprintf(mfm_err, "Track %d/%d: no sector",
+                t >> 1, t & 1);
+            for (; s<d->nsectors_per_track; ++s)
+                if (! have_sector [s]) {
+                    fprintf(mfm_err, " %d", s);
+                    mfm_count(missing, 1);
+                }
+            fprintf(mfm_err, "\n");
+        }
+        if (fout)
+            mfm_write_raw(d, fout);
+    }
+}
+
+/*
+ * Читаем дискету из MFM-файла. Количество дорожек (до 160)
+ * задаётся параметром ntracks. Если задан fout, образ d хранит
+ * одну дорожку, которая выводится в fout сразу после декодирования.
+ */
+void mfm_read_format(const mfm_format_t *fmt, mfm_disk_t *d,
+    mfm_track_index_t *idx, mfm_io_t *in, int ntracks, FILE *fout)
+{
+    read_job_t job;
+    int error;
+
+    job.fmt = fmt;
+    job.d = d;
+    job.idx = idx;
+    job.in = in;
+    job.ntracks = ntracks;
+    job.fout = fout;
+
+    /* Дорожки независимы: при возможности строим оглавления
+     * параллельно, а результаты обрабатываем по порядку.
+     * При ошибке массив оглавлений тоже освобождаем. */
+    job.tab = mfm_index_parallel(in, ntracks, fmt->index);
+    error = mfm_catch(read_tracks, &job);
+    if (job.tab)
+        mfm_index_release(job.tab, ntracks);
+    if (error != MFM_OK)
+        mfm_fail(error);
+}
+
+/*
+ * Исследуем и печатаем информацию о дискете из MFM-файла.
+ * Количество дорожек (до 160) задаётся параметром ntracks.
+ */
+void mfm_analyze_format(const mfm_format_t *fmt, mfm_track_index_t *idx,
+    mfm_io_t *in, int ntracks)
+{
+    int t, s, i, nsectors_per_track;
+    int have_sector [MAXINDEX];
+
+    fprintf(mfm_err, "Format: %s\n", fmt->name);
+    for (t=0; t<ntracks; ++t) {
+        fprintf(mfm_err, "\n");
+        mfm_index_seek(idx, in, t);
+        fmt->index(idx);
+        for (s=0; s<MAXINDEX; ++s)
+            have_sector [s] = 0;
+        nsectors_per_track = 0;
+        for (i=0; i<idx->nsectors; ++i) {
+            mfm_index_print(idx, idx->sect[i].diag_end);
+            s = idx->sect[i].sector;
+            if (s >= MAXINDEX) {
+                fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
+                    s+1);
+                mfm_fail(MFM_ERR_FORMAT);
+            }
+            if (s >= nsectors_per_track)
+                nsectors_per_track = s + 1;
+
+            /* Сектора могут следовать в произвольном порядке. */
+            have_sector [s] = 1;
+        }
+        mfm_index_print(idx, -1);
+        fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
+            t >> 1, t & 1, nsectors_per_track);
+        if (nsectors_per_track < 1)
+            continue;
+
+        fprintf(mfm_err, "Order of sectors:");
+        for (i=0; i<idx->nsectors; ++i) {
+            fprintf(mfm_err, " %d", idx->sect[i].sector + 1);
+        }
+        fprintf(mfm_err, "\n");
+
+        fprintf(mfm_err, "Sector gap:");
+        for (i=0; i<idx->nsectors; ++i) {
+            fprintf(mfm_err, " %d", idx->sect[i].sector_gap - fmt->mark_bytes*8);
+        }
+        fprintf(mfm_err, " bits (std %d)\n",
+            mfm_std_sector_gap(fmt, nsectors_per_track) * 8);
+
+        if (fmt->data_gap) {
+            fprintf(mfm_err, "Data gap:");
+            for (i=0; i<idx->nsectors; ++i) {
+                fprintf(mfm_err, " %d", idx->sect[i].data_gap - fmt->mark_bytes*8);
+            }
+            fprintf(mfm_err, " bits (std %d)\n", fmt->data_gap * 8);
+        }
+
+        /* Проверим, что получили все сектора. */
+        for (s=0; s<nsectors_per_track; ++s) {
+            if (! have_sector [s])
+                fprintf(mfm_err, "No sector %d\n", s + 1);
+        }
+    }
+}
+
+/*
+ * Записываем MFM-образ флоппи-диска. Если задан fin, образ d
+ * хранит одну дорожку: очередная дорожка читается из fin перед
+ * кодированием, до конца файла.
+ * Дорожка строится один раз, по образцу: промежутки и маркеры
+ * одинаковы для всех дорожек. Для каждой дорожки в образец
+ * вписываются только поля секторов.
+ */
+void mfm_write_format(const mfm_format_t *fmt, mfm_disk_t *d, FILE *fin,
+    mfm_io_t *out)
+{
+    mfm_writer_t writer;
+    int pos [2*MAXINDEX];
+    int t, dt, stage;
+
+    /* Длина дорожки - по плотности записи. Таблица плотностей
+     * дана для секторов по 512 байтов, большие сектора считаем
+     * за несколько. */
+    mfm_io_density(out, mfm_density_of(fmt,
+        d->nsectors_per_track * d->sector_size / SECTSZ));
+
+    if (mfm_verbose && ! fin)
+        fprintf(mfm_err, "Creating %d tracks, %d sectors per track\n",
+            d->ntracks, d->nsectors_per_track);
+    if (d->nsectors_per_track > MAXINDEX) {
+        fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
+            d->nsectors_per_track);
+        mfm_fail(MFM_ERR_ARG);
+    }
+    stage = mfm_stage(MFM_STAGE_ENCODE);
+
+    mfm_write_reset(&writer, out);
+    writer.io = 0;
+    fmt->layout(fmt, &writer, d, pos);
+
+    for (t=0; fin || t<d->ntracks; ++t) {
+        dt = t;
+        if (fin) {
+            mfm_stage(MFM_STAGE_IO);
+            if (! mfm_read_raw_track(d, fin))
+                break;
+            mfm_stage(MFM_STAGE_ENCODE);
+            if (t >= MAXTRACK) {
+                fprintf(mfm_err, "Too many tracks, aborted.\n");
+                mfm_fail(MFM_ERR_ARG);
+            }
+            dt = 0;
+        }
+        fmt->patch(&writer, pos, d, t, dt);
+        mfm_io_write(out, writer.buf, writer.nhalfbits >> 3);
+        mfm_count(tracks_written, 1);
+    }
+    mfm_io_flush(out);
+    mfm_stage(stage);
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Initial corpus for fuzz-scp: SCP files of one track, cut down
+# to a few sectors, in all formats mfmdisk writes.
+# Run from the src directory, after make: fuzz/mkcorpus.sh
+#
+set -e
+mfmdisk=./mfmdisk
+dir=fuzz/scp
+tmp=/tmp/mkcorpus$$
+nsamples=8000                   # about two sectors of DD track
+trap 'rm -f $tmp.img $tmp.scp' 0
+
+# Little endian 32-bit word, as octal escapes for printf.
+le32() {
+    printf '\\%03o\\%03o\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)) \
+        $(($1 >> 16 & 255)) $(($1 >> 24 & 255))
+}
+
+# Name, image size in bytes, mfmdisk options.
+seed() {
+    yes "$1" | head -c $2 > $tmp.img
+    shift 2
+    $mfmdisk "$@" -c $tmp.scp $tmp.img
+    (
+        # Disk header, with track 0 only.
+        head -c 20 $tmp.scp
+        head -c 672 /dev/zero | tail -c 668
+        # Track header, with the sample count of revolution 0.
+        dd if=$tmp.scp bs=1 skip=688 count=8 2>/dev/null
+        printf "$(le32 $nsamples)"
+        dd if=$tmp.scp bs=1 skip=700 count=4 2>/dev/null
+        # Samples.
+        dd if=$tmp.scp bs=2 skip=352 count=$nsamples 2>/dev/null
+    ) > $dir/$name.scp
+}
+
+name=ibmpc_dd;  seed $name 9216
+name=ibmpc_hd;  seed $name 18432 -s 18
+name=ibmpc_ed;  seed $name 36864 -s 36
+name=bk;        seed $name 10240 -b
+name=amiga_dd;  seed $name 11264 -a
+name=amiga_hd;  seed $name 22528 -a -s 22
@@ -0,0 +1,107 @@
+/*
+ * Fuzzing of SCP reader and sector parsers, for libFuzzer.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "config.h"
+#include "mfm.h"
+#include "scp.h"
+
+/*
+ * Цель для libFuzzer: входные данные - файл SCP. Проверяем
+ * разбор заголовков (scp_open), выбор дорожек и отсчёты потока
+ * всех оборотов (scp_select_track, scp_read_flux), затем
+ * декодирование MFM и сектора IBM PC и Amiga (scp_read_disk).
+ * Сборка: configure находит -fsanitize=fuzzer, например с CC=clang.
+ * Запуск: ./fuzz-scp fuzz/scp, начальный набор строит
+ * fuzz/mkcorpus.sh.
+ */
+static char scp_name[32];               /* the file by descriptor */
+static int scp_fd = -1;
+
+static mfm_disk_t disk;
+static mfm_track_index_t idx;
+
+/*
+ * Все дорожки и все обороты, по заголовкам файла.
+ */
+static void fuzz_tracks(void *arg)
+{
+    scp_file_t *sf = arg;
+    const uint32_t *flux;
+    unsigned tn, rev;
+
+    for (tn=0; tn<TRACK_MAX; ++tn) {
+        if (scp_select_track(sf, tn) < 0)
+            continue;
+        for (rev=0; rev<sf->header.nr_revolutions; ++rev)
+            scp_read_flux(sf, rev, &flux);
+    }
+}
+
+/*
+ * Сектора со всех оборотов, с определением формата.
+ */
+static void fuzz_sectors(void *arg)
+{
+    scp_read_disk(&disk, &idx, scp_name, -1, -1);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    scp_file_t sf;
+
+    if (scp_fd < 0) {
+        /* Временный файл удаляем сразу, открываем по дескриптору. */
+        char tmpl[] = "/tmp/fuzzscpXXXXXX";
+
+        scp_fd = mkstemp(tmpl);
+        mfm_err = fopen("/dev/null", "w");
+        if (scp_fd < 0 || ! mfm_err) {
+            perror(tmpl);
+            exit(-1);
+        }
+        unlink(tmpl);
+        sprintf(scp_name, "/proc/self/fd/%d", scp_fd);
+    }
+    if (ftruncate(scp_fd, 0) < 0 ||
+        pwrite(scp_fd, data, size, 0) != (ssize_t) size) {
+        perror(scp_name);
+        exit(-1);
+    }
+
+    if (scp_open(&sf, scp_name) == MFM_OK) {
+        mfm_catch(fuzz_tracks, &sf);
+        scp_close(&sf);
+    }
+    mfm_catch(fuzz_sectors, 0);
+    mfm_disk_free(&disk);
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * HFE output for HxC and Gotek floppy emulators.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Формат HFE версии 1, все числа little-endian.
+ * Блок 0 - заголовок:
+ *
+ *   0  8  "HXCPICFE"
+ *   8  1  версия, 0
+ *   9  1  количество цилиндров
+ *  10  1  количество сторон, 2
+ *  11  1  кодирование: 0 - MFM IBM PC, 1 - MFM Amiga
+ *  12  2  скорость, кбит/сек
+ *  14  2  скорость вращения, об/мин, 0 - по умолчанию
+ *  16  1  режим интерфейса дисковода
+ *  17  1  не используется
+ *  18  2  номер блока таблицы цилиндров, 1
+ *  20  1  запись разрешена, ff
+ *  21  1  одинарный шаг, ff
+ *  22  4  особое кодирование дорожки 0, ff - нет
+ *
+ * Блок 1 - таблица цилиндров: номер первого блока и длина
+ * данных в байтах, по 2 байта. Данные цилиндра идут блоками
+ * по 512 байтов: 256 байтов стороны 0, затем 256 байтов
+ * стороны 1. Биты в байте передаются младшим вперёд.
+ */
+#define HFE_BLOCK       512
+#define HFE_HEADER      (2 * HFE_BLOCK) /* header and cylinder table */
+
+#define HFE_IBMPC_DD    0x00            /* floppy interface modes */
+#define HFE_IBMPC_HD    0x01
+#define HFE_AMIGA_DD    0x04
+#define HFE_AMIGA_HD    0x05
+
+/*
+ * Байт дорожки в порядке битов HFE: младший бит вперёд.
+ */
+static inline unsigned char reverse(unsigned char b)
+{
+    b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+    b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+/*
+ * Вывод в формате HFE. Данные цилиндров выводятся по мере
+ * записи дорожек, заголовок - в конце, на место в начале
+ * файла, поэтому канал для вывода не годится.
+ */
+void mfm_io_hfe(mfm_io_t *io, int amiga)
+{
+    if (io->hout)
+        return;
+    if (io->mode == MFM_IO_STREAM && lseek(io->fd, 0, SEEK_CUR) < 0) {
+        fprintf(mfm_err, "HFE file cannot be written to a pipe, aborted.\n");
+        mfm_fail(MFM_ERR_ARG);
+    }
+    io->hout = calloc(1, sizeof(mfm_hfe_t));
+    if (! io->hout) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+    io->hout->amiga = amiga;
+}
+
+/*
+ * Добавление дорожки: стороны цилиндра перемежаются блоками.
+ * Цилиндр выводится, когда записаны обе стороны.
+ */
+static void add_track(mfm_io_t *io, const unsigned char *track, int tracksz)
+{
+    mfm_hfe_t *h = io->hout;
+    unsigned char *p;
+    int side = h->ntracks & 1;
+    int i;
+
+    if (tracksz > TRACKSZ * MFM_DENSITY_HD) {
+        fprintf(mfm_err, "HFE file cannot hold tracks of extra high "
+            "density, aborted.\n");
+        mfm_fail(MFM_ERR_ARG);
+    }
+    if (h->ntracks >= MAXTRACK) {
+        fprintf(mfm_err, "Too many tracks = %d, aborted.\n", h->ntracks + 1);
+        mfm_fail(MFM_ERR_FORMAT);
+    }
+    if (h->ntracks == 0) {
+        /* Место для заголовка. */
+        memset(h->cyl, 0xff, HFE_HEADER);
+        mfm_io_output(io, h->cyl, HFE_HEADER);
+    }
+    for (i=0; i<tracksz; ++i) {
+        p = h->cyl + (i / (HFE_BLOCK/2)) * HFE_BLOCK +
+            side * (HFE_BLOCK/2) + i % (HFE_BLOCK/2);
+        *p = reverse(track[i]);
+    }
+    h->ntracks++;
+    if (side)
+        mfm_io_output(io, h->cyl, 2 * tracksz);
+}
+
+/*
+ * Вывод данных в HFE-файл: собираем целые дорожки.
+ */
+void mfm_hfe_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes)
+{
+    mfm_hfe_t *h = io->hout;
+    size_t tracksz = io->tracksz, n;
+
+    while (nbytes > 0) {
+        if (h->fill == 0 && nbytes >= tracksz) {
+            /* Целая дорожка, без копирования. */
+            add_track(io, buf, tracksz);
+            buf += tracksz;
+            nbytes -= tracksz;
+            continue;
+        }
+        n = tracksz - h->fill;
+        if (n > nbytes)
+            n = nbytes;
+        memcpy(h->track + h->fill, buf, n);
+        h->fill += n;
+        buf += n;
+        nbytes -= n;
+        if (h->fill == tracksz) {
+            add_track(io, h->track, tracksz);
+            h->fill = 0;
+        }
+    }
+}
+
+static void put16(unsigned char *p, unsigned val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+/*
+ * Завершение HFE-файла: неполная дорожка дополняется нулями,
+ * недостающая вторая сторона - пустой дорожкой MFM.
+ * Заголовок и таблицу цилиндров пишем в начало файла.
+ */
+void mfm_hfe_finish(mfm_io_t *io)
+{
+    mfm_hfe_t *h = io->hout;
+    int tracksz = io->tracksz, density = tracksz / TRACKSZ;
+    int ncyl, c, nblocks;
+    unsigned char *hdr;
+
+    if (h->fill > 0) {
+        memset(h->track + h->fill, 0, tracksz - h->fill);
+        add_track(io, h->track, tracksz);
+        h->fill = 0;
+    }
+    if (h->ntracks & 1) {
+        memset(h->track, 0xaa, tracksz);
+        add_track(io, h->track, tracksz);
+    }
+    if (h->ntracks == 0) {
+        memset(h->cyl, 0xff, HFE_HEADER);
+        mfm_io_output(io, h->cyl, HFE_HEADER);
+    }
+
+    hdr = h->cyl;
+    memset(hdr, 0xff, HFE_HEADER);
+    ncyl = h->ntracks / 2;
+    memcpy(hdr, "HXCPICFE", 8);
+    hdr[8] = 0;
+    hdr[9] = ncyl;
+    hdr[10] = 2;
+    hdr[11] = h->amiga ? 1 : 0;
+    put16(hdr + 12, 250 * density);
+    put16(hdr + 14, 0);
+    if (h->amiga)
+        hdr[16] = (density > 1) ? HFE_AMIGA_HD : HFE_AMIGA_DD;
+    else
+        hdr[16] = (density > 1) ? HFE_IBMPC_HD : HFE_IBMPC_DD;
+    hdr[17] = 0;
+    put16(hdr + 18, 1);
+
+    nblocks = 2 * tracksz / HFE_BLOCK;
+    for (c=0; c<ncyl; ++c) {
+        put16(hdr + HFE_BLOCK + 4*c, HFE_HEADER / HFE_BLOCK + c * nblocks);
+        put16(hdr + HFE_BLOCK + 4*c + 2, 2 * tracksz);
+    }
+    mfm_io_update(io, 0, 0, hdr, HFE_HEADER);
+}
+
+void mfm_hfe_free(mfm_hfe_t *h)
+{
+    free(h);
+}
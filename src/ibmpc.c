@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "config.h"
 #include "mfm.h"
 
@@ -70,6 +71,102 @@ static const unsigned short poly_tab [256] = {
     0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
 };
 
+/*
+ * Byte at a time, with poly_tab.
+ */
+static unsigned short crc16_bytewise(unsigned short sum,
+    unsigned const char *buf, unsigned int len)
+{
+    while (len--) {
+        sum = (sum << 8) ^ poly_tab [*buf++ ^ (sum >> 8)];
+    }
+    return sum;
+}
+
+/*
+ * Bit at a time, straight from the polynomial x^16 + x^12 + x^5 + 1.
+ * Reference for the table versions, see mfm_codec_ref.
+ */
+unsigned short mfm_crc16_ref(unsigned short sum, const unsigned char *buf,
+    unsigned len)
+{
+    int i;
+
+    while (len--) {
+        sum ^= *buf++ << 8;
+        for (i=0; i<8; ++i)
+            sum = (sum & 0x8000) ? (sum << 1) ^ 0x1021 : sum << 1;
+    }
+    return sum;
+}
+
+/*
+ * Slicing-by-8 tables: slice_tab[k][b] is the sum of byte b
+ * followed by k zero bytes, starting from zero.  Built once
+ * from poly_tab, and checked against it.
+ */
+static unsigned short slice_tab [8] [256];
+static pthread_once_t slice_once = PTHREAD_ONCE_INIT;
+static int slice_ok;
+
+static unsigned short crc16_sliced(unsigned short sum,
+    unsigned const char *buf, unsigned int len)
+{
+    while (len >= 8) {
+        sum ^= buf[0] << 8 | buf[1];
+        sum = slice_tab [7] [sum >> 8] ^ slice_tab [6] [sum & 0xff] ^
+              slice_tab [5] [buf[2]] ^ slice_tab [4] [buf[3]] ^
+              slice_tab [3] [buf[4]] ^ slice_tab [2] [buf[5]] ^
+              slice_tab [1] [buf[6]] ^ slice_tab [0] [buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    return crc16_bytewise(sum, buf, len);
+}
+
+static void slice_init(void)
+{
+    /* Header, data and plain seeds. */
+    static const unsigned short seed [] = { 0xb230, 0xcdb4, 0xffff };
+    unsigned char test [SECTSZ + 7];
+    int k, b, len, i;
+
+    for (b=0; b<256; ++b)
+        slice_tab [0] [b] = poly_tab [b];
+    for (k=1; k<8; ++k)
+        for (b=0; b<256; ++b)
+            slice_tab [k] [b] = (slice_tab [k-1] [b] << 8) ^
+                poly_tab [slice_tab [k-1] [b] >> 8];
+
+    /* Self-test: the same sums as byte at a time, for all
+     * tail lengths. Otherwise stay with the plain table. */
+    for (b=0; b<(int) sizeof(test); ++b)
+        test [b] = b * 167 + 13;
+    slice_ok = 1;
+    for (len=SECTSZ; len<(int) sizeof(test); ++len) {
+        for (i=0; i<(int) (sizeof(seed) / sizeof(seed[0])); ++i) {
+            if (crc16_sliced(seed[i], test, len) !=
+                crc16_bytewise(seed[i], test, len)) {
+                fprintf(mfm_err, "CRC self-test failed, using slow CRC\n");
+                slice_ok = 0;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Table version: sliced when the tables passed the self-test.
+ */
+unsigned short mfm_crc16(unsigned short sum, const unsigned char *buf,
+    unsigned len)
+{
+    pthread_once(&slice_once, slice_init);
+    if (slice_ok)
+        return crc16_sliced(sum, buf, len);
+    return crc16_bytewise(sum, buf, len);
+}
+
 /*
  * Calculate a new sum given the current sum and the new data.
  * Use 0xffff as the initial sum value.
@@ -78,19 +175,19 @@ static const unsigned short poly_tab [256] = {
 static unsigned short crc16_ccitt(unsigned short sum,
     unsigned const char *buf, unsigned int len)
 {
-    while (len--) {
-        sum = (sum << 8) ^ poly_tab [*buf++ ^ (sum >> 8)];
-    }
+    int stage = mfm_stage(MFM_STAGE_CRC);
+
+    sum = mfm_codec->crc16(sum, buf, len);
+    mfm_stage(stage);
     return sum;
 }
 
 static unsigned short crc16_ccitt_byte(unsigned short sum, unsigned char byte)
 {
-    sum = (sum << 8) ^ poly_tab [byte ^ (sum >> 8)];
-    return sum;
+    return mfm_codec->crc16(sum, &byte, 1);
 }
 
-static int print_gap(unsigned long history, int printed)
+static int print_gap(FILE *err, unsigned long history, int printed)
 {
     int byte;
 
@@ -108,35 +205,29 @@ static int print_gap(unsigned long history, int printed)
         printed == (unsigned char) (history >> 6) ||
         printed == (unsigned char) (history >> 7))
         return printed;
-    fprintf(mfm_err, "Fill: %d%d%d%d%d%d%d%d\n",
+    fprintf(err, "Fill: %d%d%d%d%d%d%d%d\n",
         byte >> 7 & 1, byte >> 6 & 1, byte >> 5 & 1, byte >> 4 & 1,
         byte >> 3 & 1, byte >> 2 & 1, byte >> 1 & 1, byte & 1);
     return byte;
 }
 
 /*
- * Поиск идентификатора сектора на дискете формата IBM PC.
+ * Печать заполнителей зазора, от текущей позиции до end.
+ * Зазор просматривается по битам, только в режиме отладки.
  */
-int mfm_scan_ibmpc(mfm_reader_t *reader, int *nbits_read)
+static void print_gaps(mfm_reader_t *reader, int end)
 {
-    int bit, tag, gap_printed = 0;
+    int bit, halfbit, gap_printed = 0;
     unsigned long history;
 
+    halfbit = reader->halfbit;
     history = 0x13713713;
-    if (nbits_read)
-        *nbits_read = 0;
-    for (;;) {
+    while (reader->halfbit < end) {
         bit = mfm_read_bit(reader);
-        if (bit < 0) {
-            if (mfm_verbose && nbits_read)
-                fprintf(mfm_err, "Track %d/%d: final gap %d bits\n",
-                    reader->track >> 1, reader->track & 1, *nbits_read);
-            return -1;
-        }
+        if (bit < 0)
+            break;
         history = history << 1 | bit;
         history &= 0xffffffff;
-        if (nbits_read)
-            ++*nbits_read;
 
         /* Все единицы - подсинхронизовываемся на полубит. */
         if (history == 0xffffffff) {
@@ -144,49 +235,71 @@ int mfm_scan_ibmpc(mfm_reader_t *reader, int *nbits_read)
             history = 0;
             continue;
         }
+        gap_printed = print_gap(reader->err, history, gap_printed);
+    }
+    reader->halfbit = halfbit;
+}
+
+/*
+ * Промежуток до маркера считается до его конца: в него входят
+ * 12 байтов нулей и три байта A1.
+ */
+#define MARK_BYTES      15
 
-        if (mfm_verbose > 1)
-            gap_printed = print_gap(history, gap_printed);
+/*
+ * Поиск идентификатора сектора на дискете формата IBM PC.
+ * Ждем маркер 00-a1-a1-a1 или 00-c2-c2-c2.
+ */
+int mfm_scan_ibmpc(mfm_reader_t *reader, int *nbits_read)
+{
+    const mfm_mark_t *m;
+    int end;
 
-        /* Формат IBM PC: ждем 00-a1-a1-a1 или 00-c2-c2-c2. */
-        if (history == 0x00a1a1a1 || history == 0x00c2c2c2) {
-            /* Нашли маркер, читаем и возвращаем его тег. */
-            tag = mfm_read_byte(reader);
-            return tag;
-        }
+    m = mfm_next_mark(reader, MFM_SYNC_IBMPC | MFM_SYNC_INDEX);
+    end = m ? m->halfbit : reader->nhalfbits;
+    if (mfm_verbose > 1)
+        print_gaps(reader, end);
+    if (nbits_read)
+        *nbits_read = (end - reader->halfbit) / 2;
+    reader->halfbit = end;
+    if (! m) {
+        if (mfm_verbose && nbits_read)
+            fprintf(reader->err, "Track %d/%d: final gap %d bits\n",
+                reader->track >> 1, reader->track & 1, *nbits_read);
+        return -1;
     }
+
+    /* Нашли маркер, читаем и возвращаем его тег. */
+    return mfm_read_byte(reader);
 }
 
 /*
  * Чтение очередного сектора с дискеты формата IBM PC.
+ * Положение и параметры сектора запоминаем в sect.
  */
 int mfm_read_sector_ibmpc(mfm_reader_t *reader, unsigned char *data,
-    int *sector_gap, int *data_gap)
+    mfm_sector_t *sect)
 {
-    int tag, cylinder, head, track, sector, size, gap, i;
+    int tag, cylinder, head, track, sector, size, nbytes, gap;
     unsigned short header_sum, data_sum, my_header_sum, my_data_sum;
 
-    if (sector_gap)
-        *sector_gap = 0;
+    sect->sector_gap = 0;
     for (;;) {
         tag = mfm_scan_ibmpc(reader, &gap);
-        if (sector_gap)
-            *sector_gap += gap;
+        sect->sector_gap += gap;
         if (tag < 0)
             return -1;
         if (tag != 0xfe) {
             if (mfm_verbose) {
-                fprintf(mfm_err, "Track %d/%d: tag %02X",
-                    reader->track >> 1, reader->track & 1, tag);
-                if (sector_gap) {
-                    fprintf(mfm_err, ", gap %d bits", *sector_gap - 15*8);
-                    *sector_gap = 0;
-                }
-                fprintf(mfm_err, "\n");
+                fprintf(reader->err, "Track %d/%d: tag %02X, gap %d bits\n",
+                    reader->track >> 1, reader->track & 1, tag,
+                    sect->sector_gap - MARK_BYTES*8);
+                sect->sector_gap = 0;
             }
             continue;
         }
-ident:  cylinder = mfm_read_byte(reader);
+ident:  sect->id_halfbit = reader->halfbit - 16;
+        cylinder = mfm_read_byte(reader);
         head = mfm_read_byte(reader);
         sector = mfm_read_byte(reader);
         size = mfm_read_byte(reader);
@@ -198,277 +311,317 @@ ident:  cylinder = mfm_read_byte(reader);
         my_header_sum = crc16_ccitt_byte(my_header_sum, sector);
         my_header_sum = crc16_ccitt_byte(my_header_sum, size);
         if (my_header_sum != header_sum) {
-            fprintf(mfm_err, "Track %d/%d: header sum %04x, expected %04x\n",
+            mfm_count(header_errors, 1);
+            fprintf(reader->err, "Track %d/%d: header sum %04x, expected %04x\n",
                 reader->track >> 1, reader->track & 1,
                 my_header_sum, header_sum);
             continue;
         }
         track = cylinder * 2 + head;
         if (track != reader->track) {
-            fprintf(mfm_err, "Track %d/%d sector %d: incorrect c/h = %d/%d\n",
+            fprintf(reader->err, "Track %d/%d sector %d: incorrect c/h = %d/%d\n",
                 reader->track >> 1, reader->track & 1,
                 sector, cylinder, head);
         }
-        if (size != 2) {
-            fprintf(mfm_err, "Track %d/%d sector %d: incorrect block size = %d\n",
+        /* Размер сектора 128 << size, от 128 до 1024 байтов. */
+        nbytes = 128 << size;
+        if (size > 3) {
+            fprintf(reader->err, "Track %d/%d sector %d: incorrect block size = %d\n",
                 reader->track >> 1, reader->track & 1, sector, size);
+            nbytes = SECTSZ;
         }
-        tag = mfm_scan_ibmpc(reader, data_gap);
+        tag = mfm_scan_ibmpc(reader, &sect->data_gap);
         if (tag < 0)
             return -1;
         if (tag == 0xfe) {
-            if (sector_gap)
-                *sector_gap += *data_gap + 6*8;
+            sect->sector_gap += sect->data_gap + 6*8;
             if (mfm_verbose)
-                fprintf(mfm_err, "Track %d/%d sector %d: incorrect data tag %02X\n",
+                fprintf(reader->err, "Track %d/%d sector %d: incorrect data tag %02X\n",
                     reader->track >> 1, reader->track & 1, sector, tag);
             goto ident;
         }
         if (tag != 0xfb) {
-            fprintf(mfm_err, "Track %d/%d sector %d: invalid tag %02X\n",
+            fprintf(reader->err, "Track %d/%d sector %d: invalid tag %02X\n",
                 reader->track >> 1, reader->track & 1, sector, tag);
         }
-        for (i=0; i<SECTSZ; ++i)
-            data[i] = mfm_read_byte(reader);
+        sect->data_halfbit = reader->halfbit;
+        sect->tag = tag;
+        mfm_read_bytes(reader, data, nbytes);
         data_sum = mfm_read_byte(reader) << 8;
         data_sum |= mfm_read_byte(reader);
 
         my_data_sum = crc16_ccitt_byte(0xcdb4, tag);
-        my_data_sum = crc16_ccitt(my_data_sum, data, SECTSZ);
-        if (my_data_sum != data_sum) {
-            fprintf(mfm_err, "Track %d/%d sector %d: data sum %04x, expected %04x\n",
+        my_data_sum = crc16_ccitt(my_data_sum, data, nbytes);
+        sect->data_ok = (my_data_sum == data_sum);
+        if (! sect->data_ok) {
+            mfm_count(data_errors, 1);
+            fprintf(reader->err, "Track %d/%d sector %d: data sum %04x, expected %04x\n",
                 reader->track >> 1, reader->track & 1,
                 sector, my_data_sum, data_sum);
         }
+        sect->sector = sector - 1;
+        sect->cylinder = cylinder;
+        sect->head = head;
+        sect->size = size;
+        sect->nbytes = nbytes;
         return sector - 1;
     }
 }
 
 /*
- * Читаем дискету IBM PC из MFM-файла. Количество дорожек (до 160)
- * задаётся параметром ntracks.
+ * Строим оглавление дорожки IBM PC.
+ * Если оно уже построено, повторно дорожку не просматриваем.
  */
-void mfm_read_ibmpc(mfm_disk_t *d, FILE *fin, int ntracks)
+void mfm_index_ibmpc(mfm_track_index_t *idx)
 {
-    int t, s;
-    mfm_reader_t reader;
-    unsigned char block [SECTSZ];
-    int have_sector [MAXSECT];
-
-    d->ntracks = ntracks;
-    d->nsectors_per_track = 10;
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        for (;;) {
-            s = mfm_read_sector_ibmpc(&reader, block, 0, 0);
-            if (s < 0)
-                break;
-            if (s >= d->nsectors_per_track) {
-                fprintf(mfm_err, "Track %d/%d: too large sector number %d\n",
-                    t >> 1, t & 1, s + 1);
-                continue;
-            }
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            memcpy(d->block[t][s], block, SECTSZ);
-        }
-        /* Разпознаём количество секторов. */
-        if (t == 0 && ! have_sector [9])
-            d->nsectors_per_track = 9;
-
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<d->nsectors_per_track; ++s)
-            if (! have_sector [s])
-                break;
-        if (s < d->nsectors_per_track) {
-            fprintf(mfm_err, "Track %d/%d: no sector",
-                t >> 1, t & 1);
-            for (; s<d->nsectors_per_track; ++s)
-                if (! have_sector [s])
-                    fprintf(mfm_err, " %d", s);
-            fprintf(mfm_err, "\n");
-        }
-    }
+    if (idx->format == MFM_SYNC_IBMPC)
+        return;
+
+    /* На сектор два маркера: заголовка и данных. */
+    mfm_index_build(idx, MFM_SYNC_IBMPC, mfm_read_sector_ibmpc, 2, 0);
+}
+
+void mfm_read_ibmpc(mfm_disk_t *d, mfm_track_index_t *idx, mfm_io_t *in, int ntracks)
+{
+    mfm_read_format(&mfm_format_ibmpc, d, idx, in, ntracks, 0);
 }
 
 /*
- * Исследуем и печатаем информацию о дискете IBM PC из MFM-файла.
- * Количество дорожек (до 160) задаётся параметром ntracks.
+ * Потоковое чтение: сектора каждой дорожки выводим в fout,
+ * не накапливая образ в памяти. Количество секторов
+ * определяется по нулевой дорожке.
  */
-void mfm_analyze_ibmpc(FILE *fin, int ntracks)
+void mfm_read_ibmpc_stream(mfm_track_index_t *idx, mfm_io_t *in, FILE *fout)
 {
-    int t, s, i, nsectors_per_track;
-    mfm_reader_t reader;
-    unsigned char block [SECTSZ];
-    int have_sector [MAXSECT];
-    int order_of_sectors [MAXSECT];
-    int sector_gap [MAXSECT];
-    int data_gap [MAXSECT];
-
-    fprintf(mfm_err, "Format: IBM PC\n");
-    for (t=0; t<ntracks; ++t) {
-        fprintf(mfm_err, "\n");
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        nsectors_per_track = 0;
-        for (i=0; ; ++i) {
-            s = mfm_read_sector_ibmpc(&reader, block,
-                &sector_gap[i], &data_gap[i]);
-            if (s < 0)
-                break;
-            if (s >= MAXSECT) {
-                fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
-                    s+1);
-                exit(-1);
-            }
-            if (s >= nsectors_per_track)
-                nsectors_per_track = s + 1;
-
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            order_of_sectors [i] = s;
-        }
-        fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
-            t >> 1, t & 1, nsectors_per_track);
-        if (nsectors_per_track < 1)
-            continue;
+    mfm_disk_t d;
 
-        fprintf(mfm_err, "Order of sectors:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", order_of_sectors[s] + 1);
-        }
-        fprintf(mfm_err, "\n");
+    memset(&d, 0, sizeof(d));
+    mfm_read_format(&mfm_format_ibmpc, &d, idx, in, MAXTRACK, fout);
+    mfm_disk_free(&d);
+}
 
-        fprintf(mfm_err, "Sector gap:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", sector_gap[s] - 15*8);
-        }
-        fprintf(mfm_err, " bits (std %d)\n",
-            (nsectors_per_track == 10) ? 46*8 : 80*8);
+void mfm_analyze_ibmpc(mfm_track_index_t *idx, mfm_io_t *in, int ntracks)
+{
+    mfm_analyze_format(&mfm_format_ibmpc, idx, in, ntracks);
+}
 
-        fprintf(mfm_err, "Data gap:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", data_gap[s] - 15*8);
-        }
-        fprintf(mfm_err, " bits (std %d)\n", 22*8);
+/*
+ * Идентификатор сектора и его контрольная сумма, 6 байтов.
+ * Код размера: 128 << id[3] байтов.
+ */
+static void make_ident(unsigned char *id, int t, int s, int sector_size)
+{
+    int sum, size = 0;
+
+    while ((128 << size) < sector_size)
+        size++;
+    id[0] = t >> 1;
+    id[1] = t & 1;
+    id[2] = s + 1;
+    id[3] = size;
+
+    sum = crc16_ccitt_byte(0xb230, id[0]);
+    sum = crc16_ccitt_byte(sum, id[1]);
+    sum = crc16_ccitt_byte(sum, id[2]);
+    sum = crc16_ccitt_byte(sum, id[3]);
+
+    id[4] = sum >> 8;
+    id[5] = sum;
+}
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<nsectors_per_track; ++s) {
-            if (! have_sector [s])
-                fprintf(mfm_err, "No sector %d\n", s + 1);
-        }
+/*
+ * Образец дорожки IBM PC: промежутки, маркеры и теги.
+ * Запоминаем положение полей, которые меняются:
+ * идентификаторов и данных с суммами.
+ */
+static void layout_ibmpc(const mfm_format_t *fmt, mfm_writer_t *writer,
+    const mfm_disk_t *d, int *pos)
+{
+    unsigned char id [6];
+    int s, index_gap, sector_gap, data_gap;
+    int nsectors = d->nsectors_per_track;
+
+    /* Промежутки по умолчанию зависят от количества секторов. */
+    index_gap = mfm_index_gap ? mfm_index_gap : INDEX_GAP;
+    data_gap = mfm_data_gap ? mfm_data_gap : fmt->data_gap;
+    sector_gap = mfm_sector_gap ? mfm_sector_gap :
+        mfm_std_sector_gap(fmt, nsectors);
+
+    if (fmt->index_mark) {
+        mfm_write_gap(writer, fmt->pre_gap, mfm_gap_byte);
+        mfm_write_marker(writer, fmt->sync_zeros, MFM_MARK_C2, fmt->sync_marks);
+        mfm_write_byte(writer, 0xfc);
+    }
+    mfm_write_gap(writer, index_gap, mfm_gap_byte);
+    for (s=0; s<nsectors; ++s) {
+        if (s > 0)
+            mfm_write_gap(writer, sector_gap, mfm_gap_byte);
+        mfm_write_marker(writer, fmt->sync_zeros, MFM_MARK_A1, fmt->sync_marks);
+        mfm_write_byte(writer, 0xfe);
+        pos[2*s] = writer->halfbit;
+        make_ident(id, 0, s, d->sector_size);
+        mfm_write(writer, id, 6);
+        mfm_write_gap(writer, data_gap, mfm_gap_byte);
+        mfm_write_marker(writer, fmt->sync_zeros, MFM_MARK_A1, fmt->sync_marks);
+        mfm_write_byte(writer, 0xfb);
+        pos[2*s+1] = writer->halfbit;
+        mfm_write_gap(writer, d->sector_size + 2, 0);
     }
+    mfm_fill_track(writer, mfm_gap_byte);
 }
 
 /*
- * Записываем идентификатор и его контрольную сумму.
+ * Поля секторов дорожки t: идентификаторы, данные и суммы.
  */
-static void write_ident(mfm_writer_t *writer, int t, int s)
+static void patch_ibmpc(mfm_writer_t *writer, const int *pos, mfm_disk_t *d,
+    int t, int dt)
 {
-    int sum;
-
-    mfm_write_byte(writer, t >> 1);
-    mfm_write_byte(writer, t & 1);
-    mfm_write_byte(writer, s + 1);
-    mfm_write_byte(writer, 2);
+    unsigned char id [6], sum [2], *data;
+    int s, crc, size = d->sector_size;
+
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        make_ident(id, t, s, size);
+        mfm_write_patch(writer, pos[2*s], id, 6);
+
+        /* Данные с суммой: повторный сектор берём из кэша.
+         * Кэш хранит только сектора по 512 байтов. */
+        data = mfm_block(d, dt, s);
+        if (size == SECTSZ && mfm_cache_get(writer, pos[2*s+1], MFM_SYNC_IBMPC, data,
+            (SECTSZ + 2) * 2))
+            continue;
+        mfm_write_patch(writer, pos[2*s+1], data, size);
+
+        crc = crc16_ccitt_byte(0xcdb4, 0xfb);
+        crc = crc16_ccitt(crc, data, size);
+        sum[0] = crc >> 8;
+        sum[1] = crc;
+        mfm_write_patch(writer, pos[2*s+1] + size*16, sum, 2);
+        if (size == SECTSZ)
+            mfm_cache_put(writer, pos[2*s+1], MFM_SYNC_IBMPC, data,
+                (SECTSZ + 2) * 2);
+    }
+}
 
-    sum = crc16_ccitt_byte(0xb230, t >> 1);
-    sum = crc16_ccitt_byte(sum, t & 1);
-    sum = crc16_ccitt_byte(sum, s + 1);
-    sum = crc16_ccitt_byte(sum, 2);
+/*
+ * Стандартные промежутки между секторами и плотность записи.
+ */
+static const mfm_gap_t ibmpc_gaps[] = {
+    { 9,  SECTOR_GAP_9,  MFM_DENSITY_DD },      /* default */
+    { 10, SECTOR_GAP_10, MFM_DENSITY_DD },
+    { 11, 0,             MFM_DENSITY_DD },
+    { 18, SECTOR_GAP_18, MFM_DENSITY_HD },
+    { 21, 0,             MFM_DENSITY_HD },
+    { 36, SECTOR_GAP_36, MFM_DENSITY_ED },
+    { 0,  0,             0 },
+};
 
-    mfm_write_byte(writer, sum >> 8);
-    mfm_write_byte(writer, sum);
-}
+const mfm_format_t mfm_format_ibmpc = {
+    .name       = "IBM PC",
+    .sync       = MFM_SYNC_IBMPC,
+    .nsectors   = 9,
+    .sync_zeros = 12,
+    .sync_marks = 3,
+    .mark_bytes = MARK_BYTES,
+    .pre_gap    = 80,
+    .index_mark = 1,
+    .data_gap   = DATA_GAP,
+    .gaps       = ibmpc_gaps,
+    .index      = mfm_index_ibmpc,
+    .layout     = layout_ibmpc,
+    .patch      = patch_ibmpc,
+};
 
 /*
- * Записываем маркер индекса, с нарушением правил MFM.
+ * БК-0010: формат IBM PC без маркера индекса.
  */
-static void write_index_marker(mfm_writer_t *writer)
-{
-    int i;
+const mfm_format_t mfm_format_bk = {
+    .name       = "BK-0010",
+    .sync       = MFM_SYNC_IBMPC,
+    .nsectors   = 10,
+    .sync_zeros = 12,
+    .sync_marks = 3,
+    .mark_bytes = MARK_BYTES,
+    .pre_gap    = 0,
+    .index_mark = 0,
+    .data_gap   = DATA_GAP,
+    .gaps       = ibmpc_gaps,
+    .index      = mfm_index_ibmpc,
+    .layout     = layout_ibmpc,
+    .patch      = patch_ibmpc,
+};
 
-    /* Двенадцать байтов нулей, для синхронизации. */
-    for (i=0; i<12; ++i)
-        mfm_write_byte(writer, 0);
-
-    /* Три байта C2 с нарушением кодирования в шестом бите. */
-    for (i=0; i<3; ++i) {
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 0);
-        mfm_write_halfbit(writer, 0);
-        mfm_write_halfbit(writer, 0);
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 0);
-    }
+void mfm_write_ibmpc(mfm_disk_t *d, mfm_io_t *out, int skip_index_mark)
+{
+    mfm_write_format(skip_index_mark ? &mfm_format_bk : &mfm_format_ibmpc,
+        d, 0, out);
 }
 
 /*
- * Записываем маркер идентификатора, с нарушением правил MFM.
+ * Потоковая запись: образ секторов читаем из fin по дорожке,
+ * геометрия задаётся параметром.
  */
-static void write_marker(mfm_writer_t *writer)
+void mfm_write_ibmpc_stream(FILE *fin, mfm_io_t *out, int nsectors_per_track,
+    int skip_index_mark)
 {
-    int i;
+    mfm_disk_t d;
 
-    /* Двенадцать байтов нулей, для синхронизации. */
-    for (i=0; i<12; ++i)
-        mfm_write_byte(writer, 0);
-
-    /* Три байта A1 с нарушением кодирования в шестом бите. */
-    for (i=0; i<3; ++i) {
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 1);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 0);
-        mfm_write_halfbit(writer, 0);
-        mfm_write_halfbit(writer, 0);
-        mfm_write_bit(writer, 0);
-        mfm_write_bit(writer, 1);
-    }
+    memset(&d, 0, sizeof(d));
+    mfm_disk_init(&d, 1, nsectors_per_track, mfm_sector_size);
+    mfm_write_format(skip_index_mark ? &mfm_format_bk : &mfm_format_ibmpc,
+        &d, fin, out);
+    mfm_disk_free(&d);
 }
 
 /*
- * Записываем MFM-образ флоппи-диска в формате IBM PC.
+ * Замена данных сектора s на дорожке t прямо в MFM-файле.
+ * Перекодируются и записываются на место только данные сектора
+ * и контрольная сумма, остальная дорожка не меняется.
+ * Возвращаем 1, если сектор записан, 0, если данные те же,
+ * -1, если сектор не найден.
  */
-void mfm_write_ibmpc(mfm_disk_t *d, FILE *fout, int skip_index_mark)
+int mfm_update_ibmpc(mfm_track_index_t *idx, mfm_io_t *io, int t, int s,
+    const unsigned char *data)
 {
-    mfm_writer_t writer;
-    int t, s, sum;
-
-    if (mfm_verbose)
-        fprintf(mfm_err, "Creating %d tracks, %d sectors per track\n",
-            d->ntracks, d->nsectors_per_track);
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_write_reset(&writer, fout);
-        if (! skip_index_mark) {
-            mfm_write_gap(&writer, 80, mfm_gap_byte);
-            write_index_marker(&writer);
-            mfm_write_byte(&writer, 0xfc);
-        }
-        mfm_write_gap(&writer, mfm_index_gap, mfm_gap_byte);
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            if (s > 0)
-                mfm_write_gap(&writer, mfm_sector_gap, mfm_gap_byte);
-            write_marker(&writer);
-            mfm_write_byte(&writer, 0xfe);
-            write_ident(&writer, t, s);
-            mfm_write_gap(&writer, mfm_data_gap, mfm_gap_byte);
-            write_marker(&writer);
-            mfm_write_byte(&writer, 0xfb);
-            mfm_write(&writer, d->block[t][s], SECTSZ);
-
-            sum = crc16_ccitt_byte(0xcdb4, 0xfb);
-            sum = crc16_ccitt(sum, d->block[t][s], SECTSZ);
-            mfm_write_byte(&writer, sum >> 8);
-            mfm_write_byte(&writer, sum);
-        }
-        mfm_fill_track(&writer, mfm_gap_byte);
+    mfm_reader_t *reader = &idx->reader;
+    mfm_sector_t *sect;
+    unsigned char buf [MAXSECTSZ + 2];
+    int i, sum, first, end, nbytes;
+
+    mfm_index_seek(idx, io, t);
+    mfm_index_ibmpc(idx);
+    for (i=0; i<idx->nsectors; ++i)
+        if (idx->sect[i].sector == s)
+            break;
+    if (i >= idx->nsectors)
+        return -1;
+    sect = &idx->sect[i];
+    nbytes = sect->nbytes;
+    if (nbytes != mfm_sector_size) {
+        fprintf(mfm_err, "Track %d/%d sector %d: %d bytes instead of %d, "
+            "aborted.\n", t >> 1, t & 1, s + 1, nbytes, mfm_sector_size);
+        mfm_fail(MFM_ERR_FORMAT);
     }
+    if (sect->data_ok && memcmp(idx->data[i], data, nbytes) == 0)
+        return 0;
+
+    memcpy(buf, data, nbytes);
+    sum = crc16_ccitt_byte(0xcdb4, sect->tag);
+    sum = crc16_ccitt(sum, data, nbytes);
+    buf [nbytes] = sum >> 8;
+    buf [nbytes+1] = sum;
+
+    /* Меняем дорожку в оглавлении, чтобы оно оставалось верным
+     * для следующих секторов, и записываем изменённые байты. */
+    end = mfm_splice(reader, sect->data_halfbit, buf, nbytes + 2);
+    if (end < 0)
+        return -1;
+    first = sect->data_halfbit >> 3;
+    end = (end + 8) >> 3;
+    if (end > reader->nhalfbits >> 3)
+        end = reader->nhalfbits >> 3;
+    mfm_io_update(io, t, first, reader->buf + first, end - first);
+
+    memcpy(idx->data[i], data, nbytes);
+    sect->data_ok = 1;
+    return 1;
 }
@@ -0,0 +1,554 @@
+/*
+ * Track-granular input and output for MFM files.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Размер дорожки во входном файле: задан плотностью, или
+ * угадываем по длине файла, который не вмещается в MAXTRACK
+ * дорожек двойной плотности.
+ */
+static int guess_tracksz(off_t size)
+{
+    if (mfm_density)
+        return mfm_density * TRACKSZ;
+    if (size > 2 * MAXTRACK * (off_t) TRACKSZ)
+        return MFM_DENSITY_ED * TRACKSZ;
+    if (size > MAXTRACK * (off_t) TRACKSZ)
+        return MFM_DENSITY_HD * TRACKSZ;
+    return TRACKSZ;
+}
+
+/*
+ * Распознаём компактный файл по заголовку.
+ * Размер дорожки в нём задан явно.
+ */
+static void detect_compact(mfm_io_t *io)
+{
+    int density;
+
+    switch (mfm_compact_check(io->map, io->size, &io->ntracks, &density)) {
+    case 0:
+        return;
+    case 1:
+        io->compact = 1;
+        io->tracksz = density * TRACKSZ;
+        return;
+    default:
+        fprintf(mfm_err, "Bad compact MFM file, aborted.\n");
+        mfm_fail(MFM_ERR_FORMAT);
+    }
+}
+
+/*
+ * Компактный файл без отображения в память читаем целиком:
+ * он небольшой, а дорожки в нём разной длины.
+ */
+static void load_compact(mfm_io_t *io, off_t size)
+{
+    unsigned char magic [4];
+    size_t done = 0;
+    ssize_t n;
+
+    if (pread(io->fd, magic, 4, 0) != 4 || memcmp(magic, "MFMZ", 4) != 0)
+        return;
+    io->map = malloc(size);
+    if (! io->map) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+    while (done < (size_t) size) {
+        n = pread(io->fd, io->map + done, size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    io->mode = MFM_IO_MEMORY;
+    io->size = done;
+    io->alloc = size;
+}
+
+/*
+ * Подготовка файла к вводу или выводу дорожками.
+ * Обычный файл на чтение отображаем в память, при неудаче
+ * читаем через pread(). Канал читаем и пишем последовательно
+ * крупными блоками, без буферизации stdio.
+ */
+void mfm_io_open(mfm_io_t *io, int fd, int writing)
+{
+    struct stat st;
+
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->mode = MFM_IO_STREAM;
+    io->tracksz = guess_tracksz(0);
+    if (writing || fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode))
+        return;
+
+    io->mode = MFM_IO_PREAD;
+    io->tracksz = guess_tracksz(st.st_size);
+    if (st.st_size > 0) {
+        void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            io->mode = MFM_IO_MMAP;
+            io->map = p;
+            io->size = st.st_size;
+        } else
+            load_compact(io, st.st_size);
+    }
+    if (io->map)
+        detect_compact(io);
+}
+
+/*
+ * Файл для замены секторов на месте: читаем через pread(),
+ * чтобы видеть свои же изменения, и пишем через pwrite().
+ */
+void mfm_io_open_update(mfm_io_t *io, int fd)
+{
+    unsigned char magic [4];
+    struct stat st;
+
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->mode = MFM_IO_PREAD;
+    if (fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode)) {
+        fprintf(mfm_err, "MFM file for update must be a regular file, aborted.\n");
+        mfm_fail(MFM_ERR_ARG);
+    }
+    if (pread(fd, magic, 4, 0) == 4 && memcmp(magic, "MFMZ", 4) == 0) {
+        fprintf(mfm_err, "Compact MFM file cannot be updated, aborted.\n");
+        mfm_fail(MFM_ERR_ARG);
+    }
+    io->tracksz = guess_tracksz(st.st_size);
+}
+
+/*
+ * Запись nbytes байтов на место, со смещения offset в дорожке t.
+ */
+void mfm_io_update(mfm_io_t *io, int t, int offset,
+    const unsigned char *buf, size_t nbytes)
+{
+    off_t pos = t * (off_t) io->tracksz + offset;
+    size_t done = 0;
+    ssize_t n;
+    int stage = mfm_stage(MFM_STAGE_IO);
+
+    if (io->mode == MFM_IO_MEMORY) {
+        /* Вывод в память: только внутри уже записанного. */
+        if (pos + nbytes <= io->size)
+            memcpy(io->map + pos, buf, nbytes);
+        mfm_stage(stage);
+        return;
+    }
+    while (done < nbytes) {
+        n = pwrite(io->fd, buf + done, nbytes - done, pos + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(mfm_err, "Error writing output file, aborted.\n");
+            mfm_fail(MFM_ERR_IO);
+        }
+        done += n;
+    }
+    mfm_stage(stage);
+    mfm_count(bytes_written, done);
+}
+
+/*
+ * Ввод из буфера в памяти, или вывод в память, когда buf равен 0.
+ * Память для вывода выделяется по мере надобности.
+ */
+void mfm_io_memory(mfm_io_t *io, const void *buf, size_t size)
+{
+    memset(io, 0, sizeof(*io));
+    io->fd = -1;
+    io->mode = MFM_IO_MEMORY;
+    io->map = (unsigned char*) buf;
+    io->size = buf ? size : 0;
+    io->tracksz = guess_tracksz(io->size);
+    if (buf)
+        detect_compact(io);
+}
+
+/*
+ * Плотность выводимого файла, 1, 2 или 4. Плотность, заданная
+ * пользователем, имеет приоритет. Меняем до записи первой дорожки.
+ */
+void mfm_io_density(mfm_io_t *io, int density)
+{
+    io->tracksz = (mfm_density ? mfm_density : density) * TRACKSZ;
+}
+
+/*
+ * Вывод в память заново, с начала буфера.
+ */
+void mfm_io_rewind(mfm_io_t *io)
+{
+    if (io->mode == MFM_IO_MEMORY && io->alloc)
+        io->size = 0;
+    mfm_compact_free(io->zout);
+    io->zout = 0;
+    mfm_hfe_free(io->hout);
+    io->hout = 0;
+    mfm_scp_free(io->sout);
+    io->sout = 0;
+}
+
+void mfm_io_close(mfm_io_t *io)
+{
+    if (io->mode == MFM_IO_MMAP)
+        munmap(io->map, io->size);
+    else if (io->mode == MFM_IO_MEMORY && io->alloc)
+        free(io->map);
+    else if (io->mode == MFM_IO_STREAM)
+        free(io->map);
+    io->map = 0;
+    io->size = 0;
+    io->alloc = 0;
+    mfm_compact_free(io->zout);
+    io->zout = 0;
+    mfm_hfe_free(io->hout);
+    io->hout = 0;
+    mfm_scp_free(io->sout);
+    io->sout = 0;
+}
+
+/*
+ * Можно ли читать дорожки в любом порядке, из нескольких потоков.
+ */
+int mfm_io_random(mfm_io_t *io)
+{
+    return io->mode != MFM_IO_STREAM;
+}
+
+/*
+ * Чтение из канала до заполнения буфера или до конца данных.
+ */
+static size_t fd_read(int fd, unsigned char *buf, size_t nbytes)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < nbytes) {
+        n = read(fd, buf + done, nbytes - done);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * Последовательное чтение из канала. Сначала выдаём
+ * данные, прочитанные вперёд через mfm_io_peek().
+ */
+static size_t stream_read(mfm_io_t *io, unsigned char *buf, size_t nbytes)
+{
+    size_t done = 0;
+
+    if (io->pos < (off_t) io->size) {
+        done = io->size - io->pos;
+        if (done > nbytes)
+            done = nbytes;
+        memcpy(buf, io->map + io->pos, done);
+    }
+    done += fd_read(io->fd, buf + done, nbytes - done);
+    io->pos += done;
+    return done;
+}
+
+/*
+ * Чтение вперёд в начале канала: данные остаются в буфере
+ * io->map и затем выдаются дорожками, как обычно. Так можно
+ * посмотреть на начало файла, не зная длины дорожки.
+ * Возвращаем буфер и количество байтов в нём.
+ */
+const unsigned char *mfm_io_peek(mfm_io_t *io, size_t nbytes, size_t *got)
+{
+    if (io->mode == MFM_IO_STREAM && ! io->map && io->pos == 0) {
+        io->map = malloc(nbytes);
+        if (! io->map) {
+            fprintf(mfm_err, "Out of memory, aborted.\n");
+            mfm_fail(MFM_ERR_NOMEM);
+        }
+        io->size = fd_read(io->fd, io->map, nbytes);
+    }
+    *got = io->size;
+    return io->map;
+}
+
+/*
+ * Распаковка дорожки t компактного файла: смещения дорожек
+ * берём из таблицы, так что доступ к любой дорожке прямой.
+ */
+static size_t compact_read(mfm_io_t *io, int t, unsigned char *buf)
+{
+    const unsigned char *p = io->map + 8 + 4*t;
+    size_t start, end;
+
+    if (t >= io->ntracks)
+        return 0;
+    start = p[0] | p[1] << 8 | p[2] << 16 | (size_t) p[3] << 24;
+    end = p[4] | p[5] << 8 | p[6] << 16 | (size_t) p[7] << 24;
+    if (mfm_compact_unpack(io->map + start, end - start,
+        buf, io->tracksz) < 0) {
+        fprintf(mfm_err, "Bad compact track %d, aborted.\n", t);
+        mfm_fail(MFM_ERR_FORMAT);
+    }
+    return io->tracksz;
+}
+
+/*
+ * Чтение дорожки t несжатого файла.
+ */
+static size_t raw_read(mfm_io_t *io, int t, unsigned char *buf)
+{
+    size_t tracksz = io->tracksz;
+    off_t offset = t * (off_t) tracksz;
+    size_t nbytes = 0;
+    ssize_t n;
+
+    switch (io->mode) {
+    case MFM_IO_MMAP:
+    case MFM_IO_MEMORY:
+        if (offset < (off_t) io->size) {
+            nbytes = io->size - offset;
+            if (nbytes > tracksz)
+                nbytes = tracksz;
+            memcpy(buf, io->map + offset, nbytes);
+        }
+        break;
+
+    case MFM_IO_PREAD:
+        while (nbytes < tracksz) {
+            n = pread(io->fd, buf + nbytes, tracksz - nbytes,
+                offset + nbytes);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            nbytes += n;
+        }
+        break;
+
+    default:
+        /* Канал: назад вернуться нельзя, пропускаем
+         * дорожки только вперёд. */
+        while (io->pos < offset) {
+            size_t skip = offset - io->pos;
+            if (skip > tracksz)
+                skip = tracksz;
+            if (stream_read(io, buf, skip) < skip)
+                return 0;
+        }
+        nbytes = stream_read(io, buf, tracksz);
+        if (offset == 0 && nbytes >= 4 && memcmp(buf, "MFMZ", 4) == 0) {
+            fprintf(mfm_err, "Compact MFM file cannot be read "
+                "from a pipe, aborted.\n");
+            mfm_fail(MFM_ERR_ARG);
+        }
+        break;
+    }
+    return nbytes;
+}
+
+/*
+ * Чтение дорожки t в буфер размером io->tracksz.
+ * Возвращаем количество прочитанных байтов.
+ */
+size_t mfm_io_read_track(mfm_io_t *io, int t, unsigned char *buf)
+{
+    int stage = mfm_stage(MFM_STAGE_IO);
+    size_t nbytes;
+
+    if (io->compact)
+        nbytes = compact_read(io, t, buf);
+    else
+        nbytes = raw_read(io, t, buf);
+    mfm_stage(stage);
+    mfm_count(tracks_read, nbytes > 0);
+    mfm_count(bytes_read, nbytes);
+    return nbytes;
+}
+
+/*
+ * Запись данных в конец файла или в память.
+ */
+static void io_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    if (io->mode == MFM_IO_MEMORY) {
+        if (io->size + nbytes > io->alloc) {
+            size_t alloc = io->alloc ? io->alloc : 64 * (size_t) io->tracksz;
+            unsigned char *p;
+
+            while (alloc < io->size + nbytes)
+                alloc *= 2;
+            p = realloc(io->alloc ? io->map : 0, alloc);
+            if (! p) {
+                fprintf(mfm_err, "Out of memory, aborted.\n");
+                mfm_fail(MFM_ERR_NOMEM);
+            }
+            io->map = p;
+            io->alloc = alloc;
+        }
+        memcpy(io->map + io->size, buf, nbytes);
+        io->size += nbytes;
+        mfm_count(bytes_written, nbytes);
+        return;
+    }
+
+    while (done < nbytes) {
+        n = write(io->fd, buf + done, nbytes - done);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0) {
+            fprintf(mfm_err, "Error writing output file, aborted.\n");
+            mfm_fail(MFM_ERR_IO);
+        }
+        done += n;
+    }
+    io->pos += done;
+    mfm_count(bytes_written, done);
+}
+
+/*
+ * Вывод дорожек, в компактном файле - с упаковкой.
+ */
+void mfm_io_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes)
+{
+    int stage = mfm_stage(MFM_STAGE_IO);
+
+    if (io->zout)
+        mfm_compact_write(io->zout, buf, nbytes, io->tracksz);
+    else if (io->hout)
+        mfm_hfe_write(io, buf, nbytes);
+    else if (io->sout)
+        mfm_scp_write(io, buf, nbytes);
+    else
+        io_write(io, buf, nbytes);
+    mfm_stage(stage);
+}
+
+/*
+ * Вывод как есть, для других форматов файла (см. hfe.c, scpout.c).
+ */
+void mfm_io_output(mfm_io_t *io, const unsigned char *buf, size_t nbytes)
+{
+    io_write(io, buf, nbytes);
+}
+
+/*
+ * Копирование дорожек MFM как есть, без декодирования секторов:
+ * для смены формата файла. Плотность выводимого файла та же.
+ */
+void mfm_io_copy(mfm_io_t *out, mfm_io_t *in)
+{
+    unsigned char buf [MAXTRACKSZ];
+    size_t nbytes;
+    int t;
+
+    out->tracksz = in->tracksz;
+    for (t=0; t<MAXTRACK; ++t) {
+        nbytes = mfm_io_read_track(in, t, buf);
+        if (nbytes == 0)
+            break;
+        mfm_io_write(out, buf, nbytes);
+    }
+    mfm_count(tracks_written, t);
+    mfm_io_flush(out);
+}
+
+/*
+ * Вывод в компактном формате. Задаём до записи первой дорожки,
+ * в конце нужен mfm_io_flush().
+ */
+void mfm_io_compact(mfm_io_t *io)
+{
+    if (io->zout)
+        return;
+    io->zout = calloc(1, sizeof(mfm_compact_t));
+    if (! io->zout) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+}
+
+/*
+ * Все дорожки записаны: для компактного файла выводим
+ * заголовок и упакованные дорожки, для HFE и SCP - последнюю
+ * дорожку и заголовок в начало файла.
+ */
+void mfm_io_flush(mfm_io_t *io)
+{
+    mfm_compact_t *z = io->zout;
+    unsigned char *hdr;
+    size_t hsize;
+    int stage;
+
+    if (io->hout) {
+        stage = mfm_stage(MFM_STAGE_IO);
+        mfm_hfe_finish(io);
+        mfm_hfe_free(io->hout);
+        io->hout = 0;
+        mfm_stage(stage);
+        return;
+    }
+    if (io->sout) {
+        stage = mfm_stage(MFM_STAGE_IO);
+        mfm_scp_finish(io);
+        mfm_scp_free(io->sout);
+        io->sout = 0;
+        mfm_stage(stage);
+        return;
+    }
+    if (! z)
+        return;
+    stage = mfm_stage(MFM_STAGE_IO);
+    hdr = mfm_compact_finish(z, io->tracksz, &hsize);
+    io_write(io, hdr, hsize);
+    free(hdr);
+    io_write(io, z->data, z->size);
+    io->zout = 0;
+    mfm_compact_free(z);
+    mfm_stage(stage);
+}
@@ -0,0 +1,527 @@
+/*
+ * Library interface: conversions inside one process.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "mfmlib.h"
+#include "scp.h"
+
+/*
+ * Контекст, внутри вызова которого работает текущий поток.
+ * Вне библиотечных вызовов фатальная ошибка завершает программу.
+ */
+static __thread mfm_context_t *mfm_current;
+
+/*
+ * Точка перехвата ошибок в рабочем потоке, см. mfm_catch().
+ */
+typedef struct {
+    jmp_buf fail;
+    int error;
+} catch_t;
+
+static __thread catch_t *mfm_catcher;
+
+/*
+ * Фатальная ошибка: возврат из библиотечного вызова с кодом ошибки.
+ * Сообщение к этому моменту уже выдано.
+ */
+void mfm_fail(int error)
+{
+    mfm_context_t *ctx = mfm_current;
+
+    if (mfm_catcher) {
+        mfm_catcher->error = error;
+        longjmp(mfm_catcher->fail, 1);
+    }
+    if (! ctx)
+        exit(-1);
+    ctx->error = error;
+    longjmp(ctx->fail, 1);
+}
+
+/*
+ * Вызов func(arg) с перехватом фатальных ошибок: возвращаем код
+ * ошибки вместо выхода из программы. Рабочие потоки не имеют
+ * контекста, ошибку передаёт дальше вызвавший их поток.
+ */
+int mfm_catch(void (*func)(void *arg), void *arg)
+{
+    catch_t c;
+    catch_t *prev = mfm_catcher;
+
+    mfm_catcher = &c;
+    if (setjmp(c.fail)) {
+        mfm_catcher = prev;
+        mfm_stage(MFM_STAGE_OTHER);
+        return c.error;
+    }
+    func(arg);
+    mfm_catcher = prev;
+    return MFM_OK;
+}
+
+void mfm_context_init(mfm_context_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->err = stderr;
+    ctx->jobs = 1;
+    ctx->gap_byte = 0x4e;
+    ctx->update_fd = -1;
+}
+
+void mfm_context_free(mfm_context_t *ctx)
+{
+    mfm_disk_free(&ctx->disk);
+    mfm_index_free(&ctx->index);
+    mfm_io_close(&ctx->out);
+    mfm_update_close(ctx);
+}
+
+/*
+ * Начало вызова: устанавливаем параметры контекста.
+ * Модули читают их из переменных потока, так что контексты
+ * с любыми параметрами могут работать параллельно.
+ */
+static void ctx_enter(mfm_context_t *ctx)
+{
+    mfm_current = ctx;
+    ctx->error = MFM_OK;
+    ctx->in_fd = -1;
+    ctx->out_fd = -1;
+    ctx->raw_in = 0;
+
+    mfm_err = ctx->err;
+    mfm_verbose = ctx->verbose;
+    mfm_jobs = ctx->jobs;
+    mfm_gap_byte = ctx->gap_byte;
+    mfm_index_gap = ctx->index_gap;
+    mfm_sector_gap = ctx->sector_gap;
+    mfm_data_gap = ctx->data_gap;
+    mfm_density = ctx->density;
+    mfm_compact = ctx->compact;
+    mfm_retry = ctx->retry;
+    mfm_codec = ctx->reference ? &mfm_codec_ref : &mfm_codec_fast;
+    mfm_stats_on = ctx->stats;
+    mfm_cache = ctx->cache;
+    mfm_sector_size = ctx->sector_size ? ctx->sector_size : SECTSZ;
+
+    /* Оглавление могло остаться от другого входного файла.
+     * Дорожку файла замены храним между вызовами: она верна,
+     * пока файл открыт, см. mfm_update_ibmpc(). */
+    if (ctx->index.reader.io != &ctx->update)
+        ctx->index.loaded = 0;
+}
+
+/*
+ * Конец вызова, с результатом.
+ */
+static int ctx_leave(mfm_context_t *ctx, int error)
+{
+    /* После ошибки поток мог остаться в какой-либо стадии. */
+    mfm_stage(MFM_STAGE_OTHER);
+    mfm_io_close(&ctx->in);
+    mfm_io_close(&ctx->out_file);
+    if (ctx->in_fd >= 0)
+        close(ctx->in_fd);
+    if (ctx->raw_in)
+        fclose(ctx->raw_in);
+    if (ctx->out_fd >= 0 && close(ctx->out_fd) < 0 && error == MFM_OK) {
+        fprintf(mfm_err, "Error writing output file\n");
+        error = MFM_ERR_IO;
+    }
+    ctx->in_fd = -1;
+    ctx->out_fd = -1;
+    ctx->raw_in = 0;
+    memset(&ctx->in, 0, sizeof(ctx->in));
+    memset(&ctx->out_file, 0, sizeof(ctx->out_file));
+    if (ctx->index.reader.io != &ctx->update)
+        ctx->index.loaded = 0;
+    mfm_current = 0;
+    return error;
+}
+
+static void ctx_result(mfm_context_t *ctx, const unsigned char **img, size_t *img_size)
+{
+    mfm_disk_t *d = &ctx->disk;
+
+    *img = d->data;
+    *img_size = (size_t) d->ntracks * d->nsectors_per_track * d->sector_size;
+}
+
+/*
+ * Извлечение данных из MFM-образа в памяти.
+ * Результат остаётся в контексте до следующего вызова.
+ */
+int mfm_extract_buffer(mfm_context_t *ctx, const void *mfm, size_t size,
+    int format, const unsigned char **img, size_t *img_size)
+{
+    int ntracks;
+
+    ctx_enter(ctx);
+    if (setjmp(ctx->fail))
+        return ctx_leave(ctx, ctx->error);
+
+    mfm_io_memory(&ctx->in, mfm, size);
+    if (! ctx->in.compact && (size == 0 || size % ctx->in.tracksz != 0)) {
+        fprintf(mfm_err, "Bad MFM image size = %zu\n", size);
+        return ctx_leave(ctx, MFM_ERR_FORMAT);
+    }
+    ntracks = ctx->in.compact ? ctx->in.ntracks :
+        (int) (size / ctx->in.tracksz);
+
+    if (format == MFM_FORMAT_AUTO)
+        format = (mfm_detect_amiga(&ctx->index, &ctx->in) == 1) ?
+            MFM_FORMAT_AMIGA : MFM_FORMAT_IBMPC;
+
+    if (format == MFM_FORMAT_AMIGA)
+        mfm_read_amiga(&ctx->disk, &ctx->index, &ctx->in, ntracks);
+    else
+        mfm_read_ibmpc(&ctx->disk, &ctx->index, &ctx->in, ntracks);
+
+    ctx_result(ctx, img, img_size);
+    return ctx_leave(ctx, MFM_OK);
+}
+
+/*
+ * Извлечение данных из файла SCP, для заданного оборота
+ * или по всем оборотам, когда rev отрицательный.
+ */
+int mfm_extract_scp(mfm_context_t *ctx, const char *name, int rev,
+    int format, const unsigned char **img, size_t *img_size)
+{
+    ctx_enter(ctx);
+    if (setjmp(ctx->fail))
+        return ctx_leave(ctx, ctx->error);
+
+    scp_read_disk(&ctx->disk, &ctx->index, name, rev,
+        (format == MFM_FORMAT_AUTO) ? -1 : (format == MFM_FORMAT_AMIGA));
+
+    ctx_result(ctx, img, img_size);
+    return ctx_leave(ctx, MFM_OK);
+}
+
+/*
+ * Размер сектора образа: степень двойки от 128 до 1024.
+ */
+static int bad_sector_size(void)
+{
+    int n;
+
+    for (n=128; n<=MAXSECTSZ; n*=2)
+        if (n == mfm_sector_size)
+            return 0;
+    fprintf(mfm_err, "Bad sector size = %d\n", mfm_sector_size);
+    return 1;
+}
+
+/*
+ * Создание MFM-образа из данных секторов в памяти.
+ * Результат остаётся в контексте до следующего вызова.
+ */
+int mfm_create_buffer(mfm_context_t *ctx, const void *img, size_t size,
+    int nsectors_per_track, int format,
+    const unsigned char **mfm, size_t *mfm_size)
+{
+    mfm_disk_t *d = &ctx->disk;
+    size_t tracksz;
+
+    ctx_enter(ctx);
+    if (setjmp(ctx->fail))
+        return ctx_leave(ctx, ctx->error);
+
+    if (nsectors_per_track < 1 || nsectors_per_track > MAXINDEX) {
+        fprintf(mfm_err, "Bad number of sectors per track = %d\n",
+            nsectors_per_track);
+        return ctx_leave(ctx, MFM_ERR_ARG);
+    }
+    if (bad_sector_size())
+        return ctx_leave(ctx, MFM_ERR_ARG);
+    tracksz = (size_t) nsectors_per_track * mfm_sector_size;
+    if (size == 0 || size % tracksz != 0) {
+        fprintf(mfm_err, "Bad image size = %zu\n", size);
+        return ctx_leave(ctx, MFM_ERR_ARG);
+    }
+    if (ctx->out.mode != MFM_IO_MEMORY)
+        mfm_io_memory(&ctx->out, 0, 0);
+    mfm_io_rewind(&ctx->out);
+    if (mfm_compact)
+        mfm_io_compact(&ctx->out);
+
+    mfm_disk_init(d, size / tracksz, nsectors_per_track, mfm_sector_size);
+    memcpy(d->data, img, d->ntracks * tracksz);
+
+    if (format == MFM_FORMAT_AMIGA)
+        mfm_write_amiga(d, &ctx->out);
+    else
+        mfm_write_ibmpc(d, &ctx->out, format == MFM_FORMAT_BK);
+
+    *mfm = ctx->out.map;
+    *mfm_size = ctx->out.size;
+    return ctx_leave(ctx, MFM_OK);
+}
+
+/*
+ * Тип файла по расширению имени.
+ */
+int mfm_file_type(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    if (ext && (strcasecmp(ext, ".mfm") == 0 || strcasecmp(ext, ".mfz") == 0))
+        return MFM_FILE_MFM;
+    if (ext && strcasecmp(ext, ".scp") == 0)
+        return MFM_FILE_SCP;
+    if (ext && strcasecmp(ext, ".hfe") == 0)
+        return MFM_FILE_HFE;
+    return MFM_FILE_IMG;
+}
+
+/*
+ * Количество секторов и формат по размеру образа дискеты.
+ * Для секторов не по 512 байтов - только IBM PC, 80 цилиндров.
+ */
+static int guess_geometry(off_t size, int *format)
+{
+    if (mfm_sector_size != SECTSZ) {
+        if (size < 80*2*mfm_sector_size)
+            return 1;
+        return size / (80*2*mfm_sector_size);
+    }
+    if (size == 80*2*11*SECTSZ) {
+        if (*format == MFM_FORMAT_AUTO)
+            *format = MFM_FORMAT_AMIGA;
+        return 11;
+    }
+    if (size == 80*2*10*SECTSZ)
+        return 10;
+    if (size == 80*2*18*SECTSZ)
+        return 18;
+    if (size == 80*2*36*SECTSZ)
+        return 36;
+    return 9;
+}
+
+/*
+ * Преобразование файла в файл, по расширениям имён:
+ * .mfm или .scp в образ секторов, образ секторов или .scp в .mfm
+ * или .hfe, образ секторов или .mfm в .scp.
+ * Для SCP используется оборот rev, или все обороты,
+ * когда rev отрицательный.
+ */
+static int convert_file(mfm_context_t *ctx, const char *input,
+    const char *output, int format, int rev)
+{
+    mfm_disk_t *d = &ctx->disk;
+    int itype = mfm_file_type(input);
+    int otype = mfm_file_type(output);
+    struct stat st;
+    mfm_io_t *out = &ctx->out_file;
+
+    if (itype == otype || itype == MFM_FILE_HFE) {
+        fprintf(mfm_err, "%s: cannot convert into %s\n", input, output);
+        return ctx_leave(ctx, MFM_ERR_ARG);
+    }
+
+    switch (itype) {
+    case MFM_FILE_MFM:
+        ctx->in_fd = open(input, O_RDONLY);
+        if (ctx->in_fd < 0) {
+            fprintf(mfm_err, "%s: cannot open\n", input);
+            return ctx_leave(ctx, MFM_ERR_IO);
+        }
+        mfm_io_open(&ctx->in, ctx->in_fd, 0);
+        if (otype == MFM_FILE_SCP) {
+            /* MFM tracks to flux as is, without decoding sectors. */
+            ctx->out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (ctx->out_fd < 0) {
+                fprintf(mfm_err, "%s: cannot create\n", output);
+                return ctx_leave(ctx, MFM_ERR_IO);
+            }
+            mfm_io_open(out, ctx->out_fd, 1);
+            mfm_io_scp(out, format == MFM_FORMAT_AMIGA ||
+                (format == MFM_FORMAT_AUTO &&
+                mfm_detect_amiga(&ctx->index, &ctx->in) == 1));
+            mfm_io_copy(out, &ctx->in);
+            return ctx_leave(ctx, MFM_OK);
+        }
+        if (format == MFM_FORMAT_AUTO)
+            format = (mfm_detect_amiga(&ctx->index, &ctx->in) == 1) ?
+                MFM_FORMAT_AMIGA : MFM_FORMAT_IBMPC;
+        if (format == MFM_FORMAT_AMIGA)
+            mfm_read_amiga(d, &ctx->index, &ctx->in, MAXTRACK);
+        else
+            mfm_read_ibmpc(d, &ctx->index, &ctx->in, MAXTRACK);
+        break;
+
+    case MFM_FILE_SCP:
+        if (otype != MFM_FILE_IMG && rev >= 0) {
+            /* Flux to MFM as is, without decoding sectors. */
+            ctx->out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (ctx->out_fd < 0) {
+                fprintf(mfm_err, "%s: cannot create\n", output);
+                return ctx_leave(ctx, MFM_ERR_IO);
+            }
+            mfm_io_open(out, ctx->out_fd, 1);
+            if (otype == MFM_FILE_HFE)
+                mfm_io_hfe(out, format == MFM_FORMAT_AMIGA);
+            else if (mfm_compact)
+                mfm_io_compact(out);
+            scp_write_mfm(input, out, rev);
+            return ctx_leave(ctx, MFM_OK);
+        }
+        if (scp_read_disk(d, &ctx->index, input, rev,
+            (format == MFM_FORMAT_AUTO) ? -1 : (format == MFM_FORMAT_AMIGA)))
+            format = MFM_FORMAT_AMIGA;
+        break;
+
+    default:
+        if (bad_sector_size())
+            return ctx_leave(ctx, MFM_ERR_ARG);
+        ctx->raw_in = fopen(input, "rb");
+        if (! ctx->raw_in || fstat(fileno(ctx->raw_in), &st) < 0) {
+            fprintf(mfm_err, "%s: cannot open\n", input);
+            return ctx_leave(ctx, MFM_ERR_IO);
+        }
+        mfm_read_raw(d, ctx->raw_in, guess_geometry(st.st_size, &format));
+        break;
+    }
+
+    ctx->out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ctx->out_fd < 0) {
+        fprintf(mfm_err, "%s: cannot create\n", output);
+        return ctx_leave(ctx, MFM_ERR_IO);
+    }
+    mfm_io_open(out, ctx->out_fd, 1);
+    if (otype == MFM_FILE_HFE)
+        mfm_io_hfe(out, format == MFM_FORMAT_AMIGA);
+    else if (otype == MFM_FILE_SCP)
+        mfm_io_scp(out, format == MFM_FORMAT_AMIGA);
+    else if (mfm_compact && otype == MFM_FILE_MFM)
+        mfm_io_compact(out);
+
+    if (otype == MFM_FILE_IMG)
+        mfm_io_write(out, d->data,
+            (size_t) d->ntracks * d->nsectors_per_track * d->sector_size);
+    else if (format == MFM_FORMAT_AMIGA)
+        mfm_write_amiga(d, out);
+    else
+        mfm_write_ibmpc(d, out, format == MFM_FORMAT_BK);
+
+    return ctx_leave(ctx, MFM_OK);
+}
+
+/*
+ * Формат определяется по ходу преобразования, поэтому сама работа
+ * вынесена в convert_file(): после setjmp() здесь ничего не меняется.
+ */
+int mfm_convert_file(mfm_context_t *ctx, const char *input,
+    const char *output, int format, int rev)
+{
+    ctx_enter(ctx);
+    if (setjmp(ctx->fail))
+        return ctx_leave(ctx, ctx->error);
+    return convert_file(ctx, input, output, format, rev);
+}
+
+/*
+ * Открытие MFM-файла для замены отдельных секторов IBM PC.
+ * Файл остаётся открытым до mfm_update_close().
+ */
+int mfm_update_open(mfm_context_t *ctx, const char *name)
+{
+    int fd;
+
+    mfm_update_close(ctx);
+    ctx_enter(ctx);
+    if (setjmp(ctx->fail))
+        return ctx_leave(ctx, ctx->error);
+
+    fd = open(name, O_RDWR);
+    if (fd < 0) {
+        fprintf(mfm_err, "%s: cannot open\n", name);
+        return ctx_leave(ctx, MFM_ERR_IO);
+    }
+    ctx->in_fd = fd;
+    mfm_io_open_update(&ctx->update, fd);
+    if (mfm_detect_amiga(&ctx->index, &ctx->update) == 1) {
+        fprintf(mfm_err, "%s: only IBM PC and BK-0010 formats "
+            "can be updated\n", name);
+        ctx->index.loaded = 0;
+        return ctx_leave(ctx, MFM_ERR_FORMAT);
+    }
+
+    /* Дескриптор переходит в контекст, ctx_leave() его не закрывает. */
+    ctx->in_fd = -1;
+    ctx->update_fd = fd;
+    return ctx_leave(ctx, MFM_OK);
+}
+
+/*
+ * Замена данных сектора на месте. Перекодируются и пишутся
+ * только данные и контрольная сумма этого сектора.
+ * Возвращаем MFM_OK, или MFM_ERR_FORMAT, если сектора нет в файле.
+ */
+int mfm_update_sector(mfm_context_t *ctx, int track, int sector,
+    const void *data)
+{
+    if (ctx->update_fd < 0)
+        return MFM_ERR_ARG;
+    ctx_enter(ctx);
+    if (setjmp(ctx->fail)) {
+        /* Дорожка могла остаться прочитанной не до конца. */
+        ctx->index.loaded = 0;
+        return ctx_leave(ctx, ctx->error);
+    }
+
+    if (mfm_update_ibmpc(&ctx->index, &ctx->update, track, sector,
+        data) < 0) {
+        fprintf(mfm_err, "Track %d/%d: no sector %d\n",
+            track >> 1, track & 1, sector + 1);
+        return ctx_leave(ctx, MFM_ERR_FORMAT);
+    }
+    return ctx_leave(ctx, MFM_OK);
+}
+
+int mfm_update_close(mfm_context_t *ctx)
+{
+    int error = MFM_OK;
+
+    if (ctx->update_fd >= 0 && close(ctx->update_fd) < 0)
+        error = MFM_ERR_IO;
+    ctx->update_fd = -1;
+    memset(&ctx->update, 0, sizeof(ctx->update));
+    ctx->index.loaded = 0;
+    return error;
+}
@@ -30,7 +30,7 @@
 #include <string.h>
 #include <getopt.h>
 #include "config.h"
-#include "mfm.h"
+#include "mfmlib.h"
 #include "scp.h"
 
 enum {
@@ -38,9 +38,12 @@ enum {
     ACTION_EXTRACT,
     ACTION_CREATE,
     ACTION_DUMP,
+    ACTION_BATCH,
+    ACTION_UPDATE,
 };
 
 mfm_disk_t disk;
+mfm_track_index_t track_index;
 
 void usage()
 {
@@ -49,23 +52,61 @@ void usage()
 
     printf("Usage:\n");
     printf("    mfmdisk [-i] input.mfm\n");
-    printf("    mfmdisk -x input.mfm output.img\n");
-    printf("    mfmdisk -c output.mfm input.img\n");
-    printf("    mfmdisk -c [-r N] output.mfm input.scp\n");
+    printf("    mfmdisk [-i] [-v] [-r N] [-t N] [--vcd=file.vcd] input.scp\n");
+    printf("    mfmdisk -x [-j N] input.mfm output.img\n");
+    printf("    mfmdisk -x [-r N] input.scp output.img\n");
+    printf("    mfmdisk -c [-s N] [-l N] output.mfm input.img\n");
+    printf("    mfmdisk -c [-r N] [-j N] output.mfm input.scp\n");
+    printf("    mfmdisk -c [-a] output.hfe input.img|input.scp\n");
+    printf("    mfmdisk -c [-a] output.scp input.img|input.mfm\n");
+    printf("    mfmdisk -B [-j N] [-r N] manifest.txt\n");
+    printf("    mfmdisk -u [-s N] [-l N] output.mfm input.img\n");
+    printf("\n");
+    printf("Name '-' means standard input or output. Images and MFM files\n");
+    printf("are converted track by track, so mfmdisk can work as a filter\n");
+    printf("in a pipe; for images, give geometry with -s, -a or -b.\n");
+    printf("When density of MFM data in a pipe cannot be detected,\n");
+    printf("give it with -D.\n");
     printf("\n");
 
     printf("Options:\n");
     printf("    -i, --info         show information about MFM file\n");
     printf("    -x, --extract      extract data from MFM file\n");
     printf("    -c, --create       create MFM file\n");
+    printf("    -z, --compact      create compact MFM file, with packed tracks\n");
     printf("    -d, --dump         dump raw bit contents of MFM file\n");
+    printf("    -u, --update       rewrite changed sectors of IBM PC MFM file\n");
+    printf("                       in place\n");
+    printf("    -B, --batch        convert files listed in manifest, one\n");
+    printf("                       'input [output]' per line, '-' for stdin\n");
     printf("    -v, --verbose      verbose mode\n");
     printf("    -a, --amiga        use Amiga format (default IBM PC)\n");
     printf("    -b, --bk           use BK-0010 format\n");
+    printf("    -j N, --jobs=N     decode tracks in N parallel threads\n");
     printf("    -r N, --revolution=N\n");
-    printf("                       decode N-th revolution, default 0\n");
+    printf("                       decode N-th revolution, default 0;\n");
+    printf("                       'all' takes good sectors from any revolution\n");
+    printf("    -R, --retry        decode SCP tracks with bad sectors again,\n");
+    printf("                       with other PLL settings\n");
+    printf("    --stats[=text|json]\n");
+    printf("                       print time by stages and counters\n");
+    printf("                       of sectors to stderr\n");
+    printf("    --reference        use slow bit-by-bit codecs, to check\n");
+    printf("                       results of the fast ones\n");
+    printf("    --cache            encode repeated sectors once, by contents;\n");
+    printf("                       the cache is kept for all files of a batch\n");
+    printf("    -t N, --track=N    show flux of SCP track N, 0...167\n");
+    printf("    --vcd=FILE         write flux, PLL clock and decoded bits\n");
+    printf("                       of the SCP track to VCD file\n");
     printf("    -s N, --sectors-per-track=N\n");
     printf("                       use N sectors per track\n");
+    printf("    -l N, --sector-size=N\n");
+    printf("                       bytes per sector of IBM PC image:\n");
+    printf("                       128, 256, 512 or 1024; default 512\n");
+    printf("    -D dd|hd|ed, --density=dd|hd|ed\n");
+    printf("                       track length and bit rate of double, high\n");
+    printf("                       or extra high density; by default detected\n");
+    printf("                       by input file, or by sectors per track\n");
     exit(-1);
 }
 
@@ -119,23 +160,42 @@ int main(int argc, char **argv)
         { "extract",            0, 0,   'x'     },
         { "create",             0, 0,   'c'     },
         { "dump",               0, 0,   'd'     },
+        { "batch",              0, 0,   'B'     },
         { "amiga",              0, 0,   'a'     },
         { "bk",                 0, 0,   'b'     },
         { "sectors-per-track",  1, 0,   's'     },
+        { "sector-size",        1, 0,   'l'     },
         { "revolution",         1, 0,   'r'     },
+        { "jobs",               1, 0,   'j'     },
+        { "density",            1, 0,   'D'     },
+        { "compact",            0, 0,   'z'     },
+        { "update",             0, 0,   'u'     },
+        { "retry",              0, 0,   'R'     },
+        { "stats",              2, 0,   'S'     },
+        { "reference",          0, 0,   'E'     },
+        { "cache",              0, 0,   'K'     },
+        { "track",              1, 0,   't'     },
+        { "vcd",                1, 0,   'W'     },
         { 0,                    0, 0,   0       },
     };
     int c;
     FILE *fin, *fout;
+    mfm_io_t in, out;
+    char *ext;
     int action = ACTION_INFO;
     int amiga = 0;
     int bk = 0;
     int nsectors_per_track = 9;
     int revolution = 0;
+    mfm_context_t ctx;
+    int t, s, failed = 0;
+    int stats = 0;
+    int track = -1;
+    char *vcd = 0;
 
     mfm_err = stdout;
     for (;;) {
-        c = getopt_long(argc, argv, "hVixcdvabs:r:", longopts, 0);
+        c = getopt_long(argc, argv, "hVixcdBuvazbRs:l:r:j:D:t:", longopts, 0);
         if (c < 0)
             break;
         switch (c) {
@@ -157,9 +217,35 @@ int main(int argc, char **argv)
         case 'd':
             action = ACTION_DUMP;
             break;
+        case 'B':
+            action = ACTION_BATCH;
+            break;
+        case 'u':
+            action = ACTION_UPDATE;
+            break;
         case 'v':
             ++mfm_verbose;
             break;
+        case 'z':
+            mfm_compact = 1;
+            break;
+        case 'R':
+            mfm_retry = 1;
+            break;
+        case 'E':
+            mfm_codec = &mfm_codec_ref;
+            break;
+        case 'K':
+            mfm_cache = 1;
+            break;
+        case 'S':
+            if (! optarg || strcmp(optarg, "text") == 0)
+                stats = 1;
+            else if (strcmp(optarg, "json") == 0)
+                stats = 2;
+            else
+                usage();
+            break;
         case 'a':
             amiga = 1;
             bk = 0;
@@ -173,13 +259,51 @@ int main(int argc, char **argv)
         case 's':
             nsectors_per_track = strtol(optarg, 0, 0);
             break;
+        case 'l':
+            mfm_sector_size = strtol(optarg, 0, 0);
+            if (mfm_sector_size != 128 && mfm_sector_size != 256 &&
+                mfm_sector_size != 512 && mfm_sector_size != 1024) {
+                fprintf(mfm_err, "Bad sector size = %s\n", optarg);
+                usage();
+            }
+            break;
         case 'r':
-            revolution = strtol(optarg, 0, 0);
+            if (strcmp(optarg, "all") == 0)
+                revolution = -1;
+            else
+                revolution = strtol(optarg, 0, 0);
+            break;
+        case 'j':
+            mfm_jobs = strtol(optarg, 0, 0);
+            break;
+        case 't':
+            track = strtol(optarg, 0, 0);
+            break;
+        case 'W':
+            vcd = optarg;
+            break;
+        case 'D':
+            if (strcasecmp(optarg, "dd") == 0)
+                mfm_density = MFM_DENSITY_DD;
+            else if (strcasecmp(optarg, "hd") == 0)
+                mfm_density = MFM_DENSITY_HD;
+            else if (strcasecmp(optarg, "ed") == 0)
+                mfm_density = MFM_DENSITY_ED;
+            else
+                usage();
             break;
         }
     }
     argc -= optind;
     argv += optind;
+    if (amiga && mfm_sector_size != SECTSZ) {
+        fprintf(mfm_err, "Amiga sectors are %d bytes\n", SECTSZ);
+        return 1;
+    }
+    if (stats) {
+        mfm_stats_on = 1;
+        mfm_stats_reset();
+    }
 
     switch (action) {
     default:
@@ -187,12 +311,39 @@ int main(int argc, char **argv)
         /* Выдача информации о файле MFM. */
         if (argc != 1)
             usage();
+        ext = strrchr(argv[0], '.');
+        if (ext && strcasecmp(ext, ".scp") == 0) {
+            /* Flux diagnostics: track 0, all tracks with -v,
+             * or the one given by -t. */
+            scp_file_t sf;
+
+            if (scp_open(&sf, argv[0]) != MFM_OK)
+                return 1;
+            if (revolution >= sf.header.nr_revolutions) {
+                fprintf(mfm_err, "Revolution %d out of range 0...%d\n",
+                    revolution, sf.header.nr_revolutions-1);
+                return 1;
+            }
+            scp_set_density(&sf);
+            scp_print_disk_header(&sf);
+            if (track >= 0 || vcd)
+                scp_decode_track(&sf, vcd, track < 0 ? 0 : track,
+                    revolution);
+            else
+                for (t=0; t < (mfm_verbose ? TRACK_MAX : 1); ++t)
+                    if (sf.tdh_ok[t])
+                        scp_decode_track(&sf, 0, t, revolution);
+            scp_close(&sf);
+            break;
+        }
         fin = open_input(argv[0]);
+        mfm_io_open(&in, fileno(fin), 0);
+        mfm_detect_density(&track_index, &in);
 
-        if (mfm_detect_amiga(fin))
-            mfm_analyze_amiga(fin, mfm_verbose ? MAXTRACK : 1);
+        if (mfm_detect_amiga(&track_index, &in))
+            mfm_analyze_amiga(&track_index, &in, mfm_verbose ? MAXTRACK : 1);
         else
-            mfm_analyze_ibmpc(fin, mfm_verbose ? MAXTRACK : 1);
+            mfm_analyze_ibmpc(&track_index, &in, mfm_verbose ? MAXTRACK : 1);
         break;
 
     case ACTION_DUMP:
@@ -200,22 +351,77 @@ int main(int argc, char **argv)
         if (argc != 1)
             usage();
         fin = open_input(argv[0]);
-        mfm_dump(fin, MAXTRACK);
+        mfm_io_open(&in, fileno(fin), 0);
+        mfm_detect_density(&track_index, &in);
+        mfm_dump(&in, MAXTRACK);
+        break;
+
+    case ACTION_BATCH:
+        /* Преобразование списка файлов. */
+        if (argc != 1)
+            usage();
+        if (mfm_batch(argv[0], amiga ? MFM_FORMAT_AMIGA :
+            bk ? MFM_FORMAT_BK : MFM_FORMAT_AUTO, revolution) != 0)
+            failed = 1;
         break;
 
     case ACTION_EXTRACT:
         /* Извлечение данных из файла MFM. */
         if (argc != 2)
             usage();
+        ext = strrchr(argv[0], '.');
+        if (ext && strcasecmp(ext, ".scp") == 0) {
+            /* Decode sectors from SCP file directly. */
+            fout = open_output(argv[1]);
+            scp_read_disk(&disk, &track_index, argv[0],
+                revolution, amiga ? 1 : -1);
+            mfm_write_raw(&disk, fout);
+            break;
+        }
         fin = open_input(argv[0]);
         fout = open_output(argv[1]);
+        mfm_io_open(&in, fileno(fin), 0);
+        mfm_detect_density(&track_index, &in);
 
-        if (amiga || mfm_detect_amiga(fin))
-            mfm_read_amiga(&disk, fin, MAXTRACK);
+        /* Сектора выводим по дорожке, по мере декодирования:
+         * так из канала в канал образ в памяти не копится. */
+        if (amiga || mfm_detect_amiga(&track_index, &in))
+            mfm_read_amiga_stream(&track_index, &in, fout);
         else
-            mfm_read_ibmpc(&disk, fin, MAXTRACK);
+            mfm_read_ibmpc_stream(&track_index, &in, fout);
+        break;
 
-        mfm_write_raw(&disk, fout);
+    case ACTION_UPDATE:
+        /* Замена изменённых секторов в файле MFM. */
+        if (argc != 2)
+            usage();
+        if (amiga) {
+            fprintf(mfm_err, "Only IBM PC and BK-0010 formats "
+                "can be updated\n");
+            return 1;
+        }
+        fin = open_input(argv[1]);
+        mfm_disk_init(&disk, 1, nsectors_per_track, mfm_sector_size);
+
+        mfm_context_init(&ctx);
+        ctx.err = mfm_err;
+        ctx.verbose = mfm_verbose;
+        ctx.density = mfm_density;
+        ctx.sector_size = mfm_sector_size;
+        ctx.stats = mfm_stats_on;
+        if (mfm_update_open(&ctx, argv[0]) != MFM_OK)
+            return 1;
+        /* Образ читаем по дорожке, он может идти из канала. */
+        for (t=0; mfm_read_raw_track(&disk, fin); ++t)
+            for (s=0; s<disk.nsectors_per_track; ++s)
+                if (mfm_update_sector(&ctx, t, s,
+                    mfm_block(&disk, 0, s)) != MFM_OK)
+                    failed = 1;
+        if (mfm_update_close(&ctx) != MFM_OK) {
+            perror(argv[0]);
+            return 1;
+        }
+        mfm_context_free(&ctx);
         break;
 
     case ACTION_CREATE:
@@ -223,38 +429,61 @@ int main(int argc, char **argv)
         if (argc < 1 || argc > 2)
             usage();
         fout = open_output(argv[0]);
+        mfm_io_open(&out, fileno(fout), 1);
+        ext = strrchr(argv[0], '.');
+        if (ext && strcasecmp(ext, ".hfe") == 0)
+            mfm_io_hfe(&out, amiga);
+        else if (ext && strcasecmp(ext, ".scp") == 0)
+            mfm_io_scp(&out, amiga);
+        else if (mfm_compact)
+            mfm_io_compact(&out);
 
         if (argc >= 2) {
             /* Read image from file. */
-            char *ext = strrchr(argv[1], '.');
+            ext = strrchr(argv[1], '.');
 
             if (ext && strcasecmp(ext, ".scp") == 0) {
-                /* Convert SCP file into MFM format. */
-                scp_write_mfm(argv[1], fout, revolution);
+                if (revolution >= 0) {
+                    /* Convert SCP file into MFM format. */
+                    scp_write_mfm(argv[1], &out, revolution);
+                    break;
+                }
+                /* Collect good sectors from all revolutions,
+                 * and write them as a clean MFM image. */
+                amiga = scp_read_disk(&disk, &track_index, argv[1],
+                    revolution, amiga ? 1 : -1);
+                nsectors_per_track = disk.nsectors_per_track;
+            } else if (ext && (strcasecmp(ext, ".mfm") == 0 ||
+                               strcasecmp(ext, ".mfz") == 0)) {
+                /* Дорожки MFM переносим как есть. */
+                fin = open_input(argv[1]);
+                mfm_io_open(&in, fileno(fin), 0);
+                mfm_detect_density(&track_index, &in);
+                mfm_io_copy(&out, &in);
+                break;
+            } else {
+                /* Образ секторов кодируем по дорожке,
+                 * по мере чтения: вход может быть каналом. */
+                fin = open_input(argv[1]);
+                if (amiga)
+                    mfm_write_amiga_stream(fin, &out, nsectors_per_track);
+                else
+                    mfm_write_ibmpc_stream(fin, &out, nsectors_per_track, bk);
                 break;
             }
-            fin = open_input(argv[1]);
-            mfm_read_raw(&disk, fin, nsectors_per_track);
         } else {
             /* Empty disk. */
-            disk.ntracks = 160;
-            disk.nsectors_per_track = nsectors_per_track;
-        }
-
-        if (! mfm_index_gap)
-            mfm_index_gap = INDEX_GAP;
-        if (! mfm_data_gap)
-            mfm_data_gap = DATA_GAP;
-        if (! mfm_sector_gap) {
-            mfm_sector_gap = (nsectors_per_track == 10) ?
-                SECTOR_GAP_10 : SECTOR_GAP_9;
+            mfm_disk_init(&disk, 160, nsectors_per_track,
+                mfm_sector_size);
         }
 
         if (amiga)
-            mfm_write_amiga(&disk, fout);
+            mfm_write_amiga(&disk, &out);
         else
-            mfm_write_ibmpc(&disk, fout, bk);
+            mfm_write_ibmpc(&disk, &out, bk);
         break;
     }
-    return 0;
+    if (stats)
+        mfm_stats_print(stderr, stats > 1);
+    return failed;
 }
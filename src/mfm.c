@@ -26,29 +26,174 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include "config.h"
 #include "mfm.h"
 
-int mfm_gap_byte = 0x4e;
+__thread FILE *mfm_err;
+__thread int mfm_verbose;
+__thread int mfm_gap_byte = 0x4e;
+__thread int mfm_index_gap;
+__thread int mfm_sector_gap;
+__thread int mfm_data_gap;
+__thread int mfm_jobs = 1;
+__thread int mfm_density;
+__thread int mfm_compact;
+__thread int mfm_retry;
+__thread int mfm_sector_size = SECTSZ;
+
+__thread const mfm_codec_t *mfm_codec = &mfm_codec_fast;
+
+/*
+ * Копия параметров потока, для передачи рабочим потокам.
+ */
+void mfm_options_save(mfm_options_t *opt)
+{
+    opt->err = mfm_err;
+    opt->verbose = mfm_verbose;
+    opt->gap_byte = mfm_gap_byte;
+    opt->index_gap = mfm_index_gap;
+    opt->sector_gap = mfm_sector_gap;
+    opt->data_gap = mfm_data_gap;
+    opt->jobs = mfm_jobs;
+    opt->density = mfm_density;
+    opt->compact = mfm_compact;
+    opt->retry = mfm_retry;
+    opt->codec = mfm_codec;
+    opt->cache = mfm_cache;
+    opt->stats = mfm_stats_on;
+    opt->sector_size = mfm_sector_size;
+}
+
+void mfm_options_load(const mfm_options_t *opt)
+{
+    mfm_err = opt->err;
+    mfm_verbose = opt->verbose;
+    mfm_gap_byte = opt->gap_byte;
+    mfm_index_gap = opt->index_gap;
+    mfm_sector_gap = opt->sector_gap;
+    mfm_data_gap = opt->data_gap;
+    mfm_jobs = opt->jobs;
+    mfm_density = opt->density;
+    mfm_compact = opt->compact;
+    mfm_retry = opt->retry;
+    mfm_codec = opt->codec;
+    mfm_cache = opt->cache;
+    mfm_stats_on = opt->stats;
+    mfm_sector_size = opt->sector_size;
+}
+
+/*
+ * Таблица кодирования байта в MFM: 16 полубитов.
+ * Индекс - значение байта, плюс 256, если предыдущий полубит был единицей.
+ */
+static const unsigned short encode_tab [512] = {
+    0xaaaa, 0xaaa9, 0xaaa4, 0xaaa5, 0xaa92, 0xaa91, 0xaa94, 0xaa95,
+    0xaa4a, 0xaa49, 0xaa44, 0xaa45, 0xaa52, 0xaa51, 0xaa54, 0xaa55,
+    0xa92a, 0xa929, 0xa924, 0xa925, 0xa912, 0xa911, 0xa914, 0xa915,
+    0xa94a, 0xa949, 0xa944, 0xa945, 0xa952, 0xa951, 0xa954, 0xa955,
+    0xa4aa, 0xa4a9, 0xa4a4, 0xa4a5, 0xa492, 0xa491, 0xa494, 0xa495,
+    0xa44a, 0xa449, 0xa444, 0xa445, 0xa452, 0xa451, 0xa454, 0xa455,
+    0xa52a, 0xa529, 0xa524, 0xa525, 0xa512, 0xa511, 0xa514, 0xa515,
+    0xa54a, 0xa549, 0xa544, 0xa545, 0xa552, 0xa551, 0xa554, 0xa555,
+    0x92aa, 0x92a9, 0x92a4, 0x92a5, 0x9292, 0x9291, 0x9294, 0x9295,
+    0x924a, 0x9249, 0x9244, 0x9245, 0x9252, 0x9251, 0x9254, 0x9255,
+    0x912a, 0x9129, 0x9124, 0x9125, 0x9112, 0x9111, 0x9114, 0x9115,
+    0x914a, 0x9149, 0x9144, 0x9145, 0x9152, 0x9151, 0x9154, 0x9155,
+    0x94aa, 0x94a9, 0x94a4, 0x94a5, 0x9492, 0x9491, 0x9494, 0x9495,
+    0x944a, 0x9449, 0x9444, 0x9445, 0x9452, 0x9451, 0x9454, 0x9455,
+    0x952a, 0x9529, 0x9524, 0x9525, 0x9512, 0x9511, 0x9514, 0x9515,
+    0x954a, 0x9549, 0x9544, 0x9545, 0x9552, 0x9551, 0x9554, 0x9555,
+    0x4aaa, 0x4aa9, 0x4aa4, 0x4aa5, 0x4a92, 0x4a91, 0x4a94, 0x4a95,
+    0x4a4a, 0x4a49, 0x4a44, 0x4a45, 0x4a52, 0x4a51, 0x4a54, 0x4a55,
+    0x492a, 0x4929, 0x4924, 0x4925, 0x4912, 0x4911, 0x4914, 0x4915,
+    0x494a, 0x4949, 0x4944, 0x4945, 0x4952, 0x4951, 0x4954, 0x4955,
+    0x44aa, 0x44a9, 0x44a4, 0x44a5, 0x4492, 0x4491, 0x4494, 0x4495,
+    0x444a, 0x4449, 0x4444, 0x4445, 0x4452, 0x4451, 0x4454, 0x4455,
+    0x452a, 0x4529, 0x4524, 0x4525, 0x4512, 0x4511, 0x4514, 0x4515,
+    0x454a, 0x4549, 0x4544, 0x4545, 0x4552, 0x4551, 0x4554, 0x4555,
+    0x52aa, 0x52a9, 0x52a4, 0x52a5, 0x5292, 0x5291, 0x5294, 0x5295,
+    0x524a, 0x5249, 0x5244, 0x5245, 0x5252, 0x5251, 0x5254, 0x5255,
+    0x512a, 0x5129, 0x5124, 0x5125, 0x5112, 0x5111, 0x5114, 0x5115,
+    0x514a, 0x5149, 0x5144, 0x5145, 0x5152, 0x5151, 0x5154, 0x5155,
+    0x54aa, 0x54a9, 0x54a4, 0x54a5, 0x5492, 0x5491, 0x5494, 0x5495,
+    0x544a, 0x5449, 0x5444, 0x5445, 0x5452, 0x5451, 0x5454, 0x5455,
+    0x552a, 0x5529, 0x5524, 0x5525, 0x5512, 0x5511, 0x5514, 0x5515,
+    0x554a, 0x5549, 0x5544, 0x5545, 0x5552, 0x5551, 0x5554, 0x5555,
+    0x2aaa, 0x2aa9, 0x2aa4, 0x2aa5, 0x2a92, 0x2a91, 0x2a94, 0x2a95,
+    0x2a4a, 0x2a49, 0x2a44, 0x2a45, 0x2a52, 0x2a51, 0x2a54, 0x2a55,
+    0x292a, 0x2929, 0x2924, 0x2925, 0x2912, 0x2911, 0x2914, 0x2915,
+    0x294a, 0x2949, 0x2944, 0x2945, 0x2952, 0x2951, 0x2954, 0x2955,
+    0x24aa, 0x24a9, 0x24a4, 0x24a5, 0x2492, 0x2491, 0x2494, 0x2495,
+    0x244a, 0x2449, 0x2444, 0x2445, 0x2452, 0x2451, 0x2454, 0x2455,
+    0x252a, 0x2529, 0x2524, 0x2525, 0x2512, 0x2511, 0x2514, 0x2515,
+    0x254a, 0x2549, 0x2544, 0x2545, 0x2552, 0x2551, 0x2554, 0x2555,
+    0x12aa, 0x12a9, 0x12a4, 0x12a5, 0x1292, 0x1291, 0x1294, 0x1295,
+    0x124a, 0x1249, 0x1244, 0x1245, 0x1252, 0x1251, 0x1254, 0x1255,
+    0x112a, 0x1129, 0x1124, 0x1125, 0x1112, 0x1111, 0x1114, 0x1115,
+    0x114a, 0x1149, 0x1144, 0x1145, 0x1152, 0x1151, 0x1154, 0x1155,
+    0x14aa, 0x14a9, 0x14a4, 0x14a5, 0x1492, 0x1491, 0x1494, 0x1495,
+    0x144a, 0x1449, 0x1444, 0x1445, 0x1452, 0x1451, 0x1454, 0x1455,
+    0x152a, 0x1529, 0x1524, 0x1525, 0x1512, 0x1511, 0x1514, 0x1515,
+    0x154a, 0x1549, 0x1544, 0x1545, 0x1552, 0x1551, 0x1554, 0x1555,
+    0x4aaa, 0x4aa9, 0x4aa4, 0x4aa5, 0x4a92, 0x4a91, 0x4a94, 0x4a95,
+    0x4a4a, 0x4a49, 0x4a44, 0x4a45, 0x4a52, 0x4a51, 0x4a54, 0x4a55,
+    0x492a, 0x4929, 0x4924, 0x4925, 0x4912, 0x4911, 0x4914, 0x4915,
+    0x494a, 0x4949, 0x4944, 0x4945, 0x4952, 0x4951, 0x4954, 0x4955,
+    0x44aa, 0x44a9, 0x44a4, 0x44a5, 0x4492, 0x4491, 0x4494, 0x4495,
+    0x444a, 0x4449, 0x4444, 0x4445, 0x4452, 0x4451, 0x4454, 0x4455,
+    0x452a, 0x4529, 0x4524, 0x4525, 0x4512, 0x4511, 0x4514, 0x4515,
+    0x454a, 0x4549, 0x4544, 0x4545, 0x4552, 0x4551, 0x4554, 0x4555,
+    0x52aa, 0x52a9, 0x52a4, 0x52a5, 0x5292, 0x5291, 0x5294, 0x5295,
+    0x524a, 0x5249, 0x5244, 0x5245, 0x5252, 0x5251, 0x5254, 0x5255,
+    0x512a, 0x5129, 0x5124, 0x5125, 0x5112, 0x5111, 0x5114, 0x5115,
+    0x514a, 0x5149, 0x5144, 0x5145, 0x5152, 0x5151, 0x5154, 0x5155,
+    0x54aa, 0x54a9, 0x54a4, 0x54a5, 0x5492, 0x5491, 0x5494, 0x5495,
+    0x544a, 0x5449, 0x5444, 0x5445, 0x5452, 0x5451, 0x5454, 0x5455,
+    0x552a, 0x5529, 0x5524, 0x5525, 0x5512, 0x5511, 0x5514, 0x5515,
+    0x554a, 0x5549, 0x5544, 0x5545, 0x5552, 0x5551, 0x5554, 0x5555,
+};
+
+/*
+ * Таблица декодирования: из восьми полубитов извлекаем
+ * четыре бита данных (нечётные полубиты).
+ */
+static const unsigned char decode_tab [256] = {
+    0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+    4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+    0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+    4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+    8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+    12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+    8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+    12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+    0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+    4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+    0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+    4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+    8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+    12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+    8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+    12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+};
 
 /*
  * Чтение полубита.
  */
 int mfm_read_halfbit(mfm_reader_t *reader)
 {
-    /* Дорожка закончилась. */
-    if (reader->halfbit >= 102400)
-        return -1;
-
-    if ((reader->halfbit & 7) == 0)
-        reader->byte = getc(reader->fd);
+    int h = reader->halfbit;
 
-    if (reader->byte < 0)
+    /* Дорожка закончилась. */
+    if (h >= reader->nhalfbits)
         return -1;
 
     ++reader->halfbit;
-    reader->byte <<= 1;
-    return reader->byte >> 8 & 1;
+    return reader->buf [h >> 3] >> (7 - (h & 7)) & 1;
 }
 
 /*
@@ -66,9 +211,19 @@ int mfm_read_bit(mfm_reader_t *reader)
 }
 
 /*
- * Декодирование очередного байта.
+ * Выборка 16 полубитов, начиная с произвольной позиции.
  */
-int mfm_read_byte(mfm_reader_t *reader)
+static inline unsigned read_word(const unsigned char *p, int shift)
+{
+    if (shift == 0)
+        return p[0] << 8 | p[1];
+    return (p[0] << 16 | p[1] << 8 | p[2]) >> (8 - shift) & 0xffff;
+}
+
+/*
+ * Декодирование очередного байта по одному биту.
+ */
+static int read_byte_ref(mfm_reader_t *reader)
 {
     int byte, bit, i;
 
@@ -84,24 +239,678 @@ int mfm_read_byte(mfm_reader_t *reader)
 }
 
 /*
- * Подготовка к чтению очередной дорожки.
+ * Декодирование очередного байта.
  */
-void mfm_read_seek(mfm_reader_t *reader, FILE *fin, int t)
+static int read_byte(mfm_reader_t *reader)
 {
-    reader->fd = fin;
+    unsigned word;
+
+    if (reader->halfbit + 16 <= reader->nhalfbits) {
+        word = read_word(reader->buf + (reader->halfbit >> 3),
+            reader->halfbit & 7);
+        reader->halfbit += 16;
+        return decode_tab [word >> 8] << 4 | decode_tab [word & 0xff];
+    }
+
+    /* Конец дорожки: по одному биту. */
+    return read_byte_ref(reader);
+}
+
+static void read_bytes_ref(mfm_reader_t *reader, unsigned char *data,
+    int nbytes)
+{
+    while (nbytes-- > 0)
+        *data++ = read_byte_ref(reader);
+}
+
+/*
+ * Декодирование массива байтов.
+ */
+static void read_bytes(mfm_reader_t *reader, unsigned char *data, int nbytes)
+{
+    const unsigned char *p;
+    unsigned word;
+    int shift;
+
+    if (reader->halfbit + 16*nbytes > reader->nhalfbits) {
+        /* Не хватает данных до конца дорожки. */
+        while (nbytes-- > 0)
+            *data++ = read_byte(reader);
+        return;
+    }
+    p = reader->buf + (reader->halfbit >> 3);
+    shift = reader->halfbit & 7;
+    reader->halfbit += 16*nbytes;
+    if (shift == 0) {
+        /* Данные выровнены на границу байта. */
+        while (nbytes-- > 0) {
+            *data++ = decode_tab [p[0]] << 4 | decode_tab [p[1]];
+            p += 2;
+        }
+        return;
+    }
+    while (nbytes-- > 0) {
+        word = read_word(p, shift);
+        *data++ = decode_tab [word >> 8] << 4 | decode_tab [word & 0xff];
+        p += 2;
+    }
+}
+
+void mfm_read_bytes(mfm_reader_t *reader, unsigned char *data, int nbytes)
+{
+    int stage = mfm_stage(MFM_STAGE_DECODE);
+
+    mfm_codec->read_bytes(reader, data, nbytes);
+    mfm_stage(stage);
+}
+
+/*
+ * Подготовка к чтению очередной дорожки:
+ * загружаем её в память целиком.
+ */
+void mfm_read_seek(mfm_reader_t *reader, mfm_io_t *in, int t)
+{
+    reader->io = in;
+    reader->err = mfm_err;
     reader->track = t;
     reader->halfbit = 0;
-    fseek(reader->fd, t * 12800L, SEEK_SET);
+    reader->nhalfbits = mfm_io_read_track(in, t, reader->buf) * 8;
+    reader->tolerant = 0;
+    reader->nmarks = -1;
+}
+
+/*
+ * Маркеры в виде 64 полубитов: байт нулей и три слова синхронизации.
+ * В байте нулей проверяем только биты данных, без синхроимпульсов.
+ * Для Amiga последнее слово - байт fx, проверяем старшие биты данных.
+ */
+#define SYNC_MASK       0x5555ffffffffffffULL
+#define SYNC_A1         0x0000448944894489ULL
+#define SYNC_C2         0x0000528452845284ULL
+#define SYNC_C2_STD     0x0000522452245224ULL   /* standard index mark */
+#define SYNC_MASK_AMIGA 0x5555ffffffff5500ULL
+#define SYNC_AMIGA      0x0000448944895500ULL
+#define SYNC_CLOCK      0xaaaaaaaaaaaaaaaaULL   /* синхроимпульсы */
+
+/*
+ * Совпадение с шаблоном с точностью до одного синхроимпульса:
+ * биты данных должны совпасть точно.
+ */
+static inline int sync_match(unsigned long long w, unsigned long long mask,
+    unsigned long long pattern)
+{
+    unsigned long long diff = (w ^ pattern) & mask;
+
+    return (diff & ~SYNC_CLOCK) == 0 && (diff & (diff - 1)) == 0;
+}
+
+/*
+ * Проверка окна из 64 полубитов на маркер.
+ * При tolerant допускаем один ошибочный синхроимпульс.
+ */
+static inline int sync_type(unsigned long long w, int tolerant)
+{
+    unsigned mid = w >> 16 & 0xffff;
+
+    /* Шаблоны всех маркеров содержат слово синхронизации
+     * в битах 16...31, так что большинство позиций
+     * отбрасывается одним сравнением. */
+    if (mid == MFM_MARK_A1) {
+        if ((w & SYNC_MASK) == SYNC_A1)
+            return MFM_SYNC_IBMPC;
+        if ((w & SYNC_MASK_AMIGA) == SYNC_AMIGA)
+            return MFM_SYNC_AMIGA;
+    } else if (mid == MFM_MARK_C2 || mid == (SYNC_C2_STD & 0xffff)) {
+        if ((w & SYNC_MASK) == SYNC_C2 ||
+            (w & SYNC_MASK) == SYNC_C2_STD)
+            return MFM_SYNC_INDEX;
+    }
+    if (! tolerant)
+        return 0;
+    if (sync_match(w, SYNC_MASK, SYNC_A1))
+        return MFM_SYNC_IBMPC;
+    if (sync_match(w, SYNC_MASK_AMIGA, SYNC_AMIGA))
+        return MFM_SYNC_AMIGA;
+    if (sync_match(w, SYNC_MASK, SYNC_C2) ||
+        sync_match(w, SYNC_MASK, SYNC_C2_STD))
+        return MFM_SYNC_INDEX;
+    return 0;
+}
+
+/*
+ * Шаблоны маркеров содержат слова синхронизации в битах 16...47.
+ * Каждое из этих слов полностью содержит байт дорожки, отстоящий
+ * на три и на пять байтов от конца окна.  Для каждого значения
+ * такого байта таблица даёт битовую маску сдвигов окна
+ * (бит s-1 для сдвига s), при которых маркер возможен.
+ * С одним ошибочным синхроимпульсом точно совпадает хотя бы
+ * одно из двух слов, и годится сдвиг, допустимый по любому байту.
+ */
+static const unsigned char sync_shift_tab [256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x0a, 0x00, 0x10, 0x00, 0x00, 0x00,
+    0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x00, 0x85, 0x00, 0x00, 0x00,
+    0x28, 0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x04, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x42, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x14, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x02, 0x00, 0x00, 0x40, 0x40, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/*
+ * Полубит дорожки в буфере.
+ */
+static inline int get_halfbit(const unsigned char *buf, int h)
+{
+    return buf [h >> 3] >> (7 - (h & 7)) & 1;
+}
+
+static inline void put_halfbit(unsigned char *buf, int h, int val)
+{
+    buf [h >> 3] = (buf [h >> 3] & ~(0x80 >> (h & 7))) |
+        (val << (7 - (h & 7)));
+}
+
+/*
+ * Эталонный поиск маркеров: окно сдвигается на один полубит.
+ */
+static int scan_marks_ref(mfm_reader_t *reader, int from, mfm_mark_t *mark,
+    int maxmarks, int *scanned_to)
+{
+    unsigned long long w = 0;
+    int h, n = 0, type;
+
+    for (h=from; h<reader->nhalfbits; ++h) {
+        w = w << 1 | get_halfbit(reader->buf, h);
+        if (h + 1 - 64 < from)
+            continue;
+        type = sync_type(w, reader->tolerant);
+        if (! type)
+            continue;
+        if (n >= maxmarks) {
+            *scanned_to = h + 1 - 64;
+            return n;
+        }
+        mark[n].halfbit = h + 1;
+        mark[n].type = type;
+        n++;
+    }
+    *scanned_to = reader->nhalfbits;
+    return n;
+}
+
+/*
+ * Поиск маркеров на дорожке, начиная с полубита from.
+ * Окно шаблона целиком должно лежать после from.
+ * Окно из 64 полубитов сдвигается на байт за шаг; полная проверка
+ * выполняется только для сдвигов, допустимых по sync_shift_tab[].
+ * Возвращаем количество найденных маркеров (не более maxmarks)
+ * и позицию, до которой просмотрена дорожка.
+ * Вызывается с постоянным tolerant, чтобы на исправных дорожках
+ * цикл оставался таким же коротким.
+ */
+static inline __attribute__((always_inline))
+int scan_bytes(mfm_reader_t *reader, int from, mfm_mark_t *mark,
+    int maxmarks, int *scanned_to, const int tolerant)
+{
+    const unsigned char *p = reader->buf;
+    unsigned long long w;
+    int nbytes = reader->nhalfbits >> 3;
+    int i, s, n, type, end, shifts;
+
+    /* Окно заполняется целыми байтами, начиная с from. */
+    n = 0;
+    w = 0;
+    i = from >> 3;
+    if (from & 7) {
+        w = p[i] & (0xff >> (from & 7));
+        i++;
+    }
+    for (; i<5 && i<nbytes; ++i)
+        w = w << 8 | p[i];
+    for (; i<nbytes; ++i) {
+        if (tolerant)
+            shifts = sync_shift_tab [p[i-3]] | sync_shift_tab [p[i-5]];
+        else
+            shifts = sync_shift_tab [p[i-3]] & sync_shift_tab [p[i-5]];
+        for (s=1; shifts; ++s, shifts >>= 1) {
+            if (! (shifts & 1))
+                continue;
+            type = sync_type(w << s | p[i] >> (8 - s), tolerant);
+            if (! type)
+                continue;
+
+            end = i*8 + s;
+            if (end - 64 < from)
+                continue;
+            if (n >= maxmarks) {
+                /* Нет места: продолжим с этого маркера. */
+                *scanned_to = end - 64;
+                return n;
+            }
+            mark[n].halfbit = end;
+            mark[n].type = type;
+            n++;
+        }
+        w = w << 8 | p[i];
+    }
+    *scanned_to = reader->nhalfbits;
+    return n;
+}
+
+static int scan_marks(mfm_reader_t *reader, int from, mfm_mark_t *mark,
+    int maxmarks, int *scanned_to)
+{
+    if (reader->tolerant)
+        return scan_bytes(reader, from, mark, maxmarks, scanned_to, 1);
+    return scan_bytes(reader, from, mark, maxmarks, scanned_to, 0);
+}
+
+int mfm_scan_marks(mfm_reader_t *reader, int from, mfm_mark_t *mark,
+    int maxmarks, int *scanned_to)
+{
+    return mfm_codec->scan_marks(reader, from, mark, maxmarks, scanned_to);
+}
+
+/*
+ * Просмотр дорожки с заданной позиции, с запоминанием маркеров.
+ */
+static void rescan_marks(mfm_reader_t *reader, int from)
+{
+    int stage = mfm_stage(MFM_STAGE_SCAN);
+
+    if (from < 0)
+        from = 0;
+    reader->marks_from = from;
+    reader->nmarks = mfm_scan_marks(reader, from, reader->mark,
+        MAXMARKS, &reader->marks_to);
+    mfm_stage(stage);
+    mfm_count(marks, reader->nmarks);
+}
+
+/*
+ * Поиск ближайшего маркера заданных типов после текущей позиции.
+ * Маркеры ищутся один раз на всю дорожку и запоминаются.
+ * Для Amiga байт нулей перед маркером может предшествовать
+ * текущей позиции, поэтому окно короче на 16 полубитов.
+ */
+const mfm_mark_t *mfm_next_mark(mfm_reader_t *reader, int types)
+{
+    const mfm_mark_t *m;
+    int i, window;
+
+    if (reader->nmarks < 0)
+        rescan_marks(reader, 0);
+    else if (reader->marks_from > 0 &&
+        reader->halfbit - 16 < reader->marks_from)
+        rescan_marks(reader, reader->halfbit - 16);
+    for (;;) {
+        for (i=0; i<reader->nmarks; ++i) {
+            m = &reader->mark[i];
+            if (! (m->type & types))
+                continue;
+            window = (m->type == MFM_SYNC_AMIGA) ? 48 : 64;
+            if (m->halfbit - window >= reader->halfbit)
+                return m;
+        }
+        if (reader->marks_to >= reader->nhalfbits)
+            return 0;
+
+        /* Не все маркеры поместились: просматриваем дальше. */
+        if (reader->marks_to > reader->halfbit - 16)
+            rescan_marks(reader, reader->marks_to);
+        else
+            rescan_marks(reader, reader->halfbit - 16);
+    }
+}
+
+/*
+ * Загрузка дорожки для построения оглавления.
+ * Если дорожка уже загружена, оглавление сохраняется:
+ * повторно дорожку не читаем и не просматриваем.
+ */
+void mfm_index_seek(mfm_track_index_t *idx, mfm_io_t *in, int t)
+{
+    if (idx->loaded && idx->reader.io == in && idx->reader.track == t)
+        return;
+    mfm_read_seek(&idx->reader, in, t);
+    idx->loaded = 1;
+    idx->format = 0;
+    idx->nsectors = 0;
+}
+
+/*
+ * Загрузка оглавления дорожки из памяти.
+ */
+void mfm_index_load(mfm_track_index_t *idx, const unsigned char *buf,
+    int nbytes, int t)
+{
+    idx->reader.io = 0;
+    idx->reader.err = mfm_err;
+    idx->reader.track = t;
+    idx->reader.halfbit = 0;
+    memcpy(idx->reader.buf, buf, nbytes);
+    idx->reader.nhalfbits = nbytes * 8;
+    idx->reader.tolerant = 0;
+    idx->reader.nmarks = -1;
+    idx->loaded = 1;
+    idx->format = 0;
+    idx->nsectors = 0;
+}
+
+/*
+ * Начинаем строить оглавление дорожки заданного формата.
+ * Диагностика накапливается в памяти и выдаётся позже,
+ * по мере использования секторов.
+ */
+void mfm_index_start(mfm_track_index_t *idx, int format)
+{
+    if (! idx->diag)
+        idx->diag = open_memstream(&idx->diag_buf, &idx->diag_size);
+    if (idx->diag)
+        rewind(idx->diag);
+    idx->reader.err = idx->diag ? idx->diag : mfm_err;
+    idx->reader.halfbit = 0;
+    idx->format = format;
+    idx->nsectors = 0;
+    idx->final_gap = 0;
+    idx->diag_end = 0;
+    idx->diag_printed = 0;
+}
+
+/*
+ * Очередной сектор занесён в оглавление.
+ */
+void mfm_index_add(mfm_track_index_t *idx)
+{
+    idx->sect[idx->nsectors].diag_end = idx->diag ? ftell(idx->diag) : 0;
+    idx->nsectors++;
+}
+
+/*
+ * Оглавление построено.
+ */
+void mfm_index_finish(mfm_track_index_t *idx)
+{
+    if (idx->diag) {
+        idx->diag_end = ftell(idx->diag);
+        fflush(idx->diag);
+    }
+    idx->reader.err = mfm_err;
+}
+
+/*
+ * Признак потерянных секторов: пропуски в номерах секторов,
+ * меньше nsectors секторов, или маркеров формата больше,
+ * чем нужно найденным секторам.
+ */
+static int index_incomplete(const mfm_track_index_t *idx,
+    int marks_per_sector, int nsectors)
+{
+    const mfm_reader_t *reader = &idx->reader;
+    int have_sector [MAXINDEX];
+    int i, s, last, nmarks;
+
+    if (idx->nsectors < nsectors)
+        return 1;
+    for (s=0; s<MAXINDEX; ++s)
+        have_sector [s] = 0;
+    last = -1;
+    for (i=0; i<idx->nsectors; ++i) {
+        s = idx->sect[i].sector;
+        if (s < 0 || s >= MAXINDEX)
+            continue;
+        have_sector [s] = 1;
+        if (s > last)
+            last = s;
+    }
+    for (s=0; s<last; ++s)
+        if (! have_sector [s])
+            return 1;
+
+    /* Маркеры известны, только если дорожка просмотрена целиком. */
+    if (reader->marks_from > 0 || reader->marks_to < reader->nhalfbits)
+        return 0;
+    nmarks = 0;
+    for (i=0; i<reader->nmarks; ++i)
+        if (reader->mark[i].type == idx->format)
+            nmarks++;
+    return nmarks > marks_per_sector * idx->nsectors;
+}
+
+/*
+ * Строим оглавление дорожки: read_sector() читает очередной сектор
+ * формата format. Маркер с одним ошибочным синхроимпульсом точным
+ * сравнением не находится, и его сектор теряется. Если секторов
+ * не хватает, просматриваем дорожку повторно, допуская такие
+ * маркеры; на исправных дорожках поиск остаётся быстрым.
+ * Счётчики статистики учтены при первом просмотре.
+ */
+void mfm_index_build(mfm_track_index_t *idx, int format,
+    int (*read_sector)(mfm_reader_t *reader, unsigned char *data,
+        mfm_sector_t *sect), int marks_per_sector, int nsectors)
+{
+    mfm_sector_t *sect;
+    int stats_on = mfm_stats_on;
+
+    for (;;) {
+        mfm_index_start(idx, format);
+        while (idx->nsectors < MAXINDEX) {
+            sect = &idx->sect [idx->nsectors];
+            if (read_sector(&idx->reader,
+                idx->data [idx->nsectors], sect) < 0) {
+                idx->final_gap = sect->sector_gap;
+                break;
+            }
+            mfm_index_add(idx);
+        }
+        mfm_index_finish(idx);
+        if (idx->reader.tolerant ||
+            ! index_incomplete(idx, marks_per_sector, nsectors))
+            break;
+        idx->reader.tolerant = 1;
+        idx->reader.nmarks = -1;
+        mfm_stats_on = 0;
+    }
+    mfm_stats_on = stats_on;
+}
+
+/*
+ * Выдача накопленной диагностики до позиции upto, или всей при -1.
+ */
+void mfm_index_print(mfm_track_index_t *idx, long upto)
+{
+    if (upto < 0 || upto > idx->diag_end)
+        upto = idx->diag_end;
+    if (upto > idx->diag_printed) {
+        fwrite(idx->diag_buf + idx->diag_printed, 1,
+            upto - idx->diag_printed, mfm_err);
+        idx->diag_printed = upto;
+    }
+}
+
+/*
+ * Освобождение памяти оглавления.
+ */
+void mfm_index_free(mfm_track_index_t *idx)
+{
+    if (idx->diag) {
+        fclose(idx->diag);
+        idx->diag = 0;
+    }
+    free(idx->diag_buf);
+    idx->diag_buf = 0;
+    idx->loaded = 0;
+}
+
+/*
+ * Задание на параллельное построение оглавлений.
+ */
+typedef struct {
+    mfm_track_index_t *tab;
+    mfm_io_t *in;
+    int ntracks;
+    void (*index)(mfm_track_index_t *idx);
+    pthread_mutex_t lock;
+    int next;                   /* next track to index */
+    int error;                  /* first error in workers */
+    mfm_options_t opt;          /* options of calling thread */
+} index_job_t;
+
+static void index_tracks(void *arg)
+{
+    index_job_t *job = arg;
+    mfm_track_index_t *idx;
+    int t;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        t = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (t >= job->ntracks)
+            return;
+
+        idx = &job->tab[t];
+        mfm_read_seek(&idx->reader, job->in, t);
+        idx->loaded = 1;
+        job->index(idx);
+    }
+}
+
+/*
+ * Ошибку запоминаем и останавливаем остальные потоки:
+ * mfm_fail() вызовет поток-хозяин задания.
+ */
+static void *index_worker(void *arg)
+{
+    index_job_t *job = arg;
+    int error;
+
+    mfm_options_load(&job->opt);
+    error = mfm_catch(index_tracks, job);
+
+    if (error != MFM_OK) {
+        pthread_mutex_lock(&job->lock);
+        if (job->error == MFM_OK)
+            job->error = error;
+        job->next = job->ntracks;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return 0;
+}
+
+/*
+ * Строим оглавления всех дорожек в mfm_jobs потоков.
+ * Каждый поток читает свои дорожки независимо от других.
+ * Возвращаем массив оглавлений, или 0, если файл не допускает
+ * произвольного доступа или задан однопоточный режим.
+ */
+mfm_track_index_t *mfm_index_parallel(mfm_io_t *in, int ntracks,
+    void (*index)(mfm_track_index_t *idx))
+{
+    index_job_t job;
+    pthread_t *thread;
+    int nthreads, i;
+
+    if (mfm_jobs <= 1 || ! mfm_io_random(in))
+        return 0;
+    nthreads = (mfm_jobs < ntracks) ? mfm_jobs : ntracks;
+    job.tab = calloc(ntracks, sizeof(job.tab[0]));
+    thread = calloc(nthreads, sizeof(thread[0]));
+    if (! job.tab || ! thread) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        free(job.tab);
+        free(thread);
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+    job.in = in;
+    job.ntracks = ntracks;
+    job.index = index;
+    job.next = 0;
+    job.error = MFM_OK;
+    mfm_options_save(&job.opt);
+    pthread_mutex_init(&job.lock, 0);
+
+    for (i=0; i<nthreads; ++i) {
+        if (pthread_create(&thread[i], 0, index_worker, &job) != 0) {
+            /* Справимся меньшим числом потоков. */
+            nthreads = i;
+            break;
+        }
+    }
+    if (nthreads == 0)
+        index_worker(&job);
+    for (i=0; i<nthreads; ++i)
+        pthread_join(thread[i], 0);
+
+    pthread_mutex_destroy(&job.lock);
+    free(thread);
+    if (job.error != MFM_OK) {
+        mfm_index_release(job.tab, ntracks);
+        mfm_fail(job.error);
+    }
+    return job.tab;
+}
+
+/*
+ * Освобождение массива оглавлений.
+ */
+void mfm_index_release(mfm_track_index_t *tab, int ntracks)
+{
+    int t;
+
+    for (t=0; t<ntracks; ++t)
+        mfm_index_free(&tab[t]);
+    free(tab);
 }
 
 /*
  * Подготовка к записи очередной дорожки.
+ * Длина дорожки берётся из файла, без файла - двойная плотность.
  */
-void mfm_write_reset(mfm_writer_t *writer, FILE *fout)
+void mfm_write_reset(mfm_writer_t *writer, mfm_io_t *out)
 {
-    writer->fd = fout;
+    writer->io = out;
+    writer->nhalfbits = (out ? out->tracksz : TRACKSZ) * 8;
     writer->halfbit = 0;
     writer->last = 0;
+    writer->byte = 0;
+}
+
+/*
+ * Дорожка заполнена: выводим её целиком.
+ * Без файла дорожка остаётся в writer->buf.
+ */
+static void mfm_write_flush(mfm_writer_t *writer)
+{
+    if (writer->io) {
+        mfm_io_write(writer->io, writer->buf, writer->nhalfbits >> 3);
+        mfm_count(tracks_written, 1);
+    }
 }
 
 /*
@@ -110,16 +919,52 @@ void mfm_write_reset(mfm_writer_t *writer, FILE *fout)
 void mfm_write_halfbit(mfm_writer_t *writer, int val)
 {
     /* Дорожка закончилась. */
-    if (writer->halfbit >= 102400)
+    if (writer->halfbit >= writer->nhalfbits)
         return;
 
     val &= 1;
-    writer->byte <<= 1;
-    writer->byte |= val;
+    writer->byte = (writer->byte << 1 | val) & 0xff;
     writer->last = val;
     ++writer->halfbit;
-    if ((writer->halfbit & 7) == 0)
-        putc(writer->byte, writer->fd);
+    if ((writer->halfbit & 7) == 0) {
+        writer->buf [(writer->halfbit >> 3) - 1] = writer->byte;
+        if (writer->halfbit == writer->nhalfbits)
+            mfm_write_flush(writer);
+    }
+}
+
+/*
+ * Запись 16 полубитов, старшие вперёд.
+ */
+void mfm_write_word(mfm_writer_t *writer, unsigned val)
+{
+    unsigned char *p;
+    unsigned long acc;
+    int shift, i;
+
+    if (writer->halfbit > writer->nhalfbits - 16) {
+        /* Конец дорожки: не более, чем помещается. */
+        for (i=15; i>=0; --i)
+            mfm_write_halfbit(writer, val >> i);
+        return;
+    }
+    p = writer->buf + (writer->halfbit >> 3);
+    shift = writer->halfbit & 7;
+    if (shift == 0) {
+        p[0] = val >> 8;
+        p[1] = val;
+    } else {
+        /* В младших битах writer->byte ждут своей очереди
+         * shift полубитов незаконченного байта. */
+        acc = (unsigned long) writer->byte << 16 | (val & 0xffff);
+        p[0] = acc >> (shift + 8);
+        p[1] = acc >> shift;
+        writer->byte = acc & 0xff;
+    }
+    writer->last = val & 1;
+    writer->halfbit += 16;
+    if (writer->halfbit == writer->nhalfbits)
+        mfm_write_flush(writer);
 }
 
 /*
@@ -141,16 +986,20 @@ void mfm_write_bit(mfm_writer_t *writer, int val)
 /*
  * Кодирование очередного байта.
  */
-void mfm_write_byte(mfm_writer_t *writer, int val)
+static void write_byte(mfm_writer_t *writer, int val)
+{
+    mfm_write_word(writer, encode_tab [writer->last << 8 | (val & 0xff)]);
+}
+
+static void write_byte_ref(mfm_writer_t *writer, int val)
 {
     int i;
 
-    for (i=0; i<8; ++i) {
-        mfm_write_bit(writer, val >> 7);
-        val <<= 1;
-    }
+    for (i=7; i>=0; --i)
+        mfm_write_bit(writer, val >> i);
 }
 
+
 /*
  * Кодирование массива байтов.
  */
@@ -174,17 +1023,151 @@ void mfm_write_gap(mfm_writer_t *writer, int nbytes, int val)
  */
 void mfm_fill_track(mfm_writer_t *writer, int val)
 {
-    while (writer->halfbit < 102400)
+    while (writer->halfbit < writer->nhalfbits)
         mfm_write_byte(writer, val);
 }
 
-void mfm_dump(FILE *fin, int ntracks)
+/*
+ * Эталонная замена: кодируем данные побитно в отдельный буфер
+ * и переносим по одному полубиту.
+ */
+static void write_patch_ref(mfm_writer_t *writer, int halfbit,
+    const unsigned char *data, int nbytes)
+{
+    mfm_writer_t tmp;
+    int h, i, end;
+
+    if (halfbit >= writer->nhalfbits)
+        return;
+    if (nbytes > (writer->nhalfbits - halfbit) / 16)
+        nbytes = (writer->nhalfbits - halfbit) / 16;
+    end = halfbit + nbytes*16;
+
+    mfm_write_reset(&tmp, 0);
+    tmp.last = (halfbit > 0) ? get_halfbit(writer->buf, halfbit-1) : 0;
+    for (i=0; i<nbytes; ++i)
+        write_byte_ref(&tmp, data[i]);
+    for (h=halfbit, i=0; h<end; ++h, ++i)
+        put_halfbit(writer->buf, h, get_halfbit(tmp.buf, i));
+
+    /* Синхроимпульс следующего байта, если его бит данных нулевой. */
+    if (end + 1 < writer->nhalfbits && ! get_halfbit(writer->buf, end+1))
+        put_halfbit(writer->buf, end, ! tmp.last);
+}
+
+/*
+ * Кодирование nbytes байтов поверх дорожки в буфере writer,
+ * с позиции halfbit, кратной 16. Так дорожка собирается из
+ * готового образца: меняются только поля с данными.
+ * Синхроимпульсы на краях вычисляются по соседним битам.
+ * В файл ничего не выводится.
+ */
+static void write_patch(mfm_writer_t *writer, int halfbit,
+    const unsigned char *data, int nbytes)
+{
+    unsigned char *p = writer->buf + (halfbit >> 3);
+    unsigned char *end = writer->buf + (writer->nhalfbits >> 3);
+    unsigned w;
+    int last;
+
+    if (p >= end)
+        return;
+    last = (halfbit > 0) ? p[-1] & 1 : 0;
+    while (nbytes-- > 0 && p + 2 <= end) {
+        w = encode_tab [last << 8 | *data++];
+        p[0] = w >> 8;
+        p[1] = w;
+        last = w & 1;
+        p += 2;
+    }
+
+    /* Синхроимпульс следующего байта, если его бит данных нулевой. */
+    if (p < end && ! (p[0] & 0x40))
+        p[0] = (p[0] & 0x7f) | (last ? 0 : 0x80);
+}
+
+void mfm_write_patch(mfm_writer_t *writer, int halfbit,
+    const unsigned char *data, int nbytes)
+{
+    mfm_codec->write_patch(writer, halfbit, data, nbytes);
+}
+
+const mfm_codec_t mfm_codec_fast = {
+    .read_byte   = read_byte,
+    .read_bytes  = read_bytes,
+    .scan_marks  = scan_marks,
+    .write_byte  = write_byte,
+    .write_patch = write_patch,
+    .crc16       = mfm_crc16,
+    .spread      = mfm_spread,
+    .gather      = mfm_gather,
+    .unshuffle   = mfm_unshuffle,
+    .shuffle     = mfm_shuffle,
+    .flux        = scp_flux,
+};
+
+/*
+ * Эталонный набор: всё по одному биту, без таблиц и сдвигов
+ * на слово. Медленно, зато просто; служит для сверки результатов
+ * быстрых кодеков.
+ */
+const mfm_codec_t mfm_codec_ref = {
+    .read_byte   = read_byte_ref,
+    .read_bytes  = read_bytes_ref,
+    .scan_marks  = scan_marks_ref,
+    .write_byte  = write_byte_ref,
+    .write_patch = write_patch_ref,
+    .crc16       = mfm_crc16_ref,
+    .spread      = mfm_spread_ref,
+    .gather      = mfm_gather_ref,
+    .unshuffle   = mfm_unshuffle_ref,
+    .shuffle     = mfm_shuffle_ref,
+    .flux        = scp_flux_ref,
+};
+
+/*
+ * Замена nbytes байтов на дорожке в памяти, начиная с полубита
+ * halfbit, который должен быть синхроимпульсом. Синхроимпульсы
+ * на краях зависят от соседних битов. Возвращаем позицию конца,
+ * или -1, если данные не помещаются на дорожке.
+ */
+int mfm_splice(mfm_reader_t *reader, int halfbit,
+    const unsigned char *data, int nbytes)
+{
+    mfm_writer_t writer;
+    unsigned char *buf = reader->buf;
+    int end = halfbit + nbytes*16;
+    int h, i, val;
+
+    if (halfbit < 1 || end > reader->nhalfbits || nbytes > TRACKSZ/2)
+        return -1;
+
+    mfm_write_reset(&writer, 0);
+    writer.last = buf [(halfbit-1) >> 3] >> (7 - ((halfbit-1) & 7)) & 1;
+    mfm_write(&writer, (unsigned char*) data, nbytes);
+
+    for (h=halfbit, i=0; h<end; ++h, ++i) {
+        val = writer.buf [i >> 3] >> (7 - (i & 7)) & 1;
+        buf [h >> 3] = (buf [h >> 3] & ~(0x80 >> (h & 7))) |
+            (val << (7 - (h & 7)));
+    }
+
+    /* Синхроимпульс после данных: единица между двумя нулями. */
+    if (end + 1 < reader->nhalfbits) {
+        val = ! writer.last && ! (buf [(end+1) >> 3] >> (7 - ((end+1) & 7)) & 1);
+        buf [end >> 3] = (buf [end >> 3] & ~(0x80 >> (end & 7))) |
+            (val << (7 - (end & 7)));
+    }
+    return end;
+}
+
+void mfm_dump(mfm_io_t *in, int ntracks)
 {
     mfm_reader_t reader;
     int t, i, a, b, last_b;
 
     for (t=0; t<ntracks; ++t) {
-        mfm_read_seek(&reader, fin, t);
+        mfm_read_seek(&reader, in, t);
         a = b = last_b = 0;
         fprintf(mfm_err, "Track %d/%d:\n", t >> 1, t & 1);
         for (i=0;; ++i) {
@@ -210,7 +1193,7 @@ void mfm_dump(FILE *fin, int ntracks)
                 fprintf(mfm_err, "\n");
         }
         fprintf(mfm_err, "\n");
-        if (reader.fd)
+        if (reader.io)
             break;
     }
 }
@@ -25,64 +25,513 @@
  * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-#define MAXTRACK        160
-#define MAXSECT         11
+#define MAXTRACK        160     /* tracks in MFM file */
+#define MAXSECT         11      /* sectors per track for analysis */
 #define SECTSZ          512
+#define MAXSECTSZ       1024    /* IBM PC, size code 3 */
+#define TRACKSZ         12800   /* bytes of MFM data per track, DD */
+#define MAXTRACKSZ      (4*TRACKSZ)     /* ED */
+
+/*
+ * Плотность записи: во сколько раз дорожка длиннее, а полубит
+ * короче, чем у дискеты двойной плотности (2 мкс на полубит).
+ */
+#define MFM_DENSITY_DD  1       /* 720k, 250 kbit/sec */
+#define MFM_DENSITY_HD  2       /* 1.44M, 500 kbit/sec */
+#define MFM_DENSITY_ED  4       /* 2.88M, 1 Mbit/sec */
 
 #define INDEX_GAP       42      /* before first sector */
 #define DATA_GAP        22      /* between sector mark and data */
 #define SECTOR_GAP_9    80      /* 720k, 9 sectors per track */
 #define SECTOR_GAP_10   46      /* 800k, 10 sectors per track */
+#define SECTOR_GAP_18   84      /* 1.44M, 18 sectors per track */
+#define SECTOR_GAP_36   83      /* 2.88M, 36 sectors per track */
 
+/*
+ * Образ дискеты. Память под данные выделяется по геометрии
+ * и используется повторно при следующих преобразованиях.
+ */
 typedef struct {
     int ntracks;                /* 80 или 160 */
-    int nsectors_per_track;     /* 9..11 */
-    unsigned char block [MAXTRACK] [MAXSECT] [SECTSZ];
+    int nsectors_per_track;     /* 9, 10, 11 или больше */
+    int sector_size;            /* bytes per sector */
+    unsigned char *data;        /* ntracks * nsectors_per_track sectors */
+    size_t data_size;           /* allocated bytes */
 } mfm_disk_t;
 
+/*
+ * Данные сектора s на дорожке t.
+ */
+#define mfm_block(d, t, s) ((d)->data + \
+    ((size_t) (t) * (d)->nsectors_per_track + (s)) * (d)->sector_size)
+
+/*
+ * Типы маркеров, найденных на дорожке.
+ */
+#define MFM_SYNC_IBMPC  1       /* 00-a1-a1-a1, IBM PC */
+#define MFM_SYNC_INDEX  2       /* 00-c2-c2-c2, IBM PC index */
+#define MFM_SYNC_AMIGA  4       /* 00-a1-a1-fx, Amiga */
+
+#define MAXMARKS        128     /* marks cached per scan */
+
+/*
+ * Ввод-вывод MFM-файла целыми дорожками.
+ */
+#define MFM_IO_STREAM   0       /* pipe or output file: read()/write() */
+#define MFM_IO_PREAD    1       /* input file, pread() */
+#define MFM_IO_MMAP     2       /* input file mapped into memory */
+#define MFM_IO_MEMORY   3       /* buffer in memory */
+
+/*
+ * Компактный MFM-файл в процессе записи, см. compact.c.
+ */
 typedef struct {
-    FILE *fd;
+    unsigned char track [MAXTRACKSZ];   /* track being assembled */
+    size_t fill;                /* bytes in track[] */
+    unsigned char *data;        /* packed tracks */
+    size_t size;                /* bytes in data[] */
+    size_t alloc;
+    int ntracks;
+    unsigned offset [MAXTRACK]; /* of packed tracks in data[] */
+} mfm_compact_t;
+
+/*
+ * HFE-файл в процессе записи, см. hfe.c.
+ */
+typedef struct {
+    unsigned char track [MAXTRACKSZ];   /* track being assembled */
+    size_t fill;                /* bytes in track[] */
+    unsigned char cyl [2*MAXTRACKSZ];   /* both sides, interleaved */
+    int ntracks;
+    int amiga;                  /* track encoding */
+} mfm_hfe_t;
+
+/*
+ * SCP-файл в процессе записи, см. scpout.c.
+ * Отсчёт потока занимает 2 байта, на байт дорожки их не больше 8,
+ * плюс переполнения длинных интервалов.
+ */
+typedef struct {
+    unsigned char track [MAXTRACKSZ];   /* track being assembled */
+    size_t fill;                /* bytes in track[] */
+    unsigned char data [16 + 18*MAXTRACKSZ];    /* track header and flux */
+    int ntracks;
+    int amiga;                  /* disk type */
+    unsigned offset [MAXTRACK]; /* of track headers in file */
+    unsigned pos;               /* bytes written */
+    unsigned sum;               /* checksum of tracks */
+} mfm_scp_t;
+
+typedef struct {
+    int fd;
+    int mode;                   /* MFM_IO_xxx */
+    unsigned char *map;         /* mapped file or memory buffer */
+    size_t size;                /* bytes in map */
+    size_t alloc;               /* allocated for memory output */
+    off_t pos;                  /* stream: bytes passed */
+    int tracksz;                /* bytes per track, TRACKSZ * density */
+    int compact;                /* input is compact, see compact.c */
+    int ntracks;                /* tracks in compact input */
+    mfm_compact_t *zout;        /* compact output */
+    mfm_hfe_t *hout;            /* HFE output */
+    mfm_scp_t *sout;            /* SCP output */
+} mfm_io_t;
+
+typedef struct {
+    int halfbit;                /* position right after the mark */
+    int type;                   /* MFM_SYNC_xxx */
+} mfm_mark_t;
+
+typedef struct {
+    mfm_io_t *io;               /* 0 when loaded from memory */
+    FILE *err;                  /* diagnostics */
     int track;                  /* 0..159 */
-    int halfbit;                /* 0..102400 */
-    int byte;
+    int halfbit;                /* 0..nhalfbits */
+    int nhalfbits;              /* halfbits present in buf[] */
+    unsigned char buf [MAXTRACKSZ];
+
+    /* Marks found by mfm_scan_marks(). */
+    int tolerant;               /* accept one bad clock bit of a mark */
+    int nmarks;                 /* -1 when not scanned yet */
+    int marks_from;             /* scanned range of the track */
+    int marks_to;
+    mfm_mark_t mark [MAXMARKS];
 } mfm_reader_t;
 
+/*
+ * Сектор, найденный на дорожке.
+ */
+typedef struct {
+    int sector;                 /* sector number, from 0 */
+    int cylinder;               /* IBM PC cylinder, or Amiga track */
+    int head;
+    int size;                   /* IBM PC size code, 2 for 512 bytes */
+    int nbytes;                 /* data bytes, 128 << size */
+    int id_halfbit;             /* position after the ID mark */
+    int data_halfbit;           /* start of sector data */
+    int sector_gap;             /* bits before the ID mark */
+    int data_gap;               /* bits between ident and data mark */
+    int data_ok;                /* data checksum is correct */
+    int tag;                    /* IBM PC data mark, fb or f8 */
+    long diag_end;              /* diagnostics up to this sector */
+} mfm_sector_t;
+
+#define MAXINDEX        40      /* sectors per track in the index */
+
+/*
+ * Оглавление дорожки: маркеры и сектора.
+ * Строится один раз и используется для определения формата,
+ * анализа и извлечения данных.
+ */
+typedef struct {
+    mfm_reader_t reader;        /* track data and marks */
+    int loaded;                 /* reader holds the track */
+    int format;                 /* MFM_SYNC_IBMPC or MFM_SYNC_AMIGA, 0 if none */
+    int nsectors;
+    int final_gap;              /* bits after the last sector */
+    mfm_sector_t sect [MAXINDEX];
+    unsigned char data [MAXINDEX] [MAXSECTSZ];
+
+    /* Diagnostics of the indexing, printed when the track is used. */
+    FILE *diag;
+    char *diag_buf;
+    size_t diag_size;
+    long diag_end;
+    long diag_printed;
+} mfm_track_index_t;
+
+/*
+ * Маркеры A1 и C2 с нарушением кодирования, в виде 16 полубитов.
+ */
+#define MFM_MARK_A1     0x4489
+#define MFM_MARK_C2     0x5284
+
 typedef struct {
-    FILE *fd;
+    mfm_io_t *io;               /* 0 - keep the track in buf */
     int last;
-    int halfbit;                /* 0..102400 */
+    int halfbit;                /* 0..nhalfbits */
+    int nhalfbits;              /* track length */
     int byte;
+    unsigned char buf [MAXTRACKSZ];
 } mfm_writer_t;
 
-FILE *mfm_err;
-int mfm_verbose;
-int mfm_gap_byte;
-int mfm_index_gap;
-int mfm_sector_gap;
-int mfm_data_gap;
+/*
+ * Стандартный промежуток между секторами, в байтах, и плотность
+ * записи по количеству секторов на дорожке. Таблица упорядочена
+ * по nsectors: плотность берётся из первой строки, вмещающей
+ * данное количество секторов, промежуток - из строки с точно
+ * таким количеством.
+ */
+typedef struct {
+    int nsectors;               /* 0 - end of table */
+    int gap;                    /* 0 - default, from first entry */
+    int density;                /* MFM_DENSITY_xx */
+} mfm_gap_t;
+
+/*
+ * Описание формата дискеты: геометрия, маркеры и промежутки -
+ * константы, кодирование и декодирование секторов - функции
+ * формата. Разбор и запись дорожек, общие для всех форматов,
+ * см. format.c. Функции формата вызываются на дорожку или сектор,
+ * а не на байт, так что новый формат не замедляет остальные.
+ */
+typedef struct mfm_format {
+    const char *name;           /* for messages */
+    int sync;                   /* MFM_SYNC_xxx of sector marks */
+    int nsectors;               /* sectors per track, at least */
+    int sync_zeros;             /* zero bytes before marker */
+    int sync_marks;             /* A1 words of marker */
+    int mark_bytes;             /* marker and tag, counted in the gap */
+    int pre_gap;                /* bytes before index mark or first sector */
+    int index_mark;             /* index mark after pre-gap */
+    int data_gap;               /* bytes between ident and data, 0 - none */
+    const mfm_gap_t *gaps;      /* standard sector gaps, first is default */
+
+    /* Sectors of a track into the index. */
+    void (*index)(mfm_track_index_t *idx);
+
+    /* Track template: gaps and marks, with positions of sector
+     * fields in pos[2*s] and pos[2*s+1].  Then fields of track t. */
+    void (*layout)(const struct mfm_format *fmt, mfm_writer_t *writer,
+        const mfm_disk_t *d, int *pos);
+    void (*patch)(mfm_writer_t *writer, const int *pos, mfm_disk_t *d,
+        int t, int dt);
+} mfm_format_t;
 
-void mfm_read_seek(mfm_reader_t *reader, FILE *fin, int t);
+extern const mfm_format_t mfm_format_ibmpc;
+extern const mfm_format_t mfm_format_bk;
+extern const mfm_format_t mfm_format_amiga;
+
+/*
+ * Коды ошибок. Фатальная ошибка вызывает mfm_fail(): внутри
+ * библиотечного вызова происходит возврат с кодом, иначе выход.
+ */
+#define MFM_OK          0
+#define MFM_ERR_IO      -1      /* cannot read or write file */
+#define MFM_ERR_FORMAT  -2      /* bad input data */
+#define MFM_ERR_NOMEM   -3      /* out of memory */
+#define MFM_ERR_ARG     -4      /* bad parameter */
+
+/*
+ * Статистика преобразований, см. stats.c: время по стадиям
+ * и счётчики. Собирается, только когда включена mfm_stats_on.
+ */
+#define MFM_STAGE_OTHER 0
+#define MFM_STAGE_IO    1       /* reading and writing files */
+#define MFM_STAGE_PLL   2       /* flux to MFM */
+#define MFM_STAGE_SCAN  3       /* search of sync marks */
+#define MFM_STAGE_DECODE 4      /* MFM to data bytes */
+#define MFM_STAGE_CRC   5       /* IBM PC checksums */
+#define MFM_STAGE_ENCODE 6      /* data to MFM tracks */
+#define MFM_NSTAGES     7
+
+typedef struct {
+    unsigned long long wall_ns [MFM_NSTAGES];   /* summed by threads, other: cpu */
+    unsigned long long cpu_ns [MFM_NSTAGES];    /* other: by mfm_stats_print() */
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long tracks_read;
+    unsigned long long tracks_written;
+    unsigned long long marks;           /* sync marks found */
+    unsigned long long header_errors;   /* bad sector header checksum */
+    unsigned long long data_errors;     /* bad sector data checksum */
+    unsigned long long missing;         /* sectors not found */
+    unsigned long long retries;         /* extra decodes of SCP tracks */
+    unsigned long long cache_hits;      /* sectors encoded by cache */
+    unsigned long long cache_misses;
+} mfm_stats_t;
+
+extern __thread int mfm_stats_on;
+extern mfm_stats_t mfm_stats;
+
+#define mfm_count(field, n) do { \
+        if (mfm_stats_on) \
+            __atomic_add_fetch(&mfm_stats.field, (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+int mfm_stage(int stage);
+void mfm_stats_reset(void);
+void mfm_stats_print(FILE *f, int json);
+
+void mfm_fail(int error);
+int mfm_catch(void (*func)(void *arg), void *arg);
+
+/*
+ * Параметры преобразования свои у каждого потока: контексты
+ * библиотеки с разными параметрами работают параллельно.
+ * Рабочий поток получает копию параметров запустившего его
+ * потока, см. mfm_options_save() и mfm_options_load().
+ */
+extern __thread FILE *mfm_err;
+extern __thread int mfm_verbose;
+extern __thread int mfm_gap_byte;
+extern __thread int mfm_index_gap;
+extern __thread int mfm_sector_gap;
+extern __thread int mfm_data_gap;
+extern __thread int mfm_jobs;
+extern __thread int mfm_density;
+extern __thread int mfm_compact;
+extern __thread int mfm_retry;
+extern __thread int mfm_cache;
+extern __thread int mfm_sector_size;
+
+typedef struct {
+    FILE *err;
+    int verbose;
+    int gap_byte;
+    int index_gap;
+    int sector_gap;
+    int data_gap;
+    int jobs;
+    int density;
+    int compact;
+    int retry;
+    const struct mfm_codec *codec;
+    int cache;
+    int stats;
+    int sector_size;
+} mfm_options_t;
+
+void mfm_options_save(mfm_options_t *opt);
+void mfm_options_load(const mfm_options_t *opt);
+
+/*
+ * Кодеки: быстрые, на таблицах и сдвигах на слово, или эталонные,
+ * по одному биту. Набор выбирается один раз, на входе в программу
+ * или библиотеку (ключ --reference, ctx.reference); в самих кодеках
+ * режим не проверяется.
+ */
+typedef struct mfm_codec {
+    int (*read_byte)(mfm_reader_t *reader);
+    void (*read_bytes)(mfm_reader_t *reader, unsigned char *data,
+        int nbytes);
+    int (*scan_marks)(mfm_reader_t *reader, int from, mfm_mark_t *mark,
+        int maxmarks, int *scanned_to);
+    void (*write_byte)(mfm_writer_t *writer, int val);
+    void (*write_patch)(mfm_writer_t *writer, int halfbit,
+        const unsigned char *data, int nbytes);
+
+    /* IBM PC: CRC-16-CCITT. */
+    unsigned short (*crc16)(unsigned short sum, const unsigned char *buf,
+        unsigned len);
+
+    /* Amiga: 16 битов на чётные позиции слова и обратно;
+     * перестановка битов 512-байтного блока, с контрольной суммой. */
+    unsigned (*spread)(unsigned x);
+    unsigned (*gather)(unsigned x);
+    unsigned (*unshuffle)(const unsigned char *raw, unsigned char *data);
+    unsigned (*shuffle)(const unsigned char *data, unsigned char *raw);
+
+    /* SCP: отсчёты потока в интервалы, в нсек. */
+    unsigned (*flux)(const unsigned char *samples, unsigned nsamples,
+        unsigned *out);
+} mfm_codec_t;
+
+extern const mfm_codec_t mfm_codec_fast;
+extern const mfm_codec_t mfm_codec_ref;
+extern __thread const mfm_codec_t *mfm_codec;
+
+unsigned short mfm_crc16(unsigned short sum, const unsigned char *buf,
+    unsigned len);
+unsigned short mfm_crc16_ref(unsigned short sum, const unsigned char *buf,
+    unsigned len);
+unsigned mfm_spread(unsigned x);
+unsigned mfm_spread_ref(unsigned x);
+unsigned mfm_gather(unsigned x);
+unsigned mfm_gather_ref(unsigned x);
+unsigned mfm_unshuffle(const unsigned char *raw, unsigned char *data);
+unsigned mfm_unshuffle_ref(const unsigned char *raw, unsigned char *data);
+unsigned mfm_shuffle(const unsigned char *data, unsigned char *raw);
+unsigned mfm_shuffle_ref(const unsigned char *data, unsigned char *raw);
+unsigned scp_flux(const unsigned char *samples, unsigned nsamples,
+    unsigned *out);
+unsigned scp_flux_ref(const unsigned char *samples, unsigned nsamples,
+    unsigned *out);
+
+static inline int mfm_read_byte(mfm_reader_t *reader)
+{
+    return mfm_codec->read_byte(reader);
+}
+
+static inline void mfm_write_byte(mfm_writer_t *writer, int val)
+{
+    mfm_codec->write_byte(writer, val);
+}
+
+void mfm_io_open(mfm_io_t *io, int fd, int writing);
+void mfm_io_memory(mfm_io_t *io, const void *buf, size_t size);
+void mfm_io_rewind(mfm_io_t *io);
+void mfm_io_close(mfm_io_t *io);
+int mfm_io_random(mfm_io_t *io);
+size_t mfm_io_read_track(mfm_io_t *io, int t, unsigned char *buf);
+const unsigned char *mfm_io_peek(mfm_io_t *io, size_t nbytes, size_t *got);
+void mfm_io_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes);
+void mfm_io_density(mfm_io_t *io, int density);
+void mfm_io_compact(mfm_io_t *io);
+void mfm_io_flush(mfm_io_t *io);
+void mfm_io_copy(mfm_io_t *out, mfm_io_t *in);
+void mfm_io_output(mfm_io_t *io, const unsigned char *buf, size_t nbytes);
+void mfm_io_open_update(mfm_io_t *io, int fd);
+void mfm_io_update(mfm_io_t *io, int t, int offset,
+    const unsigned char *buf, size_t nbytes);
+
+int mfm_compact_check(const unsigned char *buf, size_t size,
+    int *ntracks, int *density);
+size_t mfm_compact_pack(const unsigned char *src, int nbytes,
+    unsigned char *dst);
+int mfm_compact_unpack(const unsigned char *src, size_t size,
+    unsigned char *dst, int nbytes);
+void mfm_compact_write(mfm_compact_t *z, const unsigned char *buf,
+    size_t nbytes, int tracksz);
+unsigned char *mfm_compact_finish(mfm_compact_t *z, int tracksz,
+    size_t *hsize);
+void mfm_compact_free(mfm_compact_t *z);
+
+void mfm_io_hfe(mfm_io_t *io, int amiga);
+void mfm_hfe_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes);
+void mfm_hfe_finish(mfm_io_t *io);
+void mfm_hfe_free(mfm_hfe_t *h);
+
+void mfm_io_scp(mfm_io_t *io, int amiga);
+void mfm_scp_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes);
+void mfm_scp_finish(mfm_io_t *io);
+void mfm_scp_free(mfm_scp_t *s);
+
+void mfm_read_seek(mfm_reader_t *reader, mfm_io_t *in, int t);
 int mfm_read_halfbit(mfm_reader_t *reader);
 int mfm_read_bit(mfm_reader_t *reader);
-int mfm_read_byte(mfm_reader_t *reader);
-void mfm_dump(FILE *fin, int ntracks);
+void mfm_read_bytes(mfm_reader_t *reader, unsigned char *data, int nbytes);
+int mfm_scan_marks(mfm_reader_t *reader, int from, mfm_mark_t *mark,
+    int maxmarks, int *scanned_to);
+const mfm_mark_t *mfm_next_mark(mfm_reader_t *reader, int types);
+int mfm_splice(mfm_reader_t *reader, int halfbit,
+    const unsigned char *data, int nbytes);
+void mfm_dump(mfm_io_t *in, int ntracks);
+
+void mfm_index_seek(mfm_track_index_t *idx, mfm_io_t *in, int t);
+void mfm_index_load(mfm_track_index_t *idx, const unsigned char *buf,
+    int nbytes, int t);
+void mfm_index_start(mfm_track_index_t *idx, int format);
+void mfm_index_add(mfm_track_index_t *idx);
+void mfm_index_finish(mfm_track_index_t *idx);
+void mfm_index_build(mfm_track_index_t *idx, int format,
+    int (*read_sector)(mfm_reader_t *reader, unsigned char *data,
+        mfm_sector_t *sect), int marks_per_sector, int nsectors);
+void mfm_index_print(mfm_track_index_t *idx, long upto);
+void mfm_index_free(mfm_track_index_t *idx);
+mfm_track_index_t *mfm_index_parallel(mfm_io_t *in, int ntracks,
+    void (*index)(mfm_track_index_t *idx));
+void mfm_index_release(mfm_track_index_t *tab, int ntracks);
 
-void mfm_write_reset(mfm_writer_t *writer, FILE *fout);
+void mfm_write_reset(mfm_writer_t *writer, mfm_io_t *out);
 void mfm_write_halfbit(mfm_writer_t *writer, int val);
 void mfm_write_bit(mfm_writer_t *writer, int val);
+void mfm_write_word(mfm_writer_t *writer, unsigned val);
 void mfm_write(mfm_writer_t *writer, unsigned char *data, int bytes);
-void mfm_write_byte(mfm_writer_t *writer, int val);
 void mfm_write_gap(mfm_writer_t *writer, int nbytes, int val);
 void mfm_fill_track(mfm_writer_t *writer, int val);
+void mfm_write_patch(mfm_writer_t *writer, int halfbit,
+    const unsigned char *data, int nbytes);
+
+int mfm_cache_get(mfm_writer_t *writer, int halfbit, int sync,
+    const unsigned char *data, int nbytes);
+void mfm_cache_put(mfm_writer_t *writer, int halfbit, int sync,
+    const unsigned char *data, int nbytes);
+
+int mfm_std_sector_gap(const mfm_format_t *fmt, int nsectors);
+int mfm_density_of(const mfm_format_t *fmt, int nsectors);
+void mfm_write_marker(mfm_writer_t *writer, int nzeros, unsigned mark,
+    int nmarks);
+void mfm_read_format(const mfm_format_t *fmt, mfm_disk_t *d,
+    mfm_track_index_t *idx, mfm_io_t *in, int ntracks, FILE *fout);
+void mfm_analyze_format(const mfm_format_t *fmt, mfm_track_index_t *idx,
+    mfm_io_t *in, int ntracks);
+void mfm_write_format(const mfm_format_t *fmt, mfm_disk_t *d, FILE *fin,
+    mfm_io_t *out);
 
-void mfm_analyze_ibmpc(FILE *fin, int ntracks);
-void mfm_read_ibmpc(mfm_disk_t *d, FILE *fin, int ntracks);
-void mfm_write_ibmpc(mfm_disk_t *d, FILE *fout, int skip_index_mark);
+void mfm_index_ibmpc(mfm_track_index_t *idx);
+void mfm_analyze_ibmpc(mfm_track_index_t *idx, mfm_io_t *in, int ntracks);
+void mfm_read_ibmpc(mfm_disk_t *d, mfm_track_index_t *idx, mfm_io_t *in, int ntracks);
+void mfm_write_ibmpc(mfm_disk_t *d, mfm_io_t *out, int skip_index_mark);
+void mfm_read_ibmpc_stream(mfm_track_index_t *idx, mfm_io_t *in, FILE *fout);
+void mfm_write_ibmpc_stream(FILE *fin, mfm_io_t *out, int nsectors_per_track,
+    int skip_index_mark);
+int mfm_update_ibmpc(mfm_track_index_t *idx, mfm_io_t *io, int t, int s,
+    const unsigned char *data);
 
-int mfm_detect_amiga(FILE *fin);
-void mfm_analyze_amiga(FILE *fin, int ntracks);
-void mfm_read_amiga(mfm_disk_t *d, FILE *fin, int ntracks);
-void mfm_write_amiga(mfm_disk_t *d, FILE *fout);
+int mfm_detect_amiga(mfm_track_index_t *idx, mfm_io_t *in);
+int mfm_detect_amiga_track(mfm_track_index_t *idx);
+void mfm_detect_density(mfm_track_index_t *idx, mfm_io_t *in);
+void mfm_index_amiga(mfm_track_index_t *idx);
+void mfm_analyze_amiga(mfm_track_index_t *idx, mfm_io_t *in, int ntracks);
+void mfm_read_amiga(mfm_disk_t *d, mfm_track_index_t *idx, mfm_io_t *in, int ntracks);
+void mfm_write_amiga(mfm_disk_t *d, mfm_io_t *out);
+void mfm_read_amiga_stream(mfm_track_index_t *idx, mfm_io_t *in, FILE *fout);
+void mfm_write_amiga_stream(FILE *fin, mfm_io_t *out, int nsectors_per_track);
 
+void mfm_disk_init(mfm_disk_t *d, int ntracks, int nsectors_per_track,
+    int sector_size);
+void mfm_disk_free(mfm_disk_t *d);
 void mfm_read_raw(mfm_disk_t *d, FILE *fin, int nsectors_per_track);
+int mfm_read_raw_track(mfm_disk_t *d, FILE *fin);
 void mfm_write_raw(mfm_disk_t *d, FILE *fout);
@@ -0,0 +1,115 @@
+/*
+ * Library interface for conversions inside one process.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __MFMLIB_H__
+#define __MFMLIB_H__
+
+#include <stdio.h>
+#include <setjmp.h>
+#include "mfm.h"
+
+/*
+ * Формат дискеты для библиотечных функций.
+ */
+#define MFM_FORMAT_AUTO         0       /* detect by track 0 */
+#define MFM_FORMAT_IBMPC        1
+#define MFM_FORMAT_AMIGA        2
+#define MFM_FORMAT_BK           3       /* IBM PC without index mark */
+
+/*
+ * Типы файлов, по расширению имени.
+ */
+#define MFM_FILE_IMG            0       /* sector image, any other name */
+#define MFM_FILE_MFM            1
+#define MFM_FILE_SCP            2
+#define MFM_FILE_HFE            3       /* output only */
+
+/*
+ * Контекст преобразований: параметры, вывод диагностики
+ * и буферы, которые используются повторно от образа к образу.
+ */
+typedef struct {
+    /* Options, set by user after mfm_context_init(). */
+    FILE *err;                  /* diagnostics */
+    int verbose;
+    int jobs;                   /* parallel threads */
+    int gap_byte;
+    int index_gap;              /* 0 - default */
+    int sector_gap;             /* 0 - default */
+    int data_gap;               /* 0 - default */
+    int density;                /* 0 - auto, or MFM_DENSITY_xx */
+    int compact;                /* write compact MFM */
+    int retry;                  /* SCP: retry bad tracks with other PLL gains */
+    int stats;                  /* collect mfm_stats, see stats.c */
+    int reference;              /* slow bit-by-bit codecs, for checks */
+    int cache;                  /* encode repeated sectors by cache */
+    int sector_size;            /* IBM PC image: 128...1024, 0 - 512 */
+
+    /* Last decoded or encoded disk. */
+    mfm_disk_t disk;
+    mfm_track_index_t index;
+
+    /* MFM output, kept in memory. */
+    mfm_io_t out;
+
+    /* MFM file open for sector updates. */
+    mfm_io_t update;
+    int update_fd;
+
+    /* Input and output files of current call. */
+    mfm_io_t in;
+    mfm_io_t out_file;
+    int in_fd;
+    int out_fd;
+    FILE *raw_in;
+
+    /* Error recovery. */
+    jmp_buf fail;
+    int error;                  /* MFM_ERR_xxx */
+} mfm_context_t;
+
+void mfm_context_init(mfm_context_t *ctx);
+void mfm_context_free(mfm_context_t *ctx);
+
+int mfm_extract_buffer(mfm_context_t *ctx, const void *mfm, size_t size,
+    int format, const unsigned char **img, size_t *img_size);
+int mfm_extract_scp(mfm_context_t *ctx, const char *name, int rev,
+    int format, const unsigned char **img, size_t *img_size);
+int mfm_create_buffer(mfm_context_t *ctx, const void *img, size_t size,
+    int nsectors_per_track, int format,
+    const unsigned char **mfm, size_t *mfm_size);
+int mfm_file_type(const char *name);
+int mfm_convert_file(mfm_context_t *ctx, const char *input,
+    const char *output, int format, int rev);
+int mfm_update_open(mfm_context_t *ctx, const char *name);
+int mfm_update_sector(mfm_context_t *ctx, int track, int sector,
+    const void *data);
+int mfm_update_close(mfm_context_t *ctx);
+
+int mfm_batch(const char *manifest, int format, int rev);
+
+#endif /* __MFMLIB_H__ */
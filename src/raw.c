@@ -27,38 +27,121 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include "config.h"
 #include "mfm.h"
 
+/*
+ * Задание геометрии образа. Данные секторов обнуляются.
+ * Ранее выделенная память используется повторно, если её хватает.
+ */
+void mfm_disk_init(mfm_disk_t *d, int ntracks, int nsectors_per_track,
+    int sector_size)
+{
+    size_t nbytes = (size_t) ntracks * nsectors_per_track * sector_size;
+
+    if (nbytes > d->data_size || ! d->data) {
+        free(d->data);
+        d->data = malloc(nbytes ? nbytes : 1);
+        if (! d->data) {
+            fprintf(mfm_err, "Out of memory for %d tracks, aborted.\n",
+                ntracks);
+            d->data_size = 0;
+            mfm_fail(MFM_ERR_NOMEM);
+        }
+        d->data_size = nbytes;
+    }
+    memset(d->data, 0, nbytes);
+    d->ntracks = ntracks;
+    d->nsectors_per_track = nsectors_per_track;
+    d->sector_size = sector_size;
+}
+
+/*
+ * Освобождение памяти образа.
+ */
+void mfm_disk_free(mfm_disk_t *d)
+{
+    free(d->data);
+    d->data = 0;
+    d->data_size = 0;
+    d->ntracks = 0;
+}
+
 /*
  * Чтение образа дискеты из файла в традиционном бинарном виде.
+ * Размер сектора задаётся параметром mfm_sector_size.
  */
 void mfm_read_raw(mfm_disk_t *d, FILE *fin, int nsectors_per_track)
 {
-    int t, s;
+    int t, s, ntracks;
     struct stat st;
 
     if (fstat(fileno(fin), &st) < 0) {
         fprintf(mfm_err, "Cannot fstat() input file, aborted.\n");
-        exit(-1);
+        mfm_fail(MFM_ERR_IO);
     }
-    d->ntracks = st.st_size / SECTSZ / nsectors_per_track;
-    d->nsectors_per_track = nsectors_per_track;
-    if (d->ntracks > MAXTRACK) {
-        fprintf(mfm_err, "Too many tracks = %d, aborted.\n",
-            d->ntracks);
-        exit(-1);
+    if (! S_ISREG(st.st_mode)) {
+        /* Канал: размер заранее неизвестен, читаем до конца. */
+        mfm_disk_init(d, MAXTRACK, nsectors_per_track, mfm_sector_size);
+        for (t=0; t<MAXTRACK; ++t) {
+            if (fread(mfm_block(d, t, 0), (size_t) nsectors_per_track *
+                d->sector_size, 1, fin) != 1)
+                break;
+        }
+        if (t == MAXTRACK && getc(fin) != EOF) {
+            /* Как и для обычного файла. */
+            fprintf(mfm_err, "Too many tracks, aborted.\n");
+            mfm_fail(MFM_ERR_FORMAT);
+        }
+        if (ferror(fin)) {
+            fprintf(mfm_err, "Error reading input file, aborted.\n");
+            mfm_fail(MFM_ERR_IO);
+        }
+        d->ntracks = t;
+        mfm_count(bytes_read, (size_t) t * nsectors_per_track *
+            d->sector_size);
+        return;
+    }
+    ntracks = st.st_size / mfm_sector_size / nsectors_per_track;
+    if (ntracks > MAXTRACK) {
+        fprintf(mfm_err, "Too many tracks = %d, aborted.\n", ntracks);
+        mfm_fail(MFM_ERR_FORMAT);
     }
+    mfm_disk_init(d, ntracks, nsectors_per_track, mfm_sector_size);
     fseek(fin, 0L, SEEK_SET);
     for (t=0; t<d->ntracks; ++t) {
         for (s=0; s<d->nsectors_per_track; ++s) {
-            if (fread(d->block[t][s], SECTSZ, 1, fin) != 1) {
+            if (fread(mfm_block(d, t, s), d->sector_size, 1, fin) != 1) {
                 fprintf(mfm_err, "Error reading input file, aborted.\n");
-                exit(-1);
+                mfm_fail(MFM_ERR_IO);
             }
         }
     }
+    mfm_count(bytes_read, (size_t) d->ntracks * d->nsectors_per_track *
+        d->sector_size);
+}
+
+/*
+ * Чтение очередной дорожки образа из файла или канала,
+ * для потоковой обработки: образ d хранит одну дорожку.
+ * Возвращаем 0 в конце файла. Неполная последняя дорожка
+ * отбрасывается, как и в mfm_read_raw().
+ */
+int mfm_read_raw_track(mfm_disk_t *d, FILE *fin)
+{
+    size_t nbytes = (size_t) d->nsectors_per_track * d->sector_size;
+
+    if (fread(d->data, 1, nbytes, fin) == nbytes) {
+        mfm_count(bytes_read, nbytes);
+        return 1;
+    }
+    if (ferror(fin)) {
+        fprintf(mfm_err, "Error reading input file, aborted.\n");
+        mfm_fail(MFM_ERR_IO);
+    }
+    return 0;
 }
 
 /*
@@ -70,7 +153,9 @@ void mfm_write_raw(mfm_disk_t *d, FILE *fout)
 
     for (t=0; t<d->ntracks; ++t) {
         for (s=0; s<d->nsectors_per_track; ++s) {
-            fwrite(d->block[t][s], SECTSZ, 1, fout);
+            fwrite(mfm_block(d, t, s), d->sector_size, 1, fout);
         }
     }
+    mfm_count(bytes_written, (size_t) d->ntracks * d->nsectors_per_track *
+        d->sector_size);
 }
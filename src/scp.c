@@ -32,9 +32,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <err.h>
-#include "scp.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "mfm.h"
+#include "scp.h"
 
 #ifdef __APPLE__
 #   include <libkern/OSByteOrder.h>
@@ -44,123 +46,182 @@
 #   define le32toh(x) OSSwapLittleToHostInt32(x)
 #endif
 
-static void read_exact(int fd, void *buf, size_t count)
+/*
+ * Load the file contents: map it into memory when possible,
+ * otherwise read it as a whole.
+ */
+static int scp_load(scp_file_t *sf, const char *name)
 {
-    ssize_t done;
-    char *_buf = buf;
+    struct stat st;
+
+    if (fstat(sf->fd, &st) < 0) {
+        fprintf(mfm_err, "%s: %s\n", name, strerror(errno));
+        return MFM_ERR_IO;
+    }
 
-    while (count > 0) {
-        done = read(fd, _buf, count);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, sf->fd, 0);
+        if (p != MAP_FAILED) {
+            sf->map = p;
+            sf->mapsz = st.st_size;
+            sf->mapped = 1;
+            return MFM_OK;
+        }
+    }
+
+    /* Not a regular file: read until EOF. */
+    uint8_t *buf = 0;
+    size_t size = 0, len = 0;
+    for (;;) {
+        if (len == size) {
+            uint8_t *p = realloc(buf, size ? size * 2 : 1024*1024);
+            if (! p) {
+                fprintf(mfm_err, "%s: %s\n", name, strerror(errno));
+                free(buf);
+                return MFM_ERR_NOMEM;
+            }
+            buf = p;
+            size = size ? size * 2 : 1024*1024;
+        }
+        ssize_t done = read(sf->fd, buf + len, size - len);
         if (done < 0) {
             if ((errno == EAGAIN) || (errno == EINTR))
                 continue;
-            err(1, NULL);
-        }
-        if (done == 0) {
-            memset(_buf, 0, count);
-            done = count;
+            fprintf(mfm_err, "%s: %s\n", name, strerror(errno));
+            free(buf);
+            return MFM_ERR_IO;
         }
-        count -= done;
-        _buf += done;
+        if (done == 0)
+            break;
+        len += done;
+    }
+    sf->map = buf;
+    sf->mapsz = len;
+    return MFM_OK;
+}
+
+/*
+ * Check the track header at given file offset.
+ * Convert it to host byte order, and make revolution offsets
+ * from the start of the file.
+ */
+static int scp_check_track(scp_file_t *sf, unsigned int tn)
+{
+    scp_track_header_t *th = &sf->tdh[tn];
+    size_t tdh_offset = sf->header.track_offset[tn];
+    size_t hdrsz = 4 + 12 * sf->header.nr_revolutions;
+    unsigned int rev;
+
+    if (tdh_offset == 0 || tdh_offset + hdrsz > sf->mapsz)
+        return 0;
+
+    memcpy(th, sf->map + tdh_offset, hdrsz);
+    if (memcmp(th->sig, "TRK", 3) != 0)
+        return 0;
+
+    if (th->track_nr != tn)
+        return 0;
+
+    for (rev = 0; rev < sf->header.nr_revolutions; rev++) {
+        th->rev[rev].duration_25ns = le32toh(th->rev[rev].duration_25ns);
+        th->rev[rev].nr_samples = le32toh(th->rev[rev].nr_samples);
+        th->rev[rev].offset = tdh_offset + le32toh(th->rev[rev].offset);
+
+        if (th->rev[rev].nr_samples == 0 ||
+            th->rev[rev].offset < tdh_offset ||
+            th->rev[rev].offset + 2 * (size_t) th->rev[rev].nr_samples > sf->mapsz)
+            return 0;
     }
+    return 1;
 }
 
 /*
  * Open the SCP file.
- * Read disk header.
+ * Read disk header and validate all track headers.
+ * Return MFM_OK, or error code after printing a message.
  */
 int scp_open(scp_file_t *sf, const char *name)
 {
+    int error;
+
     memset(sf, 0, sizeof(*sf));
+    sf->density = MFM_DENSITY_DD;
+    sf->clock = 2000;
     sf->fd = open(name, O_RDONLY);
-    if (sf->fd < 0)
-        err(1, "%s", name);
+    if (sf->fd < 0) {
+        fprintf(mfm_err, "%s: %s\n", name, strerror(errno));
+        return MFM_ERR_IO;
+    }
 
-    read_exact(sf->fd, &sf->header, sizeof(sf->header));
+    int stage = mfm_stage(MFM_STAGE_IO);
+    error = scp_load(sf, name);
+    mfm_stage(stage);
+    if (error != MFM_OK) {
+        close(sf->fd);
+        return error;
+    }
 
-    if (memcmp(sf->header.sig, "SCP", 3) != 0)
-        errx(1, "%s: Not SCP file", name);
+    if (sf->mapsz < sizeof(sf->header) ||
+        memcmp(sf->map, "SCP", 3) != 0) {
+        fprintf(mfm_err, "%s: Not SCP file\n", name);
+        goto bad;
+    }
+    memcpy(&sf->header, sf->map, sizeof(sf->header));
 
-    if (sf->header.nr_revolutions == 0 || sf->header.nr_revolutions > REV_MAX)
-        errx(1, "%s: Invalid revolution count = %u", name, sf->header.nr_revolutions);
+    if (sf->header.nr_revolutions == 0 || sf->header.nr_revolutions > REV_MAX) {
+        fprintf(mfm_err, "%s: Invalid revolution count = %u\n",
+            name, sf->header.nr_revolutions);
+        goto bad;
+    }
 
-    if (sf->header.cell_width != 0 && sf->header.cell_width != 16)
-        errx(1, "%s: Unsupported cell width = %u", name, sf->header.cell_width);
+    if (sf->header.cell_width != 0 && sf->header.cell_width != 16) {
+        fprintf(mfm_err, "%s: Unsupported cell width = %u\n",
+            name, sf->header.cell_width);
+        goto bad;
+    }
 
     /* Convert to host byte order. */
     int i;
     for (i = 0; i < TRACK_MAX; i++) {
         sf->header.track_offset[i] = le32toh(sf->header.track_offset[i]);
+        sf->tdh_ok[i] = scp_check_track(sf, i);
     }
-
-    return 0;
+    return MFM_OK;
+bad:
+    scp_close(sf);
+    return MFM_ERR_FORMAT;
 }
 
 /*
  * Close the SCP file.
- * Free any allocated memory.
+ * Release the file contents.
  */
 void scp_close(scp_file_t *sf)
 {
+    if (sf->mapped)
+        munmap((void*) sf->map, sf->mapsz);
+    else
+        free((void*) sf->map);
+    sf->map = 0;
+    free(sf->flux);
+    sf->flux = 0;
     close(sf->fd);
-    if (sf->dat) {
-        free(sf->dat);
-        sf->dat = 0;
-    }
 }
 
 /*
  * Select a track by index.
- * Read track header.
+ * Flux data is used in place, directly from the file contents.
  */
 int scp_select_track(scp_file_t *sf, unsigned int tn)
 {
-    /* Track already loaded? */
-    if (sf->dat && (sf->track.track_nr == tn))
-        return 0;
-
-    /* Free data from previous track. */
-    free(sf->dat);
-    sf->dat = NULL;
-    sf->datsz = 0;
-
-    /* Read track header. */
-    unsigned tdh_offset = sf->header.track_offset[tn];
-    if (lseek(sf->fd, tdh_offset, SEEK_SET) != tdh_offset)
-        return -1;
-
-    read_exact(sf->fd, &sf->track, 4 + 12 * sf->header.nr_revolutions);
-    if (memcmp(sf->track.sig, "TRK", 3) != 0)
-        return -1;
-
-    if (sf->track.track_nr != tn)
-        return -1;
-
-    /* Convert to host byte order.
-     * Make offset from the start of the file.
-     * Compute total data size. */
     unsigned int rev;
-    for (rev = 0; rev < sf->header.nr_revolutions; rev++) {
-        sf->track.rev[rev].duration_25ns = le32toh(sf->track.rev[rev].duration_25ns);
-        sf->track.rev[rev].nr_samples = le32toh(sf->track.rev[rev].nr_samples);
-        sf->track.rev[rev].offset = tdh_offset + le32toh(sf->track.rev[rev].offset);
-        sf->datsz += sf->track.rev[rev].nr_samples;
-    }
 
-    /* Allocate data. */
-    sf->dat = calloc(sf->datsz, sizeof(sf->dat[0]));
-    if (! sf->dat)
-        err(1, NULL);
+    if (tn >= TRACK_MAX || ! sf->tdh_ok[tn])
+        return -1;
 
-    /* Read data. */
-    sf->datsz = 0;
+    sf->track = sf->tdh[tn];
     for (rev = 0; rev < sf->header.nr_revolutions; rev++) {
-        if (lseek(sf->fd, sf->track.rev[rev].offset, SEEK_SET) != sf->track.rev[rev].offset)
-            return -1;
-        read_exact(sf->fd, &sf->dat[sf->datsz],
-                   sf->track.rev[rev].nr_samples * sizeof(sf->dat[0]));
-        sf->datsz += sf->track.rev[rev].nr_samples;
-        sf->index_ptr[rev] = sf->datsz;
+        sf->dat[rev] = sf->map + sf->track.rev[rev].offset;
     }
     return 0;
 }
@@ -180,12 +241,13 @@ unsigned scp_next_flux(scp_file_t *sf, unsigned int rev)
 
     for (;;) {
         if (sf->iter_ptr >= sf->iter_limit) {
-            sf->iter_limit = sf->index_ptr[rev];
-            sf->iter_ptr = rev ? sf->index_ptr[rev-1] : 0;
+            sf->iter_limit = sf->track.rev[rev].nr_samples;
+            sf->iter_ptr = 0;
             val = 0;
         }
 
-        unsigned t = be16toh(sf->dat[sf->iter_ptr++]);
+        const uint8_t *p = sf->dat[rev] + 2 * sf->iter_ptr++;
+        unsigned t = p[0] << 8 | p[1];
         if (t != 0) {
             val += t;
             return val;
@@ -196,6 +258,141 @@ unsigned scp_next_flux(scp_file_t *sf, unsigned int rev)
     }
 }
 
+/*
+ * Convert raw flux samples into intervals in nanoseconds.
+ * Overflow entries are folded into the following sample;
+ * trailing overflows at the end of revolution are dropped.
+ * Return the number of intervals.
+ */
+unsigned scp_flux(const unsigned char *p, unsigned nsamples, unsigned *out)
+{
+    uint32_t val = 0;
+    unsigned int i, n = 0;
+
+    /* No branches in the loop: the output slot is always written,
+     * but advanced only by a non-zero sample. */
+    for (i = 0; i < nsamples; i++) {
+        uint32_t t = p[2*i] << 8 | p[2*i + 1];
+
+        val += t ? t : 0x10000;
+        out[n] = val * 25;
+        n += (t != 0);
+        val &= -(uint32_t) (t == 0);
+    }
+    return n;
+}
+
+/*
+ * Plain loop, to check the branchless one.
+ */
+unsigned scp_flux_ref(const unsigned char *p, unsigned nsamples, unsigned *out)
+{
+    uint32_t val = 0;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < nsamples; i++) {
+        uint32_t t = p[2*i] << 8 | p[2*i + 1];
+
+        if (t == 0) {
+            val += 0x10000;
+            continue;
+        }
+        val += t;
+        out[n++] = val * 25;
+        val = 0;
+    }
+    return n;
+}
+
+/*
+ * Convert flux samples of given revolution into intervals in nanoseconds.
+ * Return the number of intervals, and a pointer to them.
+ */
+unsigned scp_read_flux(scp_file_t *sf, unsigned int rev, const uint32_t **flux)
+{
+    unsigned int nsamples = sf->track.rev[rev].nr_samples;
+
+    if (nsamples > sf->fluxsz) {
+        free(sf->flux);
+        sf->flux = malloc(nsamples * sizeof(sf->flux[0]));
+        if (! sf->flux) {
+            fprintf(mfm_err, "Out of memory, aborted.\n");
+            sf->fluxsz = 0;
+            mfm_fail(MFM_ERR_NOMEM);
+        }
+        sf->fluxsz = nsamples;
+    }
+    *flux = sf->flux;
+    return mfm_codec->flux(sf->dat[rev], nsamples, sf->flux);
+}
+
+/*
+ * Shortest flux intervals of the track, in nsec: in MFM they are
+ * two halfbits long.  Take the 10th percentile, to skip noise.
+ */
+#define HIST_STEP       100     /* nsec per histogram bucket */
+#define HIST_SIZE       100
+
+static unsigned scp_short_flux(scp_file_t *sf, int tn)
+{
+    unsigned hist[HIST_SIZE], nflux, i, sum;
+    const uint32_t *flux;
+
+    if (tn < sf->header.start_track ||
+        tn > sf->header.end_track ||
+        scp_select_track(sf, tn) < 0)
+        return 0;
+    nflux = scp_read_flux(sf, 0, &flux);
+    if (nflux == 0)
+        return 0;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < nflux; i++) {
+        unsigned b = flux[i] / HIST_STEP;
+        hist[b < HIST_SIZE ? b : HIST_SIZE-1]++;
+    }
+    sum = 0;
+    for (i = 0; i < HIST_SIZE; i++) {
+        sum += hist[i];
+        if (sum >= nflux / 10)
+            break;
+    }
+    return i * HIST_STEP + HIST_STEP/2;
+}
+
+/*
+ * Find the density of the disk: given by user, by disk type in
+ * the header, or else estimated from the flux of the first recorded
+ * track.  A double density disk, read in a 360 RPM drive, has
+ * the halfbit shortened to 1667 nsec.
+ */
+void scp_set_density(scp_file_t *sf)
+{
+    unsigned shortest = 0;
+    int tn;
+
+    if (mfm_density)
+        sf->density = mfm_density;
+    else if (sf->header.disk_type == DISK_1440K)
+        sf->density = MFM_DENSITY_HD;
+    else if (sf->header.disk_type == DISK_720K)
+        sf->density = MFM_DENSITY_DD;
+    else {
+        for (tn = 0; tn < TRACK_MAX && ! shortest; tn++)
+            shortest = scp_short_flux(sf, tn);
+        if (shortest == 0 || shortest > 2800)
+            sf->density = MFM_DENSITY_DD;
+        else if (shortest > 1400)
+            sf->density = MFM_DENSITY_HD;
+        else
+            sf->density = MFM_DENSITY_ED;
+    }
+
+    sf->clock = 2000 / sf->density;
+    if (sf->density == MFM_DENSITY_DD && (sf->header.flags & FLAG_RPM))
+        sf->clock = 2000 * 300 / 360;
+}
+
 void scp_print_disk_header(scp_file_t *sf)
 {
     printf("Disk Header:\n");
@@ -271,35 +468,113 @@ void scp_print_track(scp_file_t *sf)
 /*
  * Flux-based streams
  */
-#define CLOCK_CENTRE    2000   /* 2000ns = 2us */
 #define CLOCK_MAX_ADJ   10     /* +/- 10% adjustment */
 #define CLOCK_MIN(_c)   (((_c) * (100 - CLOCK_MAX_ADJ)) / 100)
 #define CLOCK_MAX(_c)   (((_c) * (100 + CLOCK_MAX_ADJ)) / 100)
 
 /*
  * Amount to adjust phase/period of our clock based on each observed flux.
+ * The first pair is used normally, the others by retries of tracks
+ * with bad sectors: a slower loop for noisy flux, a faster one for
+ * unsteady rotation.
  */
 #define PERIOD_ADJ_PCT  5
 #define PHASE_ADJ_PCT   60
 
+static const struct {
+    int period;
+    int phase;
+} pll_gain[] = {
+    { PERIOD_ADJ_PCT, PHASE_ADJ_PCT },
+    { 2,  30 },
+    { 10, 85 },
+};
+
+#define NGAINS  (int) (sizeof(pll_gain) / sizeof(pll_gain[0]))
+
 typedef struct {
-    scp_file_t *sf;
-    int rev;
+    const uint32_t *dat;    /* flux intervals, nsec */
+    unsigned int nflux;     /* number of intervals */
+    unsigned int ptr;       /* next interval */
     int clock;          /* nsec */
+    int centre;         /* nominal clock, nsec */
+    int clock_min;      /* adjustment range */
+    int clock_max;
+    int period_adj;     /* gains, percent */
+    int phase_adj;
     int flux;           /* nsec */
-    int time;           /* nsec */
+    long long time;     /* nsec */
     int clocked_zeros;
 } pll_t;
 
 /*
- * Initialize PLL.
+ * Estimate the real halfbit of the revolution, near the nominal one.
+ * MFM intervals are 2, 3 or 4 halfbits: make a histogram of the flux,
+ * assign every bucket to the nearest multiple of the clock, and take
+ * total time over total halfbits.  Repeat with the new clock, as
+ * buckets may move to another multiple.  Return 0 when there is
+ * too little data.
+ */
+#define EST_BUCKETS     64      /* histogram buckets per halfbit */
+#define EST_SIZE        (5 * EST_BUCKETS)
+#define EST_PASSES      3
+
+static int pll_estimate(const uint32_t *flux, unsigned nflux, int nominal)
+{
+    unsigned hist[EST_SIZE], i, b;
+    unsigned long long time, nhalf;
+    int pass, clock = nominal, k;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < nflux; i++) {
+        b = (unsigned long long) flux[i] * EST_BUCKETS / nominal;
+        if (b < EST_SIZE)
+            hist[b]++;
+    }
+
+    for (pass = 0; pass < EST_PASSES; pass++) {
+        time = nhalf = 0;
+        for (b = EST_BUCKETS; b < EST_SIZE; b++) {
+            int centre = (2*b + 1) * nominal / (2 * EST_BUCKETS);
+
+            k = (centre + clock/2) / clock;
+            if (k < 2 || k > 4 || hist[b] == 0)
+                continue;
+            time += (unsigned long long) hist[b] * centre;
+            nhalf += (unsigned long long) hist[b] * k;
+        }
+        if (nhalf < 1000)
+            return 0;
+        clock = time / nhalf;
+    }
+
+    /* Far from nominal: rather a wrong guess than drift. */
+    if (clock < nominal * 80 / 100 || clock > nominal * 120 / 100)
+        return 0;
+    return clock;
+}
+
+/*
+ * Initialize PLL, centred on the clock estimated by the flux
+ * of the revolution, with the given gains.
+ * Return the number of flux intervals in the revolution.
  */
-static void pll_init(pll_t *pll, scp_file_t *sf, int rev)
+static int pll_init(pll_t *pll, scp_file_t *sf, int rev, int gain)
 {
+    int clock;
+
     memset(pll, 0, sizeof(*pll));
-    pll->sf = sf;
-    pll->rev = rev;
-    pll->clock = CLOCK_CENTRE;
+    pll->nflux = scp_read_flux(sf, rev, &pll->dat);
+    clock = pll_estimate(pll->dat, pll->nflux, sf->clock);
+    if (clock == 0)
+        clock = sf->clock;
+    pll->centre = clock;
+    pll->clock = clock;
+    pll->clock_min = CLOCK_MIN(clock);
+    pll->clock_max = CLOCK_MAX(clock);
+    pll->period_adj = pll_gain[gain].period;
+    pll->phase_adj = pll_gain[gain].phase;
+    return pll->nflux;
 }
 
 /*
@@ -310,7 +585,9 @@ static void pll_init(pll_t *pll, scp_file_t *sf, int rev)
 static int pll_next_bit(pll_t *pll)
 {
     while (pll->flux < pll->clock/2) {
-        pll->flux += 25 * scp_next_flux(pll->sf, pll->rev);
+        if (pll->ptr >= pll->nflux)
+            pll->ptr = 0;
+        pll->flux += pll->dat[pll->ptr++];
     }
 
     pll->time += pll->clock;
@@ -326,21 +603,21 @@ static int pll_next_bit(pll_t *pll)
     if (pll->clocked_zeros <= 3) {
 
         /* In sync: adjust base clock by a fraction of phase mismatch. */
-        pll->clock += pll->flux * PERIOD_ADJ_PCT / 100;
+        pll->clock += pll->flux * pll->period_adj / 100;
     } else {
         /* Out of sync: adjust base clock towards centre. */
-        pll->clock += (CLOCK_CENTRE - pll->clock) * PERIOD_ADJ_PCT / 100;
+        pll->clock += (pll->centre - pll->clock) * pll->period_adj / 100;
     }
 
     /* Clamp the clock's adjustment range. */
-    if (pll->clock < CLOCK_MIN(CLOCK_CENTRE))
-        pll->clock = CLOCK_MIN(CLOCK_CENTRE);
-    if (pll->clock > CLOCK_MAX(CLOCK_CENTRE))
-        pll->clock = CLOCK_MAX(CLOCK_CENTRE);
+    if (pll->clock < pll->clock_min)
+        pll->clock = pll->clock_min;
+    if (pll->clock > pll->clock_max)
+        pll->clock = pll->clock_max;
 
     /* PLL: Adjust clock phase according to mismatch.
      * eg. PHASE_ADJ_PCT=100% -> timing window snaps to observed flux. */
-    int new_flux = pll->flux * (100 - PHASE_ADJ_PCT) / 100;
+    int new_flux = pll->flux * (100 - pll->phase_adj) / 100;
     pll->time += pll->flux - new_flux;
     pll->flux = new_flux;
 
@@ -349,54 +626,712 @@ static int pll_next_bit(pll_t *pll)
 }
 
 /*
- * Decode MFM data from SCP file, for given revolution.
+ * Flux of the revolution not consumed yet: intervals not read,
+ * or at least half a cell left of the last one.  The loops stop
+ * here rather than at the last read, so that the zeros which end
+ * the revolution are decoded too, and the pointer never wraps.
  */
-void scp_write_mfm(const char *name, FILE *fout, int rev)
+static inline int pll_more(const pll_t *pll)
 {
-    /* Open the image file. */
+    return pll->ptr < pll->nflux || pll->flux >= pll->clock/2;
+}
+
+/*
+ * Run PLL over one revolution, as the decoder does, for benchmarks.
+ * Return the number of one halfbits.
+ */
+unsigned scp_pll_bits(scp_file_t *sf, int rev)
+{
+    pll_t pll;
+    unsigned ones = 0;
+
+    if (pll_init(&pll, sf, rev, 0) == 0)
+        return 0;
+    pll_next_bit(&pll);
+    do {
+        ones += pll_next_bit(&pll);
+    } while (pll_more(&pll));
+    return ones;
+}
+
+/*
+ * Decode MFM data of one track, for given revolution and PLL gains.
+ * The track is complete when the writer has got all its halfbits.
+ */
+static void scp_decode_mfm(scp_file_t *sf, int tn, int rev, int gain,
+    mfm_writer_t *writer)
+{
+    int n, stage = mfm_stage(MFM_STAGE_PLL);
+
+    pll_t pll;
+
+    if (tn < sf->header.start_track ||
+        tn > sf->header.end_track ||
+        scp_select_track(sf, tn) < 0 ||
+        pll_init(&pll, sf, rev, gain) == 0)
+    {
+        /* Produce empty track. */
+        for (n=0; n<writer->nhalfbits/16; n++)
+            mfm_write_byte(writer, 0);
+    } else {
+        mfm_count(tracks_read, 1);
+        mfm_count(bytes_read, 2 * sf->track.rev[rev].nr_samples);
+
+        /* Decode flux data of this revolution. */
+        pll_next_bit(&pll); /* Ignore first half-bit. */
+        n = 0;
+        do {
+            int halfbit = pll_next_bit(&pll);
+            mfm_write_halfbit(writer, halfbit);
+            n++;
+        } while (pll_more(&pll));
+
+        /* Fill the rest of track. */
+        while (n++ < writer->nhalfbits) {
+            mfm_write_halfbit(writer, !writer->last);
+            if (n++ < writer->nhalfbits)
+                mfm_write_halfbit(writer, !writer->last);
+        }
+    }
+    mfm_stage(stage);
+}
+
+/*
+ * Start new track, of the length given by density of the disk.
+ */
+static void scp_write_reset(const scp_file_t *sf, mfm_writer_t *writer,
+    mfm_io_t *out)
+{
+    mfm_write_reset(writer, out);
+    writer->nhalfbits = sf->density * TRACKSZ * 8;
+}
+
+/*
+ * Parallel conversion: every worker has its own copy of SCP file cursor
+ * over the shared file contents, and puts the decoded tracks into
+ * a common output image.
+ */
+typedef struct {
+    const scp_file_t *sf;
+    int rev;
+    int ntracks;
+    size_t tracksz;
+    unsigned char *image;       /* ntracks x tracksz bytes */
+    pthread_mutex_t lock;
+    int next;                   /* next track to decode */
+    int error;                  /* first error in workers */
+    mfm_options_t opt;          /* options of calling thread */
+} scp_job_t;
+
+/*
+ * Worker state: the job and a private file cursor.
+ */
+typedef struct {
+    scp_job_t *job;
     scp_file_t sf;
-    scp_open(&sf, name);
+} scp_worker_t;
 
+static void scp_decode_tracks(void *arg)
+{
+    scp_worker_t *w = arg;
+    scp_job_t *job = w->job;
     mfm_writer_t writer;
+    int tn;
 
-    if (rev >= sf.header.nr_revolutions)
-        errx(1, "Revolution %d out of range 0...%d\n", rev, sf.header.nr_revolutions-1);
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        tn = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (tn >= job->ntracks)
+            return;
 
+        scp_write_reset(&w->sf, &writer, 0);
+        scp_decode_mfm(&w->sf, tn, job->rev, 0, &writer);
+        memcpy(job->image + tn * job->tracksz, writer.buf, job->tracksz);
+    }
+}
+
+/*
+ * Errors are caught here and passed to the calling thread,
+ * which fails after all workers are joined.
+ */
+static void *scp_worker(void *arg)
+{
+    scp_worker_t w;
+    int error;
+
+    w.job = arg;
+    mfm_options_load(&w.job->opt);
+    w.sf = *w.job->sf;
+    w.sf.flux = 0;
+    w.sf.fluxsz = 0;
+    error = mfm_catch(scp_decode_tracks, &w);
+    free(w.sf.flux);
+    if (error != MFM_OK) {
+        pthread_mutex_lock(&w.job->lock);
+        if (w.job->error == MFM_OK)
+            w.job->error = error;
+        w.job->next = w.job->ntracks;
+        pthread_mutex_unlock(&w.job->lock);
+    }
+    return 0;
+}
+
+/*
+ * Decode all tracks in mfm_jobs threads, then write them in order.
+ */
+static void scp_write_mfm_parallel(const scp_file_t *sf, mfm_io_t *out, int rev,
+    unsigned char **image)
+{
+    scp_job_t job;
+    pthread_t *thread;
+    int nthreads, i;
+
+    job.sf = sf;
+    job.rev = rev;
+    job.ntracks = 160;
+    job.next = 0;
+    job.error = MFM_OK;
+    job.tracksz = sf->density * (size_t) TRACKSZ;
+    job.image = malloc(job.ntracks * job.tracksz);
+    *image = job.image;
+    nthreads = (mfm_jobs < job.ntracks) ? mfm_jobs : job.ntracks;
+    thread = calloc(nthreads, sizeof(thread[0]));
+    if (! job.image || ! thread) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        free(thread);
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+    mfm_options_save(&job.opt);
+    pthread_mutex_init(&job.lock, 0);
+
+    for (i=0; i<nthreads; ++i) {
+        if (pthread_create(&thread[i], 0, scp_worker, &job) != 0) {
+            nthreads = i;
+            break;
+        }
+    }
+    if (nthreads == 0)
+        scp_worker(&job);
+    for (i=0; i<nthreads; ++i)
+        pthread_join(thread[i], 0);
+
+    pthread_mutex_destroy(&job.lock);
+    free(thread);
+    if (job.error != MFM_OK)
+        mfm_fail(job.error);
+    mfm_io_write(out, job.image, job.ntracks * job.tracksz);
+    mfm_count(tracks_written, job.ntracks);
+}
+
+typedef struct {
+    scp_file_t *sf;
+    mfm_io_t *out;
+    int rev;
+    unsigned char *image;               /* tracks decoded in parallel */
+} scp_write_t;
+
+static void scp_write_tracks(void *arg)
+{
+    scp_write_t *w = arg;
+    mfm_writer_t writer;
     int tn;
-    for (tn = 0; tn < 160; tn++) {
-        int n;
 
+    if (mfm_jobs > 1) {
+        scp_write_mfm_parallel(w->sf, w->out, w->rev, &w->image);
+        return;
+    }
+    for (tn = 0; tn < 160; tn++) {
         /* Start new track. */
-        mfm_write_reset(&writer, fout);
-
-        if (tn < sf.header.start_track ||
-            tn >= sf.header.end_track ||
-            scp_select_track(&sf, tn) < 0)
-        {
-            /* Produce empty track. */
-            for (n=0; n<6400; n++)
-                mfm_write_byte(&writer, 0);
-        } else {
-            /* Decode flux data of this revolution. */
-            pll_t pll;
-
-            scp_reset(&sf);
-            pll_init(&pll, &sf, rev);
-            pll_next_bit(&pll); /* Ignore first half-bit. */
-            n = 0;
-            do {
-                int halfbit = pll_next_bit(&pll);
-                mfm_write_halfbit(&writer, halfbit);
-                n++;
-            } while (sf.iter_ptr < sf.iter_limit);
-
-            /* Fill the rest of track. */
-            while (n++ < 12800*8) {
-                mfm_write_halfbit(&writer, !writer.last);
-                if (n++ < 12800*8)
-                    mfm_write_halfbit(&writer, !writer.last);
+        scp_write_reset(w->sf, &writer, w->out);
+        scp_decode_mfm(w->sf, tn, w->rev, 0, &writer);
+    }
+}
+
+/*
+ * Decode MFM data from SCP file, for given revolution.
+ */
+void scp_write_mfm(const char *name, mfm_io_t *out, int rev)
+{
+    scp_file_t sf;
+    scp_write_t w;
+    int error;
+
+    /* Open the image file. */
+    error = scp_open(&sf, name);
+    if (error != MFM_OK)
+        mfm_fail(error);
+
+    if (rev >= sf.header.nr_revolutions) {
+        fprintf(mfm_err, "Revolution %d out of range 0...%d\n",
+            rev, sf.header.nr_revolutions-1);
+        scp_close(&sf);
+        mfm_fail(MFM_ERR_ARG);
+    }
+    scp_set_density(&sf);
+    mfm_io_density(out, sf.density);
+
+    /* The file is closed on errors too, then the error goes on. */
+    w.sf = &sf;
+    w.out = out;
+    w.rev = rev;
+    w.image = 0;
+    error = mfm_catch(scp_write_tracks, &w);
+    free(w.image);
+    scp_close(&sf);
+    if (error != MFM_OK)
+        mfm_fail(error);
+    mfm_io_flush(out);
+}
+
+/*
+ * Flux diagnostics
+ */
+
+/*
+ * VCD output: time in nanoseconds, from the index of the first
+ * dumped revolution.  Records go straight to the file as the PLL
+ * runs; a timestamp is printed only when the time moves on.
+ */
+typedef struct {
+    FILE *f;
+    unsigned long long now;     /* time of last record */
+    unsigned long long base;    /* index of current revolution */
+    int flux;                   /* signal levels */
+    int cell;
+    int bit;
+    int clock;
+} vcd_t;
+
+static void vcd_time(vcd_t *v, unsigned long long t)
+{
+    if (t > v->now) {
+        v->now = t;
+        fprintf(v->f, "#%llu\n", t);
+    }
+}
+
+static void vcd_flux(vcd_t *v, unsigned long long t)
+{
+    vcd_time(v, t);
+    v->flux ^= 1;
+    fprintf(v->f, "%df\n", v->flux);
+}
+
+static void vcd_clock(vcd_t *v, int clock)
+{
+    char buf[40], *p = buf + sizeof(buf);
+
+    *--p = 0;
+    do {
+        *--p = '0' + (clock & 1);
+        clock >>= 1;
+    } while (clock > 0);
+    fprintf(v->f, "b%s k\n", p);
+}
+
+/*
+ * Statistics of one revolution, as seen by the PLL.
+ */
+typedef struct {
+    unsigned halfbits;
+    unsigned run[6];            /* intervals of 1...5 halfbits, longer */
+    int clock_min;
+    int clock_max;
+    unsigned long long clock_sum;
+} diag_t;
+
+/*
+ * Run the PLL over one revolution, with the normal gains.
+ * Collect statistics, and write the waveform when v is not 0:
+ * the flux level toggles at every transition, the cell signal
+ * toggles at every halfbit window, data is the decoded halfbit,
+ * and clock is the halfbit of the PLL in nanoseconds.
+ * Return the number of flux intervals.
+ */
+static unsigned scp_diag_revolution(scp_file_t *sf, int rev, diag_t *d,
+    vcd_t *v)
+{
+    unsigned long long ftime = 0, t;
+    unsigned fptr = 0;
+    int bit, zeros = 0;
+    pll_t pll;
+
+    memset(d, 0, sizeof(*d));
+    if (pll_init(&pll, sf, rev, 0) == 0)
+        return 0;
+    d->clock_min = pll.clock;
+    d->clock_max = pll.clock;
+
+    if (v) {
+        ftime = v->base;
+        vcd_time(v, v->base);
+        fprintf(v->f, "1i\n");
+    }
+    pll_next_bit(&pll); /* Ignore first half-bit, as the decoder does. */
+    do {
+        bit = pll_next_bit(&pll);
+        d->halfbits++;
+        d->clock_sum += pll.clock;
+        if (pll.clock < d->clock_min)
+            d->clock_min = pll.clock;
+        if (pll.clock > d->clock_max)
+            d->clock_max = pll.clock;
+        if (bit) {
+            d->run[zeros < 5 ? zeros : 5]++;
+            zeros = 0;
+        } else
+            zeros++;
+        if (! v)
+            continue;
+
+        /* Transitions the PLL has passed by, then the cell. */
+        t = v->base + pll.time;
+        while (fptr < pll.ptr && ftime + pll.dat[fptr] <= t) {
+            ftime += pll.dat[fptr++];
+            vcd_flux(v, ftime);
+        }
+        vcd_time(v, t);
+        if (d->halfbits == 1)
+            fprintf(v->f, "0i\n");
+        v->cell ^= 1;
+        fprintf(v->f, "%dc\n", v->cell);
+        if (bit != v->bit) {
+            v->bit = bit;
+            fprintf(v->f, "%db\n", bit);
+        }
+        if (pll.clock != v->clock) {
+            v->clock = pll.clock;
+            vcd_clock(v, pll.clock);
+        }
+    } while (pll_more(&pll));
+
+    if (v) {
+        while (fptr < pll.nflux) {
+            ftime += pll.dat[fptr++];
+            vcd_flux(v, ftime);
+        }
+        v->base = ftime;
+    }
+    return pll.nflux;
+}
+
+/*
+ * Start the VCD file: signals of the track.
+ */
+static void vcd_open(vcd_t *v, const char *name, int tn)
+{
+    memset(v, 0, sizeof(*v));
+    v->f = fopen(name, "w");
+    if (! v->f) {
+        fprintf(mfm_err, "%s: %s\n", name, strerror(errno));
+        mfm_fail(MFM_ERR_IO);
+    }
+    setvbuf(v->f, 0, _IOFBF, 1024*1024);
+    fprintf(v->f, "$version mfmdisk $end\n");
+    fprintf(v->f, "$timescale 1ns $end\n");
+    fprintf(v->f, "$scope module track%d $end\n", tn);
+    fprintf(v->f, "$var wire 1 i index $end\n");
+    fprintf(v->f, "$var wire 1 f flux $end\n");
+    fprintf(v->f, "$var wire 1 c cell $end\n");
+    fprintf(v->f, "$var wire 1 b data $end\n");
+    fprintf(v->f, "$var integer 32 k clock $end\n");
+    fprintf(v->f, "$upscope $end\n");
+    fprintf(v->f, "$enddefinitions $end\n");
+    fprintf(v->f, "#0\n$dumpvars\n0i\n0f\n0c\n0b\nb0 k\n$end\n");
+}
+
+static void vcd_close(vcd_t *v, const char *name)
+{
+    if (fclose(v->f) != 0) {
+        fprintf(mfm_err, "%s: %s\n", name, strerror(errno));
+        mfm_fail(MFM_ERR_IO);
+    }
+}
+
+/*
+ * Write VCD waveform of all revolutions of the selected track,
+ * one after another, for viewing in GTKWave or alike.
+ */
+void scp_generate_vcd(scp_file_t *sf, const char *name)
+{
+    diag_t d;
+    vcd_t v;
+    int rev;
+
+    vcd_open(&v, name, sf->track.track_nr);
+    for (rev = 0; rev < sf->header.nr_revolutions; rev++)
+        scp_diag_revolution(sf, rev, &d, &v);
+    vcd_close(&v, name);
+}
+
+/*
+ * Print histogram of flux intervals, by HIST_STEP buckets.
+ * Empty buckets are skipped, the longest bar is 50 marks.
+ */
+static void scp_print_histogram(const uint32_t *flux, unsigned nflux)
+{
+    unsigned hist[HIST_SIZE], i, max = 0;
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < nflux; i++) {
+        unsigned b = flux[i] / HIST_STEP;
+        hist[b < HIST_SIZE ? b : HIST_SIZE-1]++;
+    }
+    for (i = 0; i < HIST_SIZE; i++)
+        if (hist[i] > max)
+            max = hist[i];
+    for (i = 0; i < HIST_SIZE; i++) {
+        if (hist[i] == 0)
+            continue;
+        printf("    %s%5.1f usec %7u ", (i == HIST_SIZE-1) ? ">" : " ",
+            i * HIST_STEP / 1000.0, hist[i]);
+        unsigned n = (hist[i] * 50 + max - 1) / max;
+        while (n-- > 0)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+/*
+ * Diagnostics of track tn: for the given revolution, or for all
+ * when rev is negative, print the histogram of flux intervals and
+ * what the PLL makes of them.  MFM has intervals of 2, 3 and 4
+ * halfbits only, anything else is noise or a weak spot.  When name
+ * is not 0, write the waveform of these revolutions to VCD file.
+ */
+void scp_decode_track(scp_file_t *sf, const char *name, int tn, int rev)
+{
+    int first_rev = (rev < 0) ? 0 : rev;
+    int last_rev = (rev < 0) ? sf->header.nr_revolutions-1 : rev;
+    const uint32_t *flux;
+    unsigned nflux, bad;
+    vcd_t v, *vp = 0;
+    diag_t d;
+
+    if (tn < sf->header.start_track ||
+        tn > sf->header.end_track ||
+        scp_select_track(sf, tn) < 0) {
+        printf("Track %d: no data\n", tn);
+        return;
+    }
+    if (name) {
+        vcd_open(&v, name, tn);
+        vp = &v;
+    }
+
+    for (rev = first_rev; rev <= last_rev; rev++) {
+        nflux = scp_read_flux(sf, rev, &flux);
+        printf("Track %d, revolution %d: %u intervals, %.3f msec\n",
+            tn, rev, nflux, sf->track.rev[rev].duration_25ns * 0.000025);
+        if (nflux == 0)
+            continue;
+        scp_print_histogram(flux, nflux);
+
+        scp_diag_revolution(sf, rev, &d, vp);
+        bad = d.run[0] + d.run[4] + d.run[5];
+        printf("    PLL: %u halfbits, clock %d...%d nsec, average %llu nsec\n",
+            d.halfbits, d.clock_min, d.clock_max,
+            d.halfbits ? d.clock_sum / d.halfbits : 0);
+        printf("    Intervals: %u x2, %u x3, %u x4, %u bad (%u x1, %u x5, %u longer)\n",
+            d.run[1], d.run[2], d.run[3], bad, d.run[0], d.run[4], d.run[5]);
+    }
+    if (vp)
+        vcd_close(vp, name);
+}
+
+/*
+ * Print a message about the sector, in the same form
+ * as mfm_read_ibmpc() or mfm_read_amiga() does.
+ */
+static void scp_print_sector(int tn, int s, int amiga, const char *msg, int num)
+{
+    if (amiga)
+        fprintf(mfm_err, "track %d: sector %d", tn, s);
+    else
+        fprintf(mfm_err, "Track %d/%d: sector %d", tn >> 1, tn & 1, s);
+    if (num >= 0)
+        fprintf(mfm_err, " from %s %d\n", msg, num);
+    else
+        fprintf(mfm_err, ": %s\n", msg);
+}
+
+/*
+ * Decode sectors of SCP file directly, without intermediate MFM file.
+ * Use given revolution, or when rev is negative, decode all revolutions
+ * and for every sector take a copy with correct checksum.
+ * With mfm_retry, tracks with bad sectors are decoded again with
+ * other PLL gains, and only the missing sectors are taken from there.
+ * Fill the disk with sector data.
+ * When amiga is negative, detect the format by the first decoded
+ * revolution of track 0.  Return 1 for Amiga format, 0 for IBM PC.
+ */
+typedef struct {
+    scp_file_t *sf;
+    mfm_disk_t *d;
+    mfm_track_index_t *idx;
+    int rev;
+    int amiga;
+} scp_read_t;
+
+static void scp_read_tracks(void *arg)
+{
+    scp_read_t *r = arg;
+    scp_file_t *sf = r->sf;
+    mfm_disk_t *d = r->d;
+    mfm_track_index_t *idx = r->idx;
+    int rev = r->rev, amiga = r->amiga;
+    mfm_writer_t writer;
+    int tn, s, i, ngood, nbad, nsectors, sector_size, kind;
+    int first_rev, last_rev;
+    int gain, ngains, pass, npasses;
+    int have_sector [MAXINDEX];         /* 0 - none, 1 - bad copy, 2 - good */
+    int from_rev [MAXINDEX];
+    int from_gain [MAXINDEX];
+    unsigned char data [MAXINDEX] [MAXSECTSZ];
+
+    first_rev = (rev < 0) ? 0 : rev;
+    last_rev = (rev < 0) ? sf->header.nr_revolutions - 1 : rev;
+    ngains = mfm_retry ? NGAINS : 1;
+
+    /* The geometry is known after track 0: the sector size
+     * is taken from the first sector found there. */
+    nsectors = 0;
+    sector_size = 0;
+    for (tn = 0; tn < 160; tn++) {
+        for (s=0; s<MAXINDEX; ++s)
+            have_sector [s] = 0;
+        ngood = 0;
+        nbad = 0;
+
+        /* All revolutions with normal gains, then with the others. */
+        npasses = ngains * (last_rev - first_rev + 1);
+        for (pass = 0; pass < npasses; pass++) {
+            rev = first_rev + pass % (last_rev - first_rev + 1);
+            gain = pass / (last_rev - first_rev + 1);
+            if (tn < sf->header.start_track ||
+                tn > sf->header.end_track ||
+                scp_select_track(sf, tn) < 0)
+                break;
+            if (pass > 0 && (tn > 0 || nbad > 0))
+                mfm_count(retries, 1);
+
+            scp_write_reset(sf, &writer, 0);
+            scp_decode_mfm(sf, tn, rev, gain, &writer);
+            mfm_index_load(idx, writer.buf, writer.nhalfbits >> 3, tn);
+
+            /* Format is taken from the first revolution
+             * with any marks, IBM PC is used until then. */
+            if (amiga < 0) {
+                kind = mfm_detect_amiga_track(idx);
+                if (kind >= 0)
+                    amiga = kind;
             }
+            if (amiga > 0)
+                mfm_index_amiga(idx);
+            else
+                mfm_index_ibmpc(idx);
+
+            for (i=0; i<idx->nsectors; ++i) {
+                s = idx->sect[i].sector;
+                if (s < 0 || s >= MAXINDEX || have_sector [s] == 2)
+                    continue;
+                if (sector_size == 0)
+                    sector_size = idx->sect[i].nbytes;
+                if (idx->sect[i].nbytes != sector_size)
+                    continue;
+                if (idx->sect[i].data_ok) {
+                    nbad -= (have_sector [s] == 1);
+                    have_sector [s] = 2;
+                    ngood++;
+                } else if (have_sector [s] == 0) {
+                    have_sector [s] = 1;
+                    nbad++;
+                } else
+                    continue;
+                from_rev [s] = rev;
+                from_gain [s] = gain;
+                memcpy(data[s], idx->data[i], sector_size);
+            }
+
+            /* All sectors are good: no need for other revolutions.
+             * Track 0 sets the geometry, so it takes all passes:
+             * a sector missed by one revolution must not be lost
+             * for the whole disk. */
+            if (tn > 0 && ngood >= nsectors)
+                break;
+        }
+
+        if (tn == 0) {
+            /* Track 0 is missing or has no marks: assume IBM PC,
+             * the geometry is fixed from here on. */
+            if (amiga < 0)
+                amiga = 0;
+
+            /* Recognize the number of sectors by track 0:
+             * 22 on Amiga high density disk. The standard count
+             * is known for 512-byte sectors only. */
+            if (sector_size == 0)
+                sector_size = SECTSZ;
+            nsectors = (sector_size != SECTSZ) ? 1 : amiga ? 11 : 9;
+            for (s=nsectors; s<MAXINDEX; ++s)
+                if (have_sector [s])
+                    nsectors = s + 1;
+            mfm_disk_init(d, 160, nsectors, sector_size);
+        }
+
+        /* Report sectors, which have no good copy. */
+        for (s=0; s<nsectors; ++s) {
+            if (have_sector [s])
+                memcpy(mfm_block(d, tn, s), data[s], sector_size);
+            if (have_sector [s] == 2) {
+                if (mfm_verbose && from_gain [s] > 0)
+                    scp_print_sector(tn, s, amiga, "retry", from_gain [s]);
+                else if (mfm_verbose && from_rev [s] > first_rev)
+                    scp_print_sector(tn, s, amiga, "revolution", from_rev [s]);
+                continue;
+            }
+            if (tn < sf->header.start_track || tn > sf->header.end_track)
+                continue;
+            if (! have_sector [s])
+                mfm_count(missing, 1);
+            scp_print_sector(tn, s, amiga,
+                ! have_sector [s] ? "not found" :
+                first_rev < last_rev ? "bad checksum in all revolutions" :
+                "bad checksum", -1);
         }
     }
+    r->amiga = amiga;
+}
+
+int scp_read_disk(mfm_disk_t *d, mfm_track_index_t *idx, const char *name,
+    int rev, int amiga)
+{
+    scp_file_t sf;
+    scp_read_t r;
+    int error;
+
+    error = scp_open(&sf, name);
+    if (error != MFM_OK)
+        mfm_fail(error);
+
+    if (rev >= sf.header.nr_revolutions) {
+        fprintf(mfm_err, "Revolution %d out of range 0...%d\n",
+            rev, sf.header.nr_revolutions-1);
+        scp_close(&sf);
+        mfm_fail(MFM_ERR_ARG);
+    }
+    scp_set_density(&sf);
+
+    /* The file is closed on errors too, then the error goes on. */
+    r.sf = &sf;
+    r.d = d;
+    r.idx = idx;
+    r.rev = rev;
+    r.amiga = amiga;
+    error = mfm_catch(scp_read_tracks, &r);
     scp_close(&sf);
+    if (error != MFM_OK)
+        mfm_fail(error);
+    return r.amiga;
 }
@@ -49,6 +49,11 @@ typedef struct {
     // in the defines).
     uint8_t disk_type;
 
+#define DISK_AMIGA  1       // Amiga
+#define DISK_720K   6       // IBM PC 360K/720K
+#define DISK_1440K  7       // IBM PC 1.44MB
+#define DISK_OTHER  0x80    // other, density is found by flux
+
     // BYTE 0x05 is the number of revolutions, which is how many revolutions for each track is
     // contained in the image.
     uint8_t nr_revolutions;
@@ -186,14 +191,29 @@ typedef struct {
     scp_disk_header_t header;           /* disk image header */
     scp_track_header_t track;           /* current track header */
 
+    /* Contents of the whole file, mapped or read into memory. */
+    const uint8_t *map;
+    size_t mapsz;
+    int mapped;                         /* map is from mmap() */
+
+    /* Track headers, validated at open. */
+    scp_track_header_t tdh[TRACK_MAX];
+    uint8_t tdh_ok[TRACK_MAX];
+
+    /* Raw flux data of each revolution of current track,
+     * big endian 16-bit samples. */
+    const uint8_t *dat[REV_MAX];
+
+    unsigned int iter_ptr;              /* current sample index in dat[rev] */
+    unsigned int iter_limit;            /* number of samples in dat[rev] */
 
-    /* Raw track data. */
-    uint16_t *dat;
-    unsigned int datsz;
+    /* Flux intervals of one revolution, in nanoseconds. */
+    uint32_t *flux;
+    unsigned int fluxsz;                /* allocated size of flux[] */
 
-    unsigned int index_ptr[REV_MAX];    /* data offsets of each index */
-    unsigned int iter_ptr;              /* current index into dat[] */
-    unsigned int iter_limit;            /* next index offset */
+    /* Timing of MFM data, set by scp_set_density(). */
+    int density;                        /* MFM_DENSITY_xx */
+    int clock;                          /* halfbit, nsec */
 
 } scp_file_t;
 
@@ -202,10 +222,15 @@ void scp_close(scp_file_t *sf);
 int scp_select_track(scp_file_t *sf, unsigned int tracknr);
 void scp_reset(scp_file_t *sf);
 unsigned scp_next_flux(scp_file_t *sf, unsigned int data_rpm);
+unsigned scp_read_flux(scp_file_t *sf, unsigned int rev, const uint32_t **flux);
+unsigned scp_pll_bits(scp_file_t *sf, int rev);
+void scp_set_density(scp_file_t *sf);
 void scp_print_disk_header(scp_file_t *sf);
 void scp_print_track(scp_file_t *sf);
 void scp_generate_vcd(scp_file_t *sf, const char *name);
 void scp_decode_track(scp_file_t *sf, const char *name, int tn, int rev);
-void scp_write_mfm(const char *name, FILE *fout, int rev);
+void scp_write_mfm(const char *name, mfm_io_t *out, int rev);
+int scp_read_disk(mfm_disk_t *d, mfm_track_index_t *idx, const char *name,
+    int rev, int amiga);
 
 #endif /* __SCP_H__ */
@@ -0,0 +1,260 @@
+/*
+ * SCP output: flux synthesis from MFM tracks.
+ *
+ * Copyright (C) 2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "mfm.h"
+#include "scp.h"
+
+/*
+ * The file is written in one pass: a placeholder of the disk
+ * header, then every track as it comes, with one revolution.
+ * The header, with track offsets and checksum, is put in place
+ * at the end, so the output cannot be a pipe.
+ */
+#define SCP_HEADER      (16 + 4 * TRACK_MAX)    /* disk header size */
+#define SCP_TRACK       16                      /* track header size */
+#define SCP_VERSION     0x19
+
+static void put32(unsigned char *p, unsigned val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+/*
+ * Output in SCP format, set before the first track is written.
+ */
+void mfm_io_scp(mfm_io_t *io, int amiga)
+{
+    if (io->sout)
+        return;
+    if (io->mode == MFM_IO_STREAM && lseek(io->fd, 0, SEEK_CUR) < 0) {
+        fprintf(mfm_err, "SCP file cannot be written to a pipe, aborted.\n");
+        mfm_fail(MFM_ERR_ARG);
+    }
+    io->sout = calloc(1, sizeof(mfm_scp_t));
+    if (! io->sout) {
+        fprintf(mfm_err, "Out of memory, aborted.\n");
+        mfm_fail(MFM_ERR_NOMEM);
+    }
+    io->sout->amiga = amiga;
+}
+
+/*
+ * Store a flux interval as big endian 16-bit samples, in 25 nsec units.
+ * Longer intervals are prefixed with zero samples, each worth 0x10000.
+ * A remainder of zero would read as one more overflow, so it is
+ * shortened by one unit, and the unit is carried to the next interval.
+ */
+static inline unsigned char *put_flux(unsigned char *p, unsigned ticks,
+    unsigned *carry)
+{
+    ticks += *carry;
+    *carry = ((ticks & 0xffff) == 0);
+    ticks -= *carry;
+    while (ticks > 0xffff) {
+        p[0] = 0;
+        p[1] = 0;
+        p += 2;
+        ticks -= 0x10000;
+    }
+    p[0] = ticks >> 8;
+    p[1] = ticks;
+    return p + 2;
+}
+
+/*
+ * Flux of the track: every halfbit set is a transition.  The index
+ * is one halfbit ahead of the track, as the reader drops the first
+ * halfbit of a revolution (see scp_decode_mfm()).  One more halfbit
+ * after the track, the revolution ends with a transition, so that
+ * the last interval of the track data is complete.  Zero bytes are
+ * skipped whole, other bytes are scanned from one transition to the
+ * next.  Return the number of samples; the duration is in *duration.
+ */
+static unsigned track_flux(const unsigned char *track, int tracksz,
+    unsigned cell, unsigned char *out, unsigned *duration)
+{
+    unsigned char *p = out;
+    unsigned run = 1, carry = 0, b;
+    int i, left, zeros;
+
+    for (i=0; i<tracksz; ++i) {
+        b = track[i];
+        if (b == 0) {
+            run += 8;
+            continue;
+        }
+        left = 8;
+        do {
+            zeros = __builtin_clz(b) - 24;
+            run += zeros + 1;
+            p = put_flux(p, run * cell, &carry);
+            run = 0;
+            left -= zeros + 1;
+            b = (b << (zeros + 1)) & 0xff;
+        } while (b);
+        run = left;
+    }
+    p = put_flux(p, (run + 1) * cell, &carry);
+
+    *duration = (8 * tracksz + 2) * cell;
+    return (p - out) / 2;
+}
+
+/*
+ * Append a track: the track header and the flux of one revolution.
+ */
+static void add_track(mfm_io_t *io, const unsigned char *track, int tracksz)
+{
+    mfm_scp_t *s = io->sout;
+    unsigned cell = 2000 / 25 * TRACKSZ / tracksz;  /* halfbit, 25 nsec units */
+    unsigned nsamples, duration, size, i;
+    int stage;
+
+    if (s->ntracks >= MAXTRACK) {
+        fprintf(mfm_err, "Too many tracks = %d, aborted.\n", s->ntracks + 1);
+        mfm_fail(MFM_ERR_FORMAT);
+    }
+    if (s->ntracks == 0) {
+        /* Place for the disk header. */
+        memset(s->data, 0, SCP_HEADER);
+        mfm_io_output(io, s->data, SCP_HEADER);
+        s->pos = SCP_HEADER;
+    }
+
+    stage = mfm_stage(MFM_STAGE_ENCODE);
+    nsamples = track_flux(track, tracksz, cell, s->data + SCP_TRACK,
+        &duration);
+    mfm_stage(stage);
+
+    memcpy(s->data, "TRK", 3);
+    s->data[3] = s->ntracks;
+    put32(s->data + 4, duration);
+    put32(s->data + 8, nsamples);
+    put32(s->data + 12, SCP_TRACK);
+
+    size = SCP_TRACK + 2 * nsamples;
+    for (i=0; i<size; ++i)
+        s->sum += s->data[i];
+    mfm_io_output(io, s->data, size);
+    s->offset[s->ntracks++] = s->pos;
+    s->pos += size;
+}
+
+/*
+ * Write MFM data into SCP file: collect whole tracks.
+ */
+void mfm_scp_write(mfm_io_t *io, const unsigned char *buf, size_t nbytes)
+{
+    mfm_scp_t *s = io->sout;
+    size_t tracksz = io->tracksz, n;
+
+    while (nbytes > 0) {
+        if (s->fill == 0 && nbytes >= tracksz) {
+            /* Whole track, with no copy. */
+            add_track(io, buf, tracksz);
+            buf += tracksz;
+            nbytes -= tracksz;
+            continue;
+        }
+        n = tracksz - s->fill;
+        if (n > nbytes)
+            n = nbytes;
+        memcpy(s->track + s->fill, buf, n);
+        s->fill += n;
+        buf += n;
+        nbytes -= n;
+        if (s->fill == tracksz) {
+            add_track(io, s->track, tracksz);
+            s->fill = 0;
+        }
+    }
+}
+
+/*
+ * Finish the SCP file: a partial track is padded with zeros.
+ * Put the disk header at the start of file.  The checksum covers
+ * everything after the first 16 bytes: the track offsets and
+ * the tracks.
+ */
+void mfm_scp_finish(mfm_io_t *io)
+{
+    mfm_scp_t *s = io->sout;
+    int density = io->tracksz / TRACKSZ;
+    unsigned char *hdr;
+    unsigned sum;
+    int i;
+
+    if (s->fill > 0) {
+        memset(s->track + s->fill, 0, io->tracksz - s->fill);
+        add_track(io, s->track, io->tracksz);
+        s->fill = 0;
+    }
+    if (s->ntracks == 0) {
+        memset(s->data, 0, SCP_HEADER);
+        mfm_io_output(io, s->data, SCP_HEADER);
+    }
+
+    hdr = s->data;
+    memset(hdr, 0, SCP_HEADER);
+    memcpy(hdr, "SCP", 3);
+    hdr[3] = SCP_VERSION;
+    if (s->amiga)
+        hdr[4] = DISK_AMIGA;
+    else if (density == MFM_DENSITY_DD)
+        hdr[4] = DISK_720K;
+    else if (density == MFM_DENSITY_HD)
+        hdr[4] = DISK_1440K;
+    else
+        hdr[4] = DISK_OTHER;
+    hdr[5] = 1;
+    hdr[6] = 0;
+    hdr[7] = s->ntracks ? s->ntracks - 1 : 0;
+    hdr[8] = FLAG_INDEX;
+    hdr[9] = 0;
+    hdr[10] = SIDE_BOTH;
+    for (i=0; i<s->ntracks; ++i)
+        put32(hdr + 16 + 4*i, s->offset[i]);
+
+    sum = s->sum;
+    for (i=16; i<SCP_HEADER; ++i)
+        sum += hdr[i];
+    put32(hdr + 12, sum);
+    mfm_io_update(io, 0, 0, hdr, SCP_HEADER);
+}
+
+void mfm_scp_free(mfm_scp_t *s)
+{
+    free(s);
+}
@@ -0,0 +1,190 @@
+/*
+ * Statistics of conversions: time by stages and counters.
+ *
+ * Copyright (C) 2008-2018 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "mfm.h"
+
+__thread int mfm_stats_on;
+mfm_stats_t mfm_stats;
+
+static const char *stage_name [MFM_NSTAGES] = {
+    "other", "io", "pll", "scan", "decode", "crc", "encode",
+};
+
+/*
+ * Стадия, в которой находится поток, и когда он в неё вошёл.
+ * Время потока до первого переключения не учитывается.
+ */
+static __thread int cur_stage;
+static __thread int cur_started;
+static __thread unsigned long long cur_wall;
+static __thread unsigned long long cur_cpu;
+
+/*
+ * Процессорное время потока - системный вызов, поэтому читаем его
+ * только для стадий, которые длятся дорожку целиком. Короткие
+ * стадии внутри сектора не блокируются, для них процессорное
+ * время считаем равным реальному.
+ */
+static const char whole_track [MFM_NSTAGES] = {
+    0, 1, 1, 0, 0, 0, 1,
+};
+
+/*
+ * Время начала замера, для общего времени преобразования.
+ */
+static unsigned long long start_wall;
+static unsigned long long start_cpu;
+
+static unsigned long long clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Переход потока в другую стадию: время с прошлого перехода
+ * относим к прежней стадии. Возвращаем прежнюю стадию,
+ * чтобы вызывающий мог в неё вернуться. Стадии вложены,
+ * время каждой считается без вложенных.
+ * Реальное время прочей стадии не копим: в нём ожидание потоков
+ * (pthread_join, блокировки, очередь планировщика), которое
+ * при нескольких потоках многократно превышает общее время.
+ */
+int mfm_stage(int stage)
+{
+    unsigned long long wall, cpu = 0;
+    int prev = cur_stage;
+
+    if (! mfm_stats_on || stage == prev)
+        return prev;
+
+    wall = clock_ns(CLOCK_MONOTONIC);
+    if (whole_track[prev] || whole_track[stage])
+        cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (cur_started) {
+        if (prev != MFM_STAGE_OTHER)
+            __atomic_add_fetch(&mfm_stats.wall_ns[prev], wall - cur_wall,
+                __ATOMIC_RELAXED);
+        if (whole_track[prev])
+            __atomic_add_fetch(&mfm_stats.cpu_ns[prev], cpu - cur_cpu,
+                __ATOMIC_RELAXED);
+        else if (prev != MFM_STAGE_OTHER)
+            __atomic_add_fetch(&mfm_stats.cpu_ns[prev], wall - cur_wall,
+                __ATOMIC_RELAXED);
+    }
+    cur_started = 1;
+    cur_stage = stage;
+    cur_wall = wall;
+    cur_cpu = cpu;
+    return prev;
+}
+
+/*
+ * Начало замера: обнуляем статистику.
+ */
+void mfm_stats_reset(void)
+{
+    memset(&mfm_stats, 0, sizeof(mfm_stats));
+    cur_stage = MFM_STAGE_OTHER;
+    cur_started = 0;
+    start_wall = clock_ns(CLOCK_MONOTONIC);
+    start_cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/*
+ * Печать статистики, текстом или в формате JSON.
+ * Время стадий суммируется по всем потокам.
+ */
+void mfm_stats_print(FILE *f, int json)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } counter[] = {
+        { "bytes_read",     offsetof(mfm_stats_t, bytes_read) },
+        { "bytes_written",  offsetof(mfm_stats_t, bytes_written) },
+        { "tracks_read",    offsetof(mfm_stats_t, tracks_read) },
+        { "tracks_written", offsetof(mfm_stats_t, tracks_written) },
+        { "marks",          offsetof(mfm_stats_t, marks) },
+        { "header_errors",  offsetof(mfm_stats_t, header_errors) },
+        { "data_errors",    offsetof(mfm_stats_t, data_errors) },
+        { "missing",        offsetof(mfm_stats_t, missing) },
+        { "retries",        offsetof(mfm_stats_t, retries) },
+        { "cache_hits",     offsetof(mfm_stats_t, cache_hits) },
+        { "cache_misses",   offsetof(mfm_stats_t, cache_misses) },
+    };
+    double wall, cpu;
+    unsigned long long val, other;
+    int i;
+
+    /* Текущий отрезок относим к его стадии. */
+    i = mfm_stage(MFM_STAGE_OTHER);
+    mfm_stage(i);
+    wall = (clock_ns(CLOCK_MONOTONIC) - start_wall) / 1e9;
+    cpu = (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - start_cpu) / 1e9;
+
+    /* Прочее процессорное время - всё, что не попало в стадии.
+     * Реальное время прочей стадии считаем равным процессорному,
+     * без простоя потоков. */
+    other = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+    for (i = 1; i < MFM_NSTAGES; i++)
+        other -= (other > mfm_stats.cpu_ns[i]) ? mfm_stats.cpu_ns[i] : other;
+    mfm_stats.cpu_ns[MFM_STAGE_OTHER] = other;
+    mfm_stats.wall_ns[MFM_STAGE_OTHER] = other;
+
+    if (json) {
+        fprintf(f, "{ \"wall\": %.6f, \"cpu\": %.6f, \"stages\": {", wall, cpu);
+        for (i = 0; i < MFM_NSTAGES; i++)
+            fprintf(f, "%s \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }",
+                i ? "," : "", stage_name[i],
+                mfm_stats.wall_ns[i] / 1e9, mfm_stats.cpu_ns[i] / 1e9);
+        fprintf(f, " }");
+        for (i = 0; i < (int) (sizeof(counter) / sizeof(counter[0])); i++) {
+            val = *(unsigned long long*) ((char*) &mfm_stats + counter[i].offset);
+            fprintf(f, ", \"%s\": %llu", counter[i].name, val);
+        }
+        fprintf(f, " }\n");
+        return;
+    }
+
+    fprintf(f, "Total: %.3f msec wall, %.3f msec cpu\n", wall * 1e3, cpu * 1e3);
+    fprintf(f, "Stage    Wall, msec  CPU, msec\n");
+    for (i = 0; i < MFM_NSTAGES; i++)
+        fprintf(f, "%-8s %10.3f %10.3f\n", stage_name[i],
+            mfm_stats.wall_ns[i] / 1e6, mfm_stats.cpu_ns[i] / 1e6);
+    for (i = 0; i < (int) (sizeof(counter) / sizeof(counter[0])); i++) {
+        val = *(unsigned long long*) ((char*) &mfm_stats + counter[i].offset);
+        fprintf(f, "%-15s %llu\n", counter[i].name, val);
+    }
+}